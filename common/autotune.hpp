@@ -0,0 +1,375 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       autotune.hpp
+ *
+ * Purpose:    Search a space of -D macros and local work-group sizes for the
+ *             fastest configuration of a kernel, timing each candidate with
+ *             OpenCL events, and remember the winner per device and driver
+ *             in a tuning database for later runs
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *             The command queue used by the candidates must have profiling
+ *             enabled
+ *
+ * Usage:      util::Tuner tuner(device, "nbody", "n=4096");
+ *             tuner.addParameter("WGSIZE", values);       // -DWGSIZE=...
+ *             tuner.addParameter("LX", values, util::Tuner::LOCAL_SIZE);
+ *             tuner.addConstraint([&](const util::TuningConfig& c)
+ *                                 { return n % c.at("WGSIZE") == 0; });
+ *
+ *             util::TuningConfig config =
+ *               tuner.select(retune, defaults, [&](const util::TuningConfig& c)
+ *               {
+ *                 program = util::buildProgram(context, source,
+ *                                              tuner.options(c));
+ *                 ...
+ *                 return kernel(cl::EnqueueArgs(queue, global, local), ...);
+ *               });
+ *
+ *             select() returns the stored configuration if there is one,
+ *             otherwise the defaults, unless retune is set in which case
+ *             the whole space is searched and the result is stored.
+ *
+ *             The database is ".cltuning" in the working directory, or the
+ *             file named by the OCL_TUNING_DB environment variable.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __AUTOTUNE_HDR
+#define __AUTOTUNE_HDR
+
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+#include "err_code.h"
+#include "benchmark.hpp"
+
+namespace util {
+
+//! Parameter name -> value
+typedef std::map<std::string, unsigned> TuningConfig;
+
+//! Returns the path of the tuning database
+inline std::string getTuningDatabase()
+{
+    const char *file = getenv("OCL_TUNING_DB");
+    return (file && *file) ? file : ".cltuning";
+}
+
+class Tuner
+{
+public:
+    enum Kind
+    {
+        MACRO,      // passed to the compiler as -DNAME=value
+        LOCAL_SIZE  // a work-group dimension, only used by the caller
+    };
+
+private:
+    struct Parameter
+    {
+        std::string           name;
+        std::vector<unsigned> values;
+        Kind                  kind;
+    };
+
+    cl::Device                                            device_;
+    std::string                                           key_;
+    std::vector<Parameter>                                parameters_;
+    std::vector<std::function<bool(const TuningConfig&)> > constraints_;
+    unsigned                                              repetitions_;
+
+    // Database lines are: key <tab> seconds <tab> NAME=value,NAME=value
+    static std::vector<std::string> split(const std::string& str, char delim)
+    {
+        std::vector<std::string> fields;
+        std::stringstream stream(str);
+        std::string field;
+        while (std::getline(stream, field, delim))
+            fields.push_back(field);
+        return fields;
+    }
+
+    static std::string format(const TuningConfig& config, const char *sep)
+    {
+        std::stringstream str;
+        for (TuningConfig::const_iterator itr = config.begin();
+             itr != config.end(); itr++)
+        {
+            str << (itr == config.begin() ? "" : sep)
+                << itr->first << "=" << itr->second;
+        }
+        return str.str();
+    }
+
+    bool valid(const TuningConfig& config) const
+    {
+        size_t local = 1;
+        for (size_t p = 0; p < parameters_.size(); p++)
+        {
+            if (parameters_[p].kind == LOCAL_SIZE)
+                local *= config.at(parameters_[p].name);
+        }
+        if (local > device_.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+            return false;
+
+        for (size_t c = 0; c < constraints_.size(); c++)
+        {
+            if (!constraints_[c](config))
+                return false;
+        }
+        return true;
+    }
+
+    //! Enumerates every combination of parameter values
+    std::vector<TuningConfig> candidates() const
+    {
+        std::vector<TuningConfig> result(1);
+        for (size_t p = 0; p < parameters_.size(); p++)
+        {
+            std::vector<TuningConfig> next;
+            for (size_t c = 0; c < result.size(); c++)
+            {
+                for (size_t v = 0; v < parameters_[p].values.size(); v++)
+                {
+                    TuningConfig config = result[c];
+                    config[parameters_[p].name] = parameters_[p].values[v];
+                    next.push_back(config);
+                }
+            }
+            result.swap(next);
+        }
+        return result;
+    }
+
+public:
+    /*!
+     * \param kernel  Name of the tuned kernel
+     * \param problem Anything else the best configuration depends on,
+     *                such as the problem size
+     */
+    Tuner(const cl::Device& device, const std::string& kernel,
+          const std::string& problem = "")
+      : device_(device), repetitions_(3)
+    {
+        key_ = kernel + "|" + problem + "|" +
+               device.getInfo<CL_DEVICE_NAME>() + "|" +
+               device.getInfo<CL_DRIVER_VERSION>();
+        // Tabs and newlines would break the database format
+        for (size_t i = 0; i < key_.size(); i++)
+        {
+            if (key_[i] == '\t' || key_[i] == '\n')
+                key_[i] = ' ';
+        }
+    }
+
+    void addParameter(const std::string& name,
+                      const std::vector<unsigned>& values,
+                      Kind kind = MACRO)
+    {
+        Parameter parameter;
+        parameter.name   = name;
+        parameter.values = values;
+        parameter.kind   = kind;
+        parameters_.push_back(parameter);
+    }
+
+    //! Adds a test that a candidate must pass to be run
+    void addConstraint(std::function<bool(const TuningConfig&)> constraint)
+    {
+        constraints_.push_back(constraint);
+    }
+
+    //! Sets the number of timed runs per candidate (after one warmup)
+    void setRepetitions(unsigned repetitions) { repetitions_ = repetitions; }
+
+    //! Returns the build options that define the MACRO parameters
+    std::string options(const TuningConfig& config) const
+    {
+        std::stringstream str;
+        for (size_t p = 0; p < parameters_.size(); p++)
+        {
+            if (parameters_[p].kind == MACRO)
+                str << " -D" << parameters_[p].name << "="
+                    << config.at(parameters_[p].name);
+        }
+        return str.str();
+    }
+
+    //! Looks up the stored configuration for this kernel and device
+    bool load(TuningConfig& config) const
+    {
+        std::ifstream in(getTuningDatabase().c_str());
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::vector<std::string> fields = split(line, '\t');
+            if (fields.size() != 3 || fields[0] != key_)
+                continue;
+
+            TuningConfig stored;
+            std::vector<std::string> values = split(fields[2], ',');
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                size_t eq = values[i].find('=');
+                if (eq != std::string::npos)
+                    stored[values[i].substr(0, eq)] =
+                        strtoul(values[i].c_str() + eq + 1, NULL, 10);
+            }
+
+            // Ignore entries from an older parameter space
+            for (size_t p = 0; p < parameters_.size(); p++)
+            {
+                if (!stored.count(parameters_[p].name))
+                    return false;
+            }
+            config = stored;
+            return true;
+        }
+        return false;
+    }
+
+    //! Stores a configuration, replacing any previous entry
+    void save(const TuningConfig& config, double seconds) const
+    {
+        std::string file = getTuningDatabase();
+        std::vector<std::string> lines;
+        {
+            std::ifstream in(file.c_str());
+            std::string line;
+            while (std::getline(in, line))
+            {
+                if (line.compare(0, key_.size() + 1, key_ + "\t"))
+                    lines.push_back(line);
+            }
+        }
+
+        std::stringstream entry;
+        entry << key_ << "\t" << std::scientific << std::setprecision(6)
+              << seconds << "\t" << format(config, ",");
+        lines.push_back(entry.str());
+
+        // A temporary file per process, so concurrent tuning jobs never
+        // write over each other's partial database
+        std::stringstream name;
+#if defined(_WIN32)
+        name << file << "." << GetCurrentProcessId() << ".tmp";
+#else
+        name << file << "." << getpid() << ".tmp";
+#endif
+        std::string tmp = name.str();
+        std::ofstream out(tmp.c_str());
+        for (size_t i = 0; i < lines.size(); i++)
+            out << lines[i] << std::endl;
+        out.close();
+        if (!out || rename(tmp.c_str(), file.c_str()))
+        {
+            remove(tmp.c_str());
+            std::cout << "Cannot write tuning database: " << file << std::endl;
+        }
+    }
+
+    /*!
+     * \brief Times every valid candidate and stores the fastest.
+     *
+     * run is called once per repetition and returns the event of the
+     * command to time. Candidates that fail to build or launch are skipped.
+     * \returns false if no candidate ran successfully
+     */
+    bool tune(std::function<cl::Event(const TuningConfig&)> run,
+              TuningConfig& best)
+    {
+        bool   found    = false;
+        double bestTime = 0;
+        std::vector<TuningConfig> space = candidates();
+
+        std::ios::fmtflags flags = std::cout.flags();
+        std::streamsize precision = std::cout.precision();
+        std::cout << "Tuning " << key_.substr(0, key_.find('|'))
+                  << " (" << space.size() << " candidates)" << std::endl;
+        for (size_t c = 0; c < space.size(); c++)
+        {
+            if (!valid(space[c]))
+                continue;
+
+            std::cout << "  " << std::left << std::setw(32)
+                      << format(space[c], " ") << std::right;
+            try
+            {
+                run(space[c]).wait();
+
+                std::vector<double> samples;
+                for (unsigned r = 0; r < repetitions_; r++)
+                {
+                    cl::Event event = run(space[c]);
+                    event.wait();
+                    samples.push_back(
+                        (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                         event.getProfilingInfo<CL_PROFILING_COMMAND_START>())
+                        * 1e-9);
+                }
+                double time = computeStatistics(samples).median;
+                std::cout << std::fixed << std::setprecision(3)
+                          << time*1e3 << " ms" << std::endl;
+
+                if (!found || time < bestTime)
+                {
+                    found    = true;
+                    best     = space[c];
+                    bestTime = time;
+                }
+            }
+            catch (cl::Error err)
+            {
+                std::cout << "failed (" << err_code(err.err()) << ")"
+                          << std::endl;
+            }
+        }
+
+        std::cout.flags(flags);
+        std::cout.precision(precision);
+        if (!found)
+            return false;
+
+        std::cout << "Best: " << format(best, " ") << std::endl << std::endl;
+        save(best, bestTime);
+        return true;
+    }
+
+    /*!
+     * \brief Returns the configuration to use: a freshly tuned one when
+     * retune is set, else the stored one, else the defaults.
+     */
+    TuningConfig select(bool retune, const TuningConfig& defaults,
+                        std::function<cl::Event(const TuningConfig&)> run)
+    {
+        TuningConfig config;
+        if (retune && tune(run, config))
+            return config;
+        if (!retune && load(config))
+            return config;
+        return defaults;
+    }
+};
+
+} // namespace util
+
+#endif // __AUTOTUNE_HDR
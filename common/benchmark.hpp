@@ -0,0 +1,360 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       benchmark.hpp
+ *
+ * Purpose:    Statistical benchmark harness: runs a timed region for a number
+ *             of warmup and measured repetitions and reports min, median,
+ *             95th percentile and standard deviation along with derived
+ *             throughput, as a text table, CSV or JSON
+ *
+ * Usage:      util::BenchmarkOptions options;
+ *             ... parseBenchmarkArgument(argc, argv, i, options) ...
+ *             util::Benchmark bench(options);
+ *             bench.run("kernel", [&]{ kernel(...); queue.finish(); },
+ *                       flops*1e-9, "GFLOP/s");
+ *             bench.report();
+ *
+ *             The timed function must not return until its work is
+ *             complete (i.e. it should finish the command queue).
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __BENCHMARK_HDR
+#define __BENCHMARK_HDR
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+namespace util {
+
+struct BenchmarkOptions
+{
+    unsigned    warmup;      // untimed repetitions run before measuring
+    unsigned    repetitions; // timed repetitions
+    std::string format;      // "text", "csv" or "json"
+    std::string output;      // file to write the report to (default stdout)
+
+    BenchmarkOptions() : warmup(1), repetitions(5), format("text") {}
+};
+
+struct Statistics
+{
+    unsigned count;
+    double   min, max, mean, median, p95, stddev;
+};
+
+struct BenchmarkResult
+{
+    std::string name;
+    Statistics  stats;       // seconds per repetition
+    double      work;        // units of work per repetition
+    std::string unit;        // throughput unit, e.g. "GFLOP/s"
+
+    //! Throughput at the median time (0 if no work was given)
+    double throughput() const
+    {
+        return (work > 0 && stats.median > 0) ? work / stats.median : 0;
+    }
+
+    //! Throughput at the fastest time
+    double peakThroughput() const
+    {
+        return (work > 0 && stats.min > 0) ? work / stats.min : 0;
+    }
+};
+
+/*!
+ * \brief Computes summary statistics of a set of samples.
+ * The 95th percentile uses the nearest-rank method.
+ */
+inline Statistics computeStatistics(std::vector<double> samples)
+{
+    Statistics s = {0, 0, 0, 0, 0, 0, 0};
+    s.count = samples.size();
+    if (samples.empty())
+        return s;
+
+    std::sort(samples.begin(), samples.end());
+    s.min = samples.front();
+    s.max = samples.back();
+
+    double sum = 0;
+    for (size_t i = 0; i < samples.size(); i++)
+        sum += samples[i];
+    s.mean = sum / samples.size();
+
+    size_t mid = samples.size() / 2;
+    s.median = (samples.size() % 2) ? samples[mid]
+                                    : 0.5 * (samples[mid-1] + samples[mid]);
+
+    size_t rank = (size_t)std::ceil(0.95 * samples.size());
+    s.p95 = samples[std::max<size_t>(rank, 1) - 1];
+
+    if (samples.size() > 1)
+    {
+        double var = 0;
+        for (size_t i = 0; i < samples.size(); i++)
+            var += (samples[i] - s.mean) * (samples[i] - s.mean);
+        s.stddev = std::sqrt(var / (samples.size() - 1));
+    }
+
+    return s;
+}
+
+/*!
+ * \brief Parses a harness option at argv[i], advancing i past its value.
+ * \returns true if the argument was recognised.
+ */
+inline bool parseBenchmarkArgument(int argc, char *argv[], int& i,
+                                   BenchmarkOptions& options)
+{
+    if (!strcmp(argv[i], "--warmup") || !strcmp(argv[i], "--reps"))
+    {
+        bool warmup = !strcmp(argv[i], "--warmup");
+        char *next = NULL;
+        unsigned long value = 0;
+        if (++i < argc)
+            value = strtoul(argv[i], &next, 10);
+        if (!next || next == argv[i] || strlen(next) || (!warmup && !value))
+        {
+            std::cout << "Invalid number of "
+                      << (warmup ? "warmup repetitions" : "repetitions")
+                      << std::endl;
+            exit(1);
+        }
+        if (warmup)
+            options.warmup = value;
+        else
+            options.repetitions = value;
+        return true;
+    }
+    else if (!strcmp(argv[i], "--format"))
+    {
+        if (++i >= argc || (strcmp(argv[i], "text") &&
+                            strcmp(argv[i], "csv")  &&
+                            strcmp(argv[i], "json")))
+        {
+            std::cout << "Invalid format (expected text, csv or json)"
+                      << std::endl;
+            exit(1);
+        }
+        options.format = argv[i];
+        return true;
+    }
+    else if (!strcmp(argv[i], "--bench-output"))
+    {
+        if (++i >= argc)
+        {
+            std::cout << "Missing argument to --bench-output" << std::endl;
+            exit(1);
+        }
+        options.output = argv[i];
+        return true;
+    }
+    return false;
+}
+
+//! Prints the help text for the harness options
+inline void printBenchmarkUsage()
+{
+    std::cout << "      --warmup     N       Untimed warmup repetitions" << std::endl;
+    std::cout << "      --reps       N       Timed benchmark repetitions" << std::endl;
+    std::cout << "      --format     FMT     Report format (text, csv, json)" << std::endl;
+    std::cout << "      --bench-output FILE  Write benchmark report to FILE" << std::endl;
+}
+
+class Benchmark
+{
+private:
+    BenchmarkOptions             options_;
+    std::vector<BenchmarkResult> results_;
+
+    static std::string escape(const std::string& str)
+    {
+        std::string out;
+        for (size_t i = 0; i < str.size(); i++)
+        {
+            if (str[i] == '"' || str[i] == '\\')
+                out += '\\';
+            out += str[i];
+        }
+        return out;
+    }
+
+    void writeText(std::ostream& out) const
+    {
+        out << std::endl << std::fixed << std::setprecision(3)
+            << std::left << std::setw(28) << "Benchmark" << std::right
+            << std::setw(6)  << "Reps"
+            << std::setw(12) << "Min(ms)"
+            << std::setw(12) << "Median(ms)"
+            << std::setw(12) << "P95(ms)"
+            << std::setw(12) << "Stddev(ms)"
+            << "   Throughput" << std::endl;
+        for (size_t i = 0; i < results_.size(); i++)
+        {
+            const BenchmarkResult& r = results_[i];
+            out << std::left << std::setw(28) << r.name << std::right
+                << std::setw(6)  << r.stats.count
+                << std::setw(12) << r.stats.min*1e3
+                << std::setw(12) << r.stats.median*1e3
+                << std::setw(12) << r.stats.p95*1e3
+                << std::setw(12) << r.stats.stddev*1e3;
+            if (r.work > 0)
+                out << "   " << r.throughput() << " " << r.unit;
+            out << std::endl;
+        }
+        out << std::endl;
+    }
+
+    void writeCSV(std::ostream& out) const
+    {
+        out << "name,reps,warmup,min_s,median_s,p95_s,mean_s,max_s,stddev_s,"
+               "throughput,peak_throughput,unit" << std::endl;
+        out << std::scientific << std::setprecision(6);
+        for (size_t i = 0; i < results_.size(); i++)
+        {
+            const BenchmarkResult& r = results_[i];
+            out << "\"" << escape(r.name) << "\","
+                << r.stats.count << "," << options_.warmup << ","
+                << r.stats.min << "," << r.stats.median << ","
+                << r.stats.p95 << "," << r.stats.mean << ","
+                << r.stats.max << "," << r.stats.stddev << ","
+                << r.throughput() << "," << r.peakThroughput() << ","
+                << r.unit << std::endl;
+        }
+    }
+
+    void writeJSON(std::ostream& out) const
+    {
+        out << std::scientific << std::setprecision(6);
+        out << "{\"warmup\": " << options_.warmup << ", \"benchmarks\": [";
+        for (size_t i = 0; i < results_.size(); i++)
+        {
+            const BenchmarkResult& r = results_[i];
+            out << (i ? "," : "") << std::endl
+                << "  {\"name\": \"" << escape(r.name) << "\""
+                << ", \"reps\": "      << r.stats.count
+                << ", \"min_s\": "     << r.stats.min
+                << ", \"median_s\": "  << r.stats.median
+                << ", \"p95_s\": "     << r.stats.p95
+                << ", \"mean_s\": "    << r.stats.mean
+                << ", \"max_s\": "     << r.stats.max
+                << ", \"stddev_s\": "  << r.stats.stddev
+                << ", \"throughput\": " << r.throughput()
+                << ", \"peak_throughput\": " << r.peakThroughput()
+                << ", \"unit\": \""    << escape(r.unit) << "\"}";
+        }
+        out << std::endl << "]}" << std::endl;
+    }
+
+public:
+    Benchmark(const BenchmarkOptions& options = BenchmarkOptions())
+      : options_(options)
+    {
+    }
+
+    const BenchmarkOptions& options() const { return options_; }
+    const std::vector<BenchmarkResult>& results() const { return results_; }
+
+    /*!
+     * \brief Runs fn for the configured warmup and timed repetitions.
+     * \param work  Units of work done by one call, e.g. GFLOPs (optional)
+     * \param unit  Throughput unit to report work/second in
+     * \param setup Untimed function called before every repetition
+     */
+    BenchmarkResult run(const std::string& name,
+                        std::function<void()> fn,
+                        double work = 0,
+                        const std::string& unit = "",
+                        std::function<void()> setup = nullptr)
+    {
+        for (unsigned i = 0; i < options_.warmup; i++)
+        {
+            if (setup)
+                setup();
+            fn();
+        }
+
+        std::vector<double> samples;
+        Timer timer;
+        for (unsigned i = 0; i < options_.repetitions; i++)
+        {
+            if (setup)
+                setup();
+            uint64_t start = timer.getTimeNanoseconds();
+            fn();
+            samples.push_back((timer.getTimeNanoseconds() - start) * 1e-9);
+        }
+
+        return record(name, samples, work, unit);
+    }
+
+    /*!
+     * \brief Records samples (in seconds) timed by some other means,
+     * such as OpenCL profiling events.
+     */
+    BenchmarkResult record(const std::string& name,
+                           const std::vector<double>& samples,
+                           double work = 0,
+                           const std::string& unit = "")
+    {
+        BenchmarkResult result;
+        result.name  = name;
+        result.stats = computeStatistics(samples);
+        result.work  = work;
+        result.unit  = unit;
+        results_.push_back(result);
+        return result;
+    }
+
+    //! Writes all results in the configured format
+    void report() const
+    {
+        std::ofstream file;
+        if (!options_.output.empty())
+        {
+            file.open(options_.output.c_str());
+            if (!file.is_open())
+            {
+                std::cout << "Cannot open file: " << options_.output << std::endl;
+                return;
+            }
+        }
+        std::ostream& out = file.is_open() ? file : std::cout;
+
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        if (options_.format == "csv")
+            writeCSV(out);
+        else if (options_.format == "json")
+            writeJSON(out);
+        else
+            writeText(out);
+        out.flags(flags);
+        out.precision(precision);
+    }
+};
+
+} // namespace util
+
+#endif // __BENCHMARK_HDR
@@ -7,6 +7,13 @@
  * Note:       Must be included AFTER the relevant OpenCL header
  *             See one of the Matrix Multiply exercises for usage
  *
+ *             "--device auto" orders the device list fastest first, using
+ *             the profiles measured by "deviceinfo --profile" when every
+ *             device has one and compute units x clock otherwise.
+ *             "--device-type" and "--require" (or the deviceType and
+ *             requiredExtensions globals, set by the program) filter the
+ *             list before indices are assigned.
+ *
  * HISTORY:    Method written by James Price, October 2014
  *             Extracted to a common header by Tom Deakin, November 2014
  */
@@ -24,6 +31,7 @@
 #pragma once
 
 #include <err_code.h>
+#include <util.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,7 +43,105 @@
 #define MAX_PLATFORMS     8
 #define MAX_DEVICES      16
 #define MAX_INFO_STRING 256
+#define MAX_EXTENSIONS    8
+
+// Filters and ordering applied by getDeviceList()
+cl_device_type deviceType = CL_DEVICE_TYPE_ALL;
+const char    *requiredExtensions[MAX_EXTENSIONS];
+unsigned       numRequiredExtensions = 0;
+int            rankDevices = 0;
+
+// Reads the measured global memory bandwidth (GB/s) and FP32 GFLOP/s of a
+// device from the profile written by "deviceinfo --profile"
+// Returns 0 if the device has not been profiled
+int loadDeviceProfile(cl_device_id device, double *bandwidth, double *fp32)
+{
+  char name[MAX_INFO_STRING], driver[MAX_INFO_STRING];
+  clGetDeviceInfo(device, CL_DEVICE_NAME, MAX_INFO_STRING, name, NULL);
+  clGetDeviceInfo(device, CL_DRIVER_VERSION, MAX_INFO_STRING, driver, NULL);
+
+  // Same location and key as device_profile.hpp
+  char dir[1024];
+  const char *env = getenv("OCL_PROFILE_DIR");
+  if (env && *env)
+    snprintf(dir, sizeof(dir), "%s", env);
+  else
+  {
+#if defined(_WIN32)
+    const char *home = getenv("USERPROFILE");
+#else
+    const char *home = getenv("HOME");
+#endif
+    snprintf(dir, sizeof(dir), "%s/.clprofile", home ? home : ".");
+  }
+
+  unsigned long long hash = 14695981039346656037ULL;
+  hash = hashBytes(name, strlen(name), hash);
+  hash = hashBytes("\n", 1, hash);
+  hash = hashBytes(driver, strlen(driver), hash);
+
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/%016llx.profile", dir, hash);
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return 0;
+
+  int matched = 0;
+  char line[1024];
+  *bandwidth = *fp32 = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    line[strcspn(line, "\r\n")] = 0;
+    if (!strncmp(line, "name ", 5))
+      matched += !strcmp(line+5, name);
+    else if (!strncmp(line, "driver ", 7))
+      matched += !strcmp(line+7, driver);
+    else if (!strncmp(line, "global_bandwidth ", 17))
+      *bandwidth = strtod(line+17, NULL);
+    else if (!strncmp(line, "fp32 ", 5))
+      *fp32 = strtod(line+5, NULL);
+  }
+  fclose(file);
+
+  return matched == 2 && *bandwidth > 0 && *fp32 > 0;
+}
+
+// Estimates relative device performance (see device_picker.hpp)
+// The measured score is bandwidth x FLOP/s, which orders devices the same
+// way as their geometric mean; it is 0 if the device has not been profiled
+double getDeviceScore(cl_device_id device, int measured)
+{
+  if (measured)
+  {
+    double bandwidth, fp32;
+    if (!loadDeviceProfile(device, &bandwidth, &fp32))
+      return 0;
+    return bandwidth * fp32;
+  }
+
+  cl_uint computeUnits, clock;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock, NULL);
+  return (double)computeUnits * clock;
+}
 
+// Returns 1 if name is one of the space separated extensions, so that
+// cl_khr_fp does not match cl_khr_fp16 or cl_khr_fp64
+int hasExtension(const char *extensions, const char *name)
+{
+  size_t len = strlen(name);
+  const char *p = extensions;
+  while (*p)
+  {
+    while (*p == ' ')
+      p++;
+    size_t tokenLen = strcspn(p, " ");
+    if (tokenLen && tokenLen == len && !strncmp(p, name, len))
+      return 1;
+    p += tokenLen;
+  }
+  return 0;
+}
 
 unsigned getDeviceList(cl_device_id devices[MAX_DEVICES])
 {
@@ -49,13 +155,69 @@ unsigned getDeviceList(cl_device_id devices[MAX_DEVICES])
 
   // Enumerate devices
   unsigned numDevices = 0;
-  for (int i = 0; i < numPlatforms; i++)
+  for (unsigned i = 0; i < numPlatforms; i++)
   {
     cl_uint num = 0;
+    cl_device_id found[MAX_DEVICES];
     err = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL,
-                         MAX_DEVICES-numDevices, devices+numDevices, &num);
+                         MAX_DEVICES-numDevices, found, &num);
     checkError(err, "getting deviceS");
-    numDevices += num;
+
+    for (unsigned d = 0; d < num; d++)
+    {
+      cl_device_type type;
+      clGetDeviceInfo(found[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+      if (!(type & deviceType))
+        continue;
+
+      // The extension string can be long, so ask for its size first
+      size_t size = 0;
+      char *extensions = NULL;
+      if (clGetDeviceInfo(found[d], CL_DEVICE_EXTENSIONS, 0, NULL, &size) == CL_SUCCESS)
+        extensions = (char *)calloc(size + 1, 1);
+      if (extensions &&
+          clGetDeviceInfo(found[d], CL_DEVICE_EXTENSIONS, size, extensions, NULL) != CL_SUCCESS)
+        extensions[0] = '\0';
+
+      int supported = 1;
+      for (unsigned e = 0; e < numRequiredExtensions; e++)
+      {
+        if (!extensions || !hasExtension(extensions, requiredExtensions[e]))
+          supported = 0;
+      }
+      free(extensions);
+      if (supported)
+        devices[numDevices++] = found[d];
+    }
+  }
+
+  if (rankDevices && numDevices > 1)
+  {
+    // Only compare measured scores if every device has been profiled
+    int measured = 1;
+    for (unsigned d = 0; d < numDevices; d++)
+    {
+      if (getDeviceScore(devices[d], 1) <= 0)
+        measured = 0;
+    }
+
+    // Insertion sort, fastest first, keeping enumeration order for ties
+    double scores[MAX_DEVICES];
+    for (unsigned d = 0; d < numDevices; d++)
+      scores[d] = getDeviceScore(devices[d], measured);
+    for (unsigned d = 1; d < numDevices; d++)
+    {
+      cl_device_id device = devices[d];
+      double score = scores[d];
+      unsigned j = d;
+      for (; j > 0 && scores[j-1] < score; j--)
+      {
+        devices[j] = devices[j-1];
+        scores[j]  = scores[j-1];
+      }
+      devices[j] = device;
+      scores[j]  = score;
+    }
   }
 
   return numDevices;
@@ -82,6 +244,62 @@ int parseUInt(const char *str, cl_uint *output)
   return !strlen(next);
 }
 
+// Parses a device selection option at argv[*i], advancing *i past its value
+// Returns 1 if the argument was recognised
+int parseDeviceArgument(int argc, char *argv[], int *i, cl_uint *deviceIndex)
+{
+  if (!strcmp(argv[*i], "--device"))
+  {
+    if (++*i < argc && !strcmp(argv[*i], "auto"))
+    {
+      // The fastest device is first in the ranked list
+      rankDevices = 1;
+      *deviceIndex = 0;
+    }
+    else if (*i >= argc || !parseUInt(argv[*i], deviceIndex))
+    {
+      printf("Invalid device index\n");
+      exit(1);
+    }
+    return 1;
+  }
+  else if (!strcmp(argv[*i], "--device-type"))
+  {
+    ++*i;
+    if (*i < argc && !strcmp(argv[*i], "cpu"))
+      deviceType = CL_DEVICE_TYPE_CPU;
+    else if (*i < argc && !strcmp(argv[*i], "gpu"))
+      deviceType = CL_DEVICE_TYPE_GPU;
+    else if (*i < argc && !strcmp(argv[*i], "accelerator"))
+      deviceType = CL_DEVICE_TYPE_ACCELERATOR;
+    else
+    {
+      printf("Invalid device type (expected cpu, gpu or accelerator)\n");
+      exit(1);
+    }
+    return 1;
+  }
+  else if (!strcmp(argv[*i], "--require"))
+  {
+    if (++*i >= argc || numRequiredExtensions >= MAX_EXTENSIONS)
+    {
+      printf("Invalid argument to --require\n");
+      exit(1);
+    }
+    requiredExtensions[numRequiredExtensions++] = argv[*i];
+    return 1;
+  }
+  return 0;
+}
+
+// Prints the help text for the device selection options
+void printDeviceUsage()
+{
+  printf("      --device     INDEX   Select device at INDEX, or 'auto' for the fastest\n");
+  printf("      --device-type TYPE   Only use cpu, gpu or accelerator devices\n");
+  printf("      --require    EXT     Only use devices supporting extension EXT\n");
+}
+
 void parseArgumentsGeneric(int argc, char *argv[], cl_uint *deviceIndex)
 {
   for (int i = 1; i < argc; i++)
@@ -100,23 +318,19 @@ void parseArgumentsGeneric(int argc, char *argv[], cl_uint *deviceIndex)
       else
       {
         printf("\nDevices:\n");
-        for (int i = 0; i < numDevices; i++)
+        for (unsigned i = 0; i < numDevices; i++)
         {
           char name[MAX_INFO_STRING];
           getDeviceName(devices[i], name);
-          printf("%2d: %s\n", i, name);
+          printf("%2u: %s\n", i, name);
         }
         printf("\n");
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, &i, deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], deviceIndex))
-      {
-        printf("Invalid device index\n");
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
@@ -125,7 +339,7 @@ void parseArgumentsGeneric(int argc, char *argv[], cl_uint *deviceIndex)
       printf("Options:\n");
       printf("  -h  --help               Print this message\n");
       printf("      --list               List available devices\n");
-      printf("      --device     INDEX   Select device at INDEX\n");
+      printDeviceUsage();
       printf("\n");
       exit(0);
     }
@@ -7,6 +7,23 @@
  * Note:       Must be included AFTER the relevant OpenCL header
  *             See one of the Matrix Multiply exercises for usage
  *
+ *             "--device auto" orders the device list fastest first, using
+ *             the profiles measured by "deviceinfo --profile" when every
+ *             device has one and compute units x clock otherwise.
+ *             "--device-type" and "--require" (or deviceSelection, set by
+ *             the program) filter the list before indices are assigned.
+ *
+ *             "--devices 0,2,3" selects several devices. Use
+ *             getSelectedDevices() and createDeviceQueues() to get a queue
+ *             for each, and partitionWork() to split an NDRange between them.
+ *             Programs that do so set deviceSelection.multiDevice before
+ *             parsing their arguments; the others reject "--devices" and
+ *             "--partition".
+ *             "--partition numa|equally:N|by-counts:A,B,..." splits each
+ *             selected device into sub-devices (e.g. one per socket of a
+ *             CPU), which getSelectedDevices() returns in its place.
+ *             firstTouch() places a buffer's pages near its sub-device.
+ *
  * HISTORY:    Method written by James Price, October 2014
  *             Extracted to a common header by Tom Deakin, November 2014
  */
@@ -23,9 +40,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <err_code.h>
 #include <iostream>
+#include <device_profile.hpp>
 
 #ifndef CL_DEVICE_BOARD_NAME_AMD
 #define CL_DEVICE_BOARD_NAME_AMD 0x4038
@@ -34,6 +57,56 @@
 #define MAX_INFO_STRING 256
 
 
+// Filters and ordering applied by getDeviceList()
+struct DeviceSelection
+{
+  cl_device_type           type;       // only devices of this type
+  std::vector<std::string> extensions; // only devices with all of these
+  bool                     rank;       // order fastest first
+  std::vector<cl_uint>     indices;    // devices chosen with --devices
+  std::vector<cl_device_partition_property> partition; // clCreateSubDevices
+                                                       // properties, or empty
+  bool                     multiDevice; // program uses getSelectedDevices()
+};
+
+DeviceSelection deviceSelection = {CL_DEVICE_TYPE_ALL, std::vector<std::string>(), false,
+                                   std::vector<cl_uint>(),
+                                   std::vector<cl_device_partition_property>(),
+                                   false};
+
+// Estimates relative device performance. The measured score is the
+// geometric mean of global memory bandwidth and FP32 FLOP/s, so that
+// neither dominates; it is 0 if the device has not been profiled.
+double getDeviceScore(const cl::Device& device, bool measured)
+{
+  if (measured)
+  {
+    util::DeviceProfile profile;
+    if (!util::loadDeviceProfile(device, profile))
+      return 0;
+    return std::sqrt(profile.globalBandwidth * profile.fp32);
+  }
+
+  return (double)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+         device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+}
+
+// Returns the relative speed of each device, from measured scores if every
+// device has been profiled and from estimated scores otherwise
+std::vector<double> getDeviceWeights(const std::vector<cl::Device>& devices)
+{
+  std::vector<double> weights;
+  for (unsigned int d = 0; d < devices.size(); d++)
+    weights.push_back(getDeviceScore(devices[d], true));
+
+  if (std::find(weights.begin(), weights.end(), 0.0) != weights.end())
+  {
+    for (unsigned int d = 0; d < devices.size(); d++)
+      weights[d] = getDeviceScore(devices[d], false);
+  }
+  return weights;
+}
+
 unsigned getDeviceList(std::vector<cl::Device>& devices)
 {
   // Get list of platforms
@@ -45,7 +118,35 @@ unsigned getDeviceList(std::vector<cl::Device>& devices)
   {
     std::vector<cl::Device> plat_devices;
     platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &plat_devices);
-    devices.insert(devices.end(), plat_devices.begin(), plat_devices.end());
+    for (unsigned int d = 0; d < plat_devices.size(); d++)
+    {
+      if (!(plat_devices[d].getInfo<CL_DEVICE_TYPE>() & deviceSelection.type))
+        continue;
+
+      std::string extensions = plat_devices[d].getInfo<CL_DEVICE_EXTENSIONS>();
+      bool supported = true;
+      for (unsigned int e = 0; e < deviceSelection.extensions.size(); e++)
+      {
+        if (!util::hasExtension(extensions, deviceSelection.extensions[e]))
+          supported = false;
+      }
+      if (supported)
+        devices.push_back(plat_devices[d]);
+    }
+  }
+
+  if (deviceSelection.rank && devices.size() > 1)
+  {
+    std::vector<double> weights = getDeviceWeights(devices);
+    std::vector<std::pair<double, unsigned> > scores;
+    for (unsigned int d = 0; d < devices.size(); d++)
+      scores.push_back(std::make_pair(-weights[d], d));
+    std::stable_sort(scores.begin(), scores.end());
+
+    std::vector<cl::Device> ranked;
+    for (unsigned int d = 0; d < scores.size(); d++)
+      ranked.push_back(devices[scores[d].second]);
+    devices.swap(ranked);
   }
 
   return devices.size();
@@ -75,6 +176,154 @@ int parseUInt(const char *str, cl_uint *output)
   return !strlen(next);
 }
 
+// Parses a comma separated list of device indices, e.g. "0,2,3"
+int parseUIntList(const char *str, std::vector<cl_uint>& output)
+{
+  std::stringstream stream(str);
+  std::string item;
+  output.clear();
+  while (std::getline(stream, item, ','))
+  {
+    cl_uint value;
+    if (item.empty() || !parseUInt(item.c_str(), &value))
+      return 0;
+    output.push_back(value);
+  }
+  return !output.empty();
+}
+
+// Parses a --partition scheme into clCreateSubDevices properties
+int parsePartition(const char *str, std::vector<cl_device_partition_property>& output)
+{
+  std::vector<cl_uint> counts;
+  output.clear();
+  if (!strcmp(str, "numa"))
+  {
+    output.push_back(CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN);
+    output.push_back(CL_DEVICE_AFFINITY_DOMAIN_NUMA);
+  }
+  else if (!strncmp(str, "equally:", 8))
+  {
+    if (!parseUIntList(str + 8, counts) || counts.size() != 1 || !counts[0])
+      return 0;
+    output.push_back(CL_DEVICE_PARTITION_EQUALLY);
+    output.push_back(counts[0]);
+  }
+  else if (!strncmp(str, "by-counts:", 10))
+  {
+    if (!parseUIntList(str + 10, counts))
+      return 0;
+    output.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+    for (unsigned int c = 0; c < counts.size(); c++)
+      output.push_back(counts[c]);
+    output.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+  }
+  else
+  {
+    return 0;
+  }
+  output.push_back(0);
+  return 1;
+}
+
+// Parses a device selection option at argv[i], advancing i past its value.
+// Returns true if the argument was recognised.
+bool parseDeviceArgument(int argc, char *argv[], int& i, cl_uint *deviceIndex)
+{
+  if (!strcmp(argv[i], "--device"))
+  {
+    if (++i < argc && !strcmp(argv[i], "auto"))
+    {
+      // The fastest device is first in the ranked list
+      deviceSelection.rank = true;
+      *deviceIndex = 0;
+    }
+    else if (i >= argc || !parseUInt(argv[i], deviceIndex))
+    {
+      std::cout << "Invalid device index\n";
+      exit(1);
+    }
+    return true;
+  }
+  else if (!strcmp(argv[i], "--devices"))
+  {
+    if (!deviceSelection.multiDevice)
+    {
+      std::cout << "This program only runs on one device (use --device)\n";
+      exit(1);
+    }
+    if (++i >= argc || !parseUIntList(argv[i], deviceSelection.indices))
+    {
+      std::cout << "Invalid device list\n";
+      exit(1);
+    }
+
+    // A repeated device would get two contexts and two slices of the work
+    std::vector<cl_uint> sorted = deviceSelection.indices;
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+    {
+      std::cout << "Invalid device list (repeated device)\n";
+      exit(1);
+    }
+    return true;
+  }
+  else if (!strcmp(argv[i], "--partition"))
+  {
+    if (!deviceSelection.multiDevice)
+    {
+      std::cout << "This program does not support sub-devices\n";
+      exit(1);
+    }
+    if (++i >= argc || !parsePartition(argv[i], deviceSelection.partition))
+    {
+      std::cout << "Invalid partition (expected numa, equally:N or by-counts:A,B,...)\n";
+      exit(1);
+    }
+    return true;
+  }
+  else if (!strcmp(argv[i], "--device-type"))
+  {
+    ++i;
+    if (i < argc && !strcmp(argv[i], "cpu"))
+      deviceSelection.type = CL_DEVICE_TYPE_CPU;
+    else if (i < argc && !strcmp(argv[i], "gpu"))
+      deviceSelection.type = CL_DEVICE_TYPE_GPU;
+    else if (i < argc && !strcmp(argv[i], "accelerator"))
+      deviceSelection.type = CL_DEVICE_TYPE_ACCELERATOR;
+    else
+    {
+      std::cout << "Invalid device type (expected cpu, gpu or accelerator)\n";
+      exit(1);
+    }
+    return true;
+  }
+  else if (!strcmp(argv[i], "--require"))
+  {
+    if (++i >= argc)
+    {
+      std::cout << "Missing argument to --require\n";
+      exit(1);
+    }
+    deviceSelection.extensions.push_back(argv[i]);
+    return true;
+  }
+  return false;
+}
+
+// Prints the help text for the device selection options
+void printDeviceUsage()
+{
+  std::cout << "      --device     INDEX   Select device at INDEX, or 'auto' for the fastest\n";
+  if (deviceSelection.multiDevice)
+  {
+    std::cout << "      --devices    LIST    Use every device in a comma separated LIST\n";
+    std::cout << "      --partition  SCHEME  Split devices into sub-devices: numa, equally:N or by-counts:A,B\n";
+  }
+  std::cout << "      --device-type TYPE   Only use cpu, gpu or accelerator devices\n";
+  std::cout << "      --require    EXT     Only use devices supporting extension EXT\n";
+}
+
 void parseArguments(int argc, char *argv[], cl_uint *deviceIndex)
 {
   for (int i = 1; i < argc; i++)
@@ -101,13 +350,9 @@ void parseArguments(int argc, char *argv[], cl_uint *deviceIndex)
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], deviceIndex))
-      {
-        std::cout << "Invalid device index\n";
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
@@ -116,10 +361,113 @@ void parseArguments(int argc, char *argv[], cl_uint *deviceIndex)
       std::cout << "Options:\n";
       std::cout << "  -h  --help               Print the message\n";
       std::cout << "      --list               List available devices\n";
-      std::cout << "      --device     INDEX   Select device at INDEX\n";
+      printDeviceUsage();
       std::cout << "\n";
       exit(0);
     }
   }
 }
 
+// Returns the devices chosen with --devices, or just the one at deviceIndex,
+// each replaced by its sub-devices if --partition was given.
+// The result is empty if any index is out of range.
+std::vector<cl::Device> getSelectedDevices(const std::vector<cl::Device>& devices,
+                                           cl_uint deviceIndex)
+{
+  std::vector<cl_uint> indices = deviceSelection.indices;
+  if (indices.empty())
+    indices.push_back(deviceIndex);
+
+  std::vector<cl::Device> selected;
+  for (unsigned int i = 0; i < indices.size(); i++)
+  {
+    if (indices[i] >= devices.size())
+      return std::vector<cl::Device>();
+    if (deviceSelection.partition.empty())
+    {
+      selected.push_back(devices[indices[i]]);
+      continue;
+    }
+
+    cl::Device device = devices[indices[i]];
+    std::vector<cl::Device> subDevices;
+    device.createSubDevices(deviceSelection.partition.data(), &subDevices);
+    selected.insert(selected.end(), subDevices.begin(), subDevices.end());
+  }
+  return selected;
+}
+
+// A device along with the context and command queue used to drive it
+struct DeviceQueue
+{
+  cl::Device       device;
+  cl::Context      context;
+  cl::CommandQueue queue;
+};
+
+// Creates one context per platform, shared by all of the given devices on
+// that platform, and one command queue per device
+std::vector<DeviceQueue> createDeviceQueues(const std::vector<cl::Device>& devices,
+                                            cl_command_queue_properties properties = 0)
+{
+  std::map<cl_platform_id, std::vector<cl::Device> > platforms;
+  for (unsigned int d = 0; d < devices.size(); d++)
+    platforms[devices[d].getInfo<CL_DEVICE_PLATFORM>()].push_back(devices[d]);
+
+  std::map<cl_platform_id, cl::Context> contexts;
+  for (std::map<cl_platform_id, std::vector<cl::Device> >::iterator itr = platforms.begin();
+       itr != platforms.end(); itr++)
+  {
+    contexts[itr->first] = cl::Context(itr->second);
+  }
+
+  std::vector<DeviceQueue> result(devices.size());
+  for (unsigned int d = 0; d < devices.size(); d++)
+  {
+    result[d].device  = devices[d];
+    result[d].context = contexts[devices[d].getInfo<CL_DEVICE_PLATFORM>()];
+    result[d].queue   = cl::CommandQueue(result[d].context, devices[d], properties);
+  }
+  return result;
+}
+
+// Splits count work-items between devices in proportion to their weights,
+// in multiples of granularity (any remainder goes to the last device).
+// Returns the first work-item of each device, plus a final entry of count.
+std::vector<size_t> partitionWork(size_t count, const std::vector<double>& weights,
+                                  size_t granularity = 1)
+{
+  double total = 0;
+  for (unsigned int d = 0; d < weights.size(); d++)
+    total += weights[d];
+
+  size_t units = count / granularity;
+  std::vector<size_t> offsets(1, 0);
+  double cumulative = 0;
+  for (unsigned int d = 0; d + 1 < weights.size(); d++)
+  {
+    cumulative += weights[d];
+    size_t end = (size_t)(units * (total > 0 ? cumulative / total : 1) + 0.5);
+    offsets.push_back(std::max(offsets.back(), end * granularity));
+  }
+  offsets.push_back(count);
+  return offsets;
+}
+
+// Fills a buffer with zeros from its device's own queue. CPU runtimes place
+// the pages of a buffer on the NUMA node of the thread that first touches
+// them, so this keeps each sub-device's data in its local memory.
+// Call before writing any data to the buffer.
+void firstTouch(const DeviceQueue& device, const cl::Buffer& buffer, size_t size)
+{
+  device.queue.enqueueFillBuffer(buffer, (cl_uchar)0, 0, size);
+}
+
+void firstTouch(const DeviceQueue& device, const cl::Image2D& image)
+{
+  cl::array<cl::size_type, 3> origin = {{0, 0, 0}};
+  cl::array<cl::size_type, 3> region = {{image.getImageInfo<CL_IMAGE_WIDTH>(),
+                                         image.getImageInfo<CL_IMAGE_HEIGHT>(), 1}};
+  cl_float4 zero = {{0, 0, 0, 0}};
+  device.queue.enqueueFillImage(image, zero, origin, region);
+}
@@ -0,0 +1,167 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       device_profile.hpp
+ *
+ * Purpose:    Read and write per-device performance profiles measured by
+ *             the DeviceInfo exercise (deviceinfo --profile)
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *
+ * Usage:      util::DeviceProfile profile;
+ *             if (util::loadDeviceProfile(device, profile))
+ *               ... profile.globalBandwidth ...
+ *
+ *             Profiles are stored in $HOME/.clprofile (or the directory
+ *             named by OCL_PROFILE_DIR) so that every program finds them
+ *             regardless of its working directory. There is one file per
+ *             device name and driver version, holding "key value" lines.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __DEVICE_PROFILE_HDR
+#define __DEVICE_PROFILE_HDR
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "util.hpp"
+
+namespace util {
+
+struct DeviceProfile
+{
+    std::string name;            // CL_DEVICE_NAME
+    std::string driver;          // CL_DRIVER_VERSION
+    double globalBandwidth;      // GB/s, device global memory copy
+    double localBandwidth;       // GB/s, local memory reads
+    double fp32;                 // GFLOP/s
+    double fp64;                 // GFLOP/s, 0 if unsupported
+    double launchLatency;        // microseconds per empty kernel
+    double hostToDevice;         // GB/s, clEnqueueWriteBuffer
+    double deviceToHost;         // GB/s, clEnqueueReadBuffer
+
+    DeviceProfile()
+      : globalBandwidth(0), localBandwidth(0), fp32(0), fp64(0),
+        launchLatency(0), hostToDevice(0), deviceToHost(0)
+    {
+    }
+};
+
+//! Returns the directory holding device profiles, creating it if needed
+inline std::string getDeviceProfileDir()
+{
+    const char *dir = getenv("OCL_PROFILE_DIR");
+    std::string path;
+    if (dir && *dir)
+    {
+        path = dir;
+    }
+    else
+    {
+#if defined(_WIN32)
+        const char *home = getenv("USERPROFILE");
+#else
+        const char *home = getenv("HOME");
+#endif
+        path = std::string(home ? home : ".") + "/.clprofile";
+    }
+#if defined(_WIN32)
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+    return path;
+}
+
+//! Returns the profile file for a device name and driver version
+inline std::string getDeviceProfilePath(const std::string& name,
+                                        const std::string& driver)
+{
+    char file[32];
+    sprintf(file, "%016llx.profile",
+            (unsigned long long)hashString(name + "\n" + driver));
+    return getDeviceProfileDir() + "/" + file;
+}
+
+inline std::string getDeviceProfilePath(const cl::Device& device)
+{
+    return getDeviceProfilePath(device.getInfo<CL_DEVICE_NAME>(),
+                                device.getInfo<CL_DRIVER_VERSION>());
+}
+
+//! Loads the profile of a device, returning false if it has not been measured
+inline bool loadDeviceProfile(const cl::Device& device, DeviceProfile& profile)
+{
+    std::string name   = device.getInfo<CL_DEVICE_NAME>();
+    std::string driver = device.getInfo<CL_DRIVER_VERSION>();
+    std::ifstream in(getDeviceProfilePath(name, driver).c_str());
+    if (!in.is_open())
+        return false;
+
+    DeviceProfile result;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::string key, value;
+        size_t space = line.find(' ');
+        if (space == std::string::npos)
+            continue;
+        key   = line.substr(0, space);
+        value = line.substr(space + 1);
+
+        double number = strtod(value.c_str(), NULL);
+        if      (key == "name")             result.name            = value;
+        else if (key == "driver")           result.driver          = value;
+        else if (key == "global_bandwidth") result.globalBandwidth = number;
+        else if (key == "local_bandwidth")  result.localBandwidth  = number;
+        else if (key == "fp32")             result.fp32            = number;
+        else if (key == "fp64")             result.fp64            = number;
+        else if (key == "launch_latency")   result.launchLatency   = number;
+        else if (key == "host_to_device")   result.hostToDevice    = number;
+        else if (key == "device_to_host")   result.deviceToHost    = number;
+    }
+
+    // Guard against hash collisions
+    if (result.name != name || result.driver != driver)
+        return false;
+
+    profile = result;
+    return true;
+}
+
+//! Writes the profile of a device, returning false on failure
+inline bool saveDeviceProfile(const DeviceProfile& profile)
+{
+    std::string file = getDeviceProfilePath(profile.name, profile.driver);
+    std::ofstream out(file.c_str());
+    if (!out.is_open())
+        return false;
+
+    out << "name "             << profile.name            << std::endl
+        << "driver "           << profile.driver          << std::endl
+        << "global_bandwidth " << profile.globalBandwidth << std::endl
+        << "local_bandwidth "  << profile.localBandwidth  << std::endl
+        << "fp32 "             << profile.fp32            << std::endl
+        << "fp64 "             << profile.fp64            << std::endl
+        << "launch_latency "   << profile.launchLatency   << std::endl
+        << "host_to_device "   << profile.hostToDevice    << std::endl
+        << "device_to_host "   << profile.deviceToHost    << std::endl;
+    return out.good();
+}
+
+} // namespace util
+
+#endif // __DEVICE_PROFILE_HDR
@@ -44,6 +44,10 @@
  #include <stdlib.h>
 #endif
 
+// Inline in C++ so that several translation units can include this header
+#ifdef __cplusplus
+inline
+#endif
 const char *err_code (cl_int err_in)
 {
     switch (err_in) {
@@ -154,6 +158,9 @@ const char *err_code (cl_int err_in)
 }
 
 
+#ifdef __cplusplus
+inline
+#endif
 void check_error(cl_int err, const char *operation,
                  const char *filename, int line)
 {
@@ -0,0 +1,174 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       pinned_allocator.hpp
+ *
+ * Purpose:    An STL allocator that places container storage in pinned
+ *             (page-locked) host memory, by allocating a CL_MEM_ALLOC_HOST_PTR
+ *             buffer and keeping it mapped for the lifetime of the storage
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *
+ * Usage:      util::cl_pinned_allocator<float> alloc(context, queue);
+ *             util::pinned_vector<float> h_a(n, 0.f, alloc);
+ *
+ *             // Transfers from pinned memory can DMA directly
+ *             queue.enqueueWriteBuffer(d_a, CL_TRUE, 0, n*sizeof(float),
+ *                                      h_a.data());
+ *
+ *             The storage buffers stay mapped, so they must not be passed
+ *             to kernels; use them only as the host side of transfers.
+ *
+ *             A default constructed allocator (or one created with
+ *             pinned = false) uses ordinary pageable memory, so that the
+ *             two can be compared without changing any types.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __PINNED_ALLOCATOR_HDR
+#define __PINNED_ALLOCATOR_HDR
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace util {
+
+//! State shared by every copy (and rebind) of a pinned allocator
+struct PinnedMemory
+{
+    struct Allocation
+    {
+        cl::Buffer buffer;
+        size_t     size; // bytes
+    };
+
+    cl::Context                        context;
+    cl::CommandQueue                   queue;
+    std::map<const char*, Allocation>  allocations;
+};
+
+template <typename T>
+class cl_pinned_allocator
+{
+private:
+    template <typename U> friend class cl_pinned_allocator;
+
+    std::shared_ptr<PinnedMemory> memory_; // NULL for pageable memory
+
+public:
+    typedef T              value_type;
+    typedef T*             pointer;
+    typedef const T*       const_pointer;
+    typedef T&             reference;
+    typedef const T&       const_reference;
+    typedef std::size_t    size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U> struct rebind { typedef cl_pinned_allocator<U> other; };
+
+    //! Allocates pageable memory
+    cl_pinned_allocator()
+    {
+    }
+
+    /*!
+     * \param queue  Used to map and unmap the buffers, which belong to context
+     * \param pinned Allocate pageable memory instead if false
+     */
+    cl_pinned_allocator(const cl::Context& context, const cl::CommandQueue& queue,
+                        bool pinned = true)
+    {
+        if (pinned)
+        {
+            memory_ = std::make_shared<PinnedMemory>();
+            memory_->context = context;
+            memory_->queue   = queue;
+        }
+    }
+
+    template <typename U>
+    cl_pinned_allocator(const cl_pinned_allocator<U>& other)
+      : memory_(other.memory_)
+    {
+    }
+
+    bool pinned() const { return memory_ != NULL; }
+
+    T* allocate(size_type n)
+    {
+        size_t size = n * sizeof(T);
+        if (!memory_)
+            return static_cast<T*>(::operator new(size));
+        if (!size)
+            return NULL;
+
+        PinnedMemory::Allocation allocation;
+        allocation.size   = size;
+        allocation.buffer = cl::Buffer(memory_->context,
+                                       CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                       size);
+        char *ptr = (char*)memory_->queue.enqueueMapBuffer(
+            allocation.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+        memory_->allocations[ptr] = allocation;
+        return reinterpret_cast<T*>(ptr);
+    }
+
+    void deallocate(T *ptr, size_type)
+    {
+        if (!memory_)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        if (!ptr)
+            return;
+
+        std::map<const char*, PinnedMemory::Allocation>::iterator itr =
+            memory_->allocations.find(reinterpret_cast<const char*>(ptr));
+        if (itr == memory_->allocations.end())
+            return;
+        // Called from container destructors, which must not throw: if the
+        // unmap fails, releasing the buffer still frees the memory
+        try
+        {
+            memory_->queue.enqueueUnmapMemObject(itr->second.buffer, ptr);
+            memory_->queue.finish();
+        }
+        catch (...)
+        {
+        }
+        memory_->allocations.erase(itr);
+    }
+
+    template <typename U>
+    bool operator==(const cl_pinned_allocator<U>& other) const
+    {
+        return memory_ == other.memory_;
+    }
+
+    template <typename U>
+    bool operator!=(const cl_pinned_allocator<U>& other) const
+    {
+        return memory_ != other.memory_;
+    }
+};
+
+//! A vector whose storage may be pinned, depending on its allocator
+template <typename T>
+using pinned_vector = std::vector<T, cl_pinned_allocator<T> >;
+
+} // namespace util
+
+#endif // __PINNED_ALLOCATOR_HDR
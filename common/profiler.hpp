@@ -0,0 +1,218 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       profiler.hpp
+ *
+ * Purpose:    Collect OpenCL profiling events for named commands and report
+ *             the queued->submit->start->end breakdown for each name
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *
+ * Usage:      util::Profiler profiler(enabled);
+ *             cl::CommandQueue queue = profiler.createQueue(context, device);
+ *
+ *             // Commands that take an event pointer
+ *             queue.enqueueReadBuffer(..., NULL, profiler.event("read C"));
+ *
+ *             // Kernel functors return their event
+ *             profiler.record("mmul", kernel(cl::EnqueueArgs(...), ...));
+ *
+ *             profiler.report();
+ *
+ *             When disabled, the queue is created without profiling and
+ *             nothing is recorded, so the calls can be left in place.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __PROFILER_HDR
+#define __PROFILER_HDR
+
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+namespace util {
+
+struct CommandTiming
+{
+    std::string name;
+    cl_command_queue queue;
+    cl_ulong queued, submit, start, end; // device timestamps in nanoseconds
+    uint64_t host;                       // hostTimeNanoseconds() at enqueue
+};
+
+class Profiler
+{
+private:
+    struct Record
+    {
+        std::string name;
+        cl::Event   event;
+        uint64_t    host;
+    };
+
+    bool               enabled_;
+    std::deque<Record> records_; // deque keeps event pointers stable
+
+public:
+    Profiler(bool enabled = true) : enabled_(enabled)
+    {
+    }
+
+    bool enabled() const { return enabled_; }
+
+    //! Creates a command queue, with profiling enabled if this profiler is
+    cl::CommandQueue createQueue(const cl::Context& context,
+                                 const cl::Device& device,
+                                 cl_command_queue_properties properties = 0) const
+    {
+        if (enabled_)
+            properties |= CL_QUEUE_PROFILING_ENABLE;
+        return cl::CommandQueue(context, device, properties);
+    }
+
+    /*!
+     * \brief Returns an event to pass to an enqueue call for the named
+     * command, or NULL when profiling is disabled.
+     */
+    cl::Event* event(const std::string& name)
+    {
+        if (!enabled_)
+            return NULL;
+        Record record;
+        record.name = name;
+        record.host = hostTimeNanoseconds();
+        records_.push_back(record);
+        return &records_.back().event;
+    }
+
+    //! Records the event returned by a kernel functor
+    const cl::Event& record(const std::string& name, const cl::Event& event)
+    {
+        if (enabled_)
+        {
+            Record record;
+            record.name  = name;
+            record.event = event;
+            record.host  = hostTimeNanoseconds();
+            records_.push_back(record);
+        }
+        return event;
+    }
+
+    //! Discards all recorded events
+    void clear()
+    {
+        records_.clear();
+    }
+
+    //! Waits for all recorded commands and returns their timestamps
+    std::vector<CommandTiming> timings() const
+    {
+        std::vector<CommandTiming> result;
+        for (size_t i = 0; i < records_.size(); i++)
+        {
+            const cl::Event& event = records_[i].event;
+            if (!event())
+                continue;
+            event.wait();
+
+            CommandTiming t;
+            t.name   = records_[i].name;
+            t.queue  = event.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+            t.queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+            t.submit = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+            t.start  = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            t.end    = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            t.host   = records_[i].host;
+            result.push_back(t);
+        }
+        return result;
+    }
+
+    //! Returns the execution (start->end) time of each named command in seconds
+    std::vector<double> durations(const std::string& name) const
+    {
+        std::vector<double> result;
+        std::vector<CommandTiming> all = timings();
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            if (all[i].name == name)
+                result.push_back((all[i].end - all[i].start) * 1e-9);
+        }
+        return result;
+    }
+
+    //! Prints the average time spent in each phase for every command name
+    void report(std::ostream& out = std::cout) const
+    {
+        if (!enabled_)
+            return;
+
+        struct Summary
+        {
+            unsigned count;
+            double   queued, submitted, running; // total nanoseconds
+        };
+        std::vector<std::string>       order;
+        std::map<std::string, Summary> summary;
+
+        std::vector<CommandTiming> all = timings();
+        for (size_t i = 0; i < all.size(); i++)
+        {
+            if (!summary.count(all[i].name))
+            {
+                Summary s = {0, 0, 0, 0};
+                summary[all[i].name] = s;
+                order.push_back(all[i].name);
+            }
+            Summary& s = summary[all[i].name];
+            s.count++;
+            s.queued    += (double)(all[i].submit - all[i].queued);
+            s.submitted += (double)(all[i].start  - all[i].submit);
+            s.running   += (double)(all[i].end    - all[i].start);
+        }
+
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::endl << "Profile (average ms per command):" << std::endl
+            << std::left << std::setw(24) << "Command" << std::right
+            << std::setw(7)  << "Count"
+            << std::setw(16) << "Queued->Submit"
+            << std::setw(15) << "Submit->Start"
+            << std::setw(13) << "Start->End"
+            << std::setw(13) << "Total(ms)" << std::endl;
+        out << std::fixed << std::setprecision(3);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            const Summary& s = summary[order[i]];
+            out << std::left << std::setw(24) << order[i] << std::right
+                << std::setw(7)  << s.count
+                << std::setw(16) << s.queued    / s.count * 1e-6
+                << std::setw(15) << s.submitted / s.count * 1e-6
+                << std::setw(13) << s.running   / s.count * 1e-6
+                << std::setw(13) << s.running * 1e-6 << std::endl;
+        }
+        out << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+};
+
+} // namespace util
+
+#endif // __PROFILER_HDR
@@ -0,0 +1,235 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       trace.hpp
+ *
+ * Purpose:    Write a timeline of host regions and OpenCL commands in the
+ *             Chrome trace-event format, for viewing in chrome://tracing
+ *             or https://ui.perfetto.dev
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *
+ * Usage:      util::Trace trace(filename);     // empty filename disables
+ *             util::Profiler profiler(profile || trace.enabled());
+ *
+ *             {
+ *               util::Trace::Region region(trace, "runReference");
+ *               runReference(...);
+ *             }
+ *
+ *             trace.write(profiler);
+ *
+ *             Every command queue that recorded events through the profiler
+ *             gets its own track. Device timestamps are moved onto the host
+ *             clock using the host time at which each command was recorded.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __TRACE_HDR
+#define __TRACE_HDR
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+#include "profiler.hpp"
+
+namespace util {
+
+class Trace
+{
+private:
+    struct HostEvent
+    {
+        std::string name;
+        unsigned    track;
+        uint64_t    start, end; // hostTimeNanoseconds()
+    };
+
+    std::string              filename_;
+    std::vector<std::string> tracks_;
+    std::vector<HostEvent>   events_;
+
+    unsigned track(const std::string& name)
+    {
+        for (size_t i = 0; i < tracks_.size(); i++)
+        {
+            if (tracks_[i] == name)
+                return i;
+        }
+        tracks_.push_back(name);
+        return tracks_.size() - 1;
+    }
+
+    static std::string escape(const std::string& str)
+    {
+        std::string out;
+        for (size_t i = 0; i < str.size(); i++)
+        {
+            if (str[i] == '"' || str[i] == '\\')
+                out += '\\';
+            out += str[i];
+        }
+        return out;
+    }
+
+    static void writeName(std::ostream& out, const char *type, unsigned pid,
+                          unsigned tid, const std::string& name)
+    {
+        out << ",\n  {\"name\": \"" << type << "\", \"ph\": \"M\""
+            << ", \"pid\": " << pid << ", \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << escape(name) << "\"}}";
+    }
+
+public:
+    //! Host regions go to pid 1, command queues to pid 2
+    enum { HOST_PID = 1, DEVICE_PID = 2 };
+
+    //! Times the enclosing scope as a region on a host track
+    class Region
+    {
+    private:
+        Trace&      trace_;
+        std::string name_, track_;
+        uint64_t    start_;
+
+    public:
+        Region(Trace& trace, const std::string& name,
+               const std::string& track = "Host")
+          : trace_(trace), name_(name), track_(track),
+            start_(hostTimeNanoseconds())
+        {
+        }
+
+        ~Region()
+        {
+            trace_.add(name_, start_, hostTimeNanoseconds(), track_);
+        }
+    };
+
+    Trace(const std::string& filename = "") : filename_(filename)
+    {
+        // Start the shared clock before anything is recorded
+        hostTimeNanoseconds();
+    }
+
+    bool enabled() const { return !filename_.empty(); }
+
+    //! Adds a host region with times from hostTimeNanoseconds()
+    void add(const std::string& name, uint64_t start, uint64_t end,
+             const std::string& track = "Host")
+    {
+        if (!enabled())
+            return;
+        HostEvent event;
+        event.name  = name;
+        event.track = this->track(track);
+        event.start = start;
+        event.end   = end;
+        events_.push_back(event);
+    }
+
+    /*!
+     * \brief Writes the host regions and every command recorded by the
+     * profiler to the trace file.
+     *
+     * Each queue's device clock is aligned to the host clock using the
+     * smallest difference between the time a command was recorded on the
+     * host and its CL_PROFILING_COMMAND_QUEUED timestamp.
+     */
+    void write(const Profiler& profiler) const
+    {
+        if (!enabled())
+            return;
+
+        std::ofstream out(filename_.c_str());
+        if (!out.is_open())
+        {
+            std::cout << "Cannot open file: " << filename_ << std::endl;
+            return;
+        }
+
+        std::vector<CommandTiming> commands = profiler.timings();
+
+        // Assign a track and clock offset to each queue
+        std::vector<cl_command_queue> queues;
+        std::map<cl_command_queue, double> offsets;
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            double offset = (double)commands[i].host - (double)commands[i].queued;
+            if (!offsets.count(commands[i].queue))
+            {
+                queues.push_back(commands[i].queue);
+                offsets[commands[i].queue] = offset;
+            }
+            else if (offset < offsets[commands[i].queue])
+            {
+                offsets[commands[i].queue] = offset;
+            }
+        }
+
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        out << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": "
+            << HOST_PID << ", \"args\": {\"name\": \"Host\"}}";
+        writeName(out, "process_name", DEVICE_PID, 0, "Device");
+
+        for (size_t t = 0; t < tracks_.size(); t++)
+            writeName(out, "thread_name", HOST_PID, t, tracks_[t]);
+        for (size_t q = 0; q < queues.size(); q++)
+        {
+            cl::CommandQueue queue(queues[q], true);
+            std::stringstream name;
+            name << "Queue " << q << " ("
+                 << queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_NAME>()
+                 << ")";
+            writeName(out, "thread_name", DEVICE_PID, q, name.str());
+        }
+
+        // Timestamps are in microseconds
+        for (size_t i = 0; i < events_.size(); i++)
+        {
+            const HostEvent& e = events_[i];
+            out << ",\n  {\"name\": \"" << escape(e.name) << "\""
+                << ", \"cat\": \"host\", \"ph\": \"X\""
+                << ", \"pid\": " << HOST_PID << ", \"tid\": " << e.track
+                << ", \"ts\": "  << e.start * 1e-3
+                << ", \"dur\": " << (e.end - e.start) * 1e-3 << "}";
+        }
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            const CommandTiming& c = commands[i];
+            size_t tid = std::find(queues.begin(), queues.end(), c.queue)
+                       - queues.begin();
+            out << ",\n  {\"name\": \"" << escape(c.name) << "\""
+                << ", \"cat\": \"device\", \"ph\": \"X\""
+                << ", \"pid\": " << DEVICE_PID << ", \"tid\": " << tid
+                << ", \"ts\": "  << (c.start + offsets[c.queue]) * 1e-3
+                << ", \"dur\": " << (c.end - c.start) * 1e-3
+                << ", \"args\": {\"queued_us\": " << (c.submit - c.queued) * 1e-3
+                << ", \"submit_us\": " << (c.start - c.submit) * 1e-3 << "}}";
+        }
+        out << "\n]}" << std::endl;
+
+        std::cout << "Wrote trace to " << filename_ << std::endl;
+    }
+};
+
+} // namespace util
+
+#endif // __TRACE_HDR
@@ -13,11 +13,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__APPLE__) || defined(__MACOSX)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
 
 #if defined(_WIN32) && !defined(__MINGW32__)
 #include <windows.h>
+#include <direct.h>
 #else
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 // Utility to load an OpenCL kernel source file
@@ -45,6 +55,187 @@ char *loadProgram(const char *filename)
   return source;
 }
 
+// Utility to compute a 64-bit FNV-1a hash, used to key on-disk caches
+unsigned long long hashBytes(const void *data, size_t len,
+                             unsigned long long hash)
+{
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Utility to get the directory used to cache program binaries
+// Defaults to ".clcache", override with OCL_CACHE_DIR or disable with
+// OCL_NO_CACHE. Returns 0 if caching is disabled.
+int getCacheDir(char *path, size_t len)
+{
+  if (getenv("OCL_NO_CACHE"))
+    return 0;
+
+  const char *dir = getenv("OCL_CACHE_DIR");
+  snprintf(path, len, "%s", (dir && *dir) ? dir : ".clcache");
+#if defined(_WIN32) && !defined(__MINGW32__)
+  _mkdir(path);
+#else
+  mkdir(path, 0755);
+#endif
+  return 1;
+}
+
+// Utility to build a program for a single device, reusing a cached binary
+// from a previous run when one is available
+// The cache is keyed on the source text, the build options and the device
+// name, version and driver version. On return err holds the result of
+// clBuildProgram, so the build log can be queried as usual on failure.
+cl_program buildProgram(cl_context context, cl_device_id device,
+                        const char *source, const char *options,
+                        cl_int *err)
+{
+  char info[4][1024];
+  cl_platform_id platform;
+  clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+  clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(info[0]), info[0], NULL);
+  clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(info[1]), info[1], NULL);
+  clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(info[2]), info[2], NULL);
+  clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(info[3]), info[3], NULL);
+
+  if (!options)
+    options = "";
+
+  // Generate cache key: the options, the device details and the source,
+  // stored in the entry and compared in full, as the file name is only
+  // a hash of it
+  size_t keyLength = strlen(options) + 1 + strlen(source);
+  for (int i = 0; i < 4; i++)
+    keyLength += strlen(info[i]) + 1;
+  char *key = (char *)malloc(keyLength + 1);
+  if (!key)
+  {
+    *err = CL_OUT_OF_HOST_MEMORY;
+    return NULL;
+  }
+  snprintf(key, keyLength + 1, "%s\n%s\n%s\n%s\n%s\n%s",
+           options, info[0], info[1], info[2], info[3], source);
+
+  // Room for the directory and "/<16 hex digits>.bin"
+  char dir[1024];
+  char file[sizeof(dir) + 24] = "";
+  if (getCacheDir(dir, sizeof(dir)))
+    snprintf(file, sizeof(file), "%s/%016llx.bin", dir,
+             hashBytes(key, keyLength, 14695981039346656037ULL));
+
+  // Try to load binary from a previous build. Lengths that overrun the
+  // file come from a truncated or corrupt entry, which is a cache miss.
+  FILE *in = file[0] ? fopen(file, "rb") : NULL;
+  if (in)
+  {
+    unsigned long long cachedLength = 0, length = 0, remaining = 0;
+    unsigned char *binary = NULL;
+    char *cachedKey = NULL;
+    if (!fseek(in, 0, SEEK_END))
+    {
+      long end = ftell(in);
+      remaining = end > 0 ? (unsigned long long)end : 0;
+    }
+    rewind(in);
+
+    if (remaining >= sizeof(cachedLength) &&
+        fread(&cachedLength, sizeof(cachedLength), 1, in) == 1 &&
+        cachedLength == keyLength &&
+        keyLength <= remaining - sizeof(cachedLength))
+    {
+      remaining -= sizeof(cachedLength) + keyLength;
+      cachedKey = (char *)malloc(keyLength);
+      if (cachedKey && fread(cachedKey, 1, keyLength, in) == keyLength &&
+          !memcmp(cachedKey, key, keyLength) &&
+          remaining >= sizeof(length) &&
+          fread(&length, sizeof(length), 1, in) == 1 &&
+          length > 0 && length <= remaining - sizeof(length))
+      {
+        binary = (unsigned char *)malloc(length);
+        if (binary && fread(binary, 1, length, in) != length)
+        {
+          free(binary);
+          binary = NULL;
+        }
+      }
+      free(cachedKey);
+    }
+    fclose(in);
+
+    if (binary)
+    {
+      size_t size = length;
+      cl_program program = clCreateProgramWithBinary(
+        context, 1, &device, &size, (const unsigned char **)&binary, NULL, err);
+      free(binary);
+      if (*err == CL_SUCCESS)
+      {
+        *err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        if (*err == CL_SUCCESS)
+        {
+          free(key);
+          return program;
+        }
+        clReleaseProgram(program);
+      }
+    }
+  }
+
+  // Cache miss - build from source
+  cl_program program =
+    clCreateProgramWithSource(context, 1, &source, NULL, err);
+  if (*err != CL_SUCCESS)
+  {
+    free(key);
+    return NULL;
+  }
+
+  *err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  if (*err != CL_SUCCESS || !file[0])
+  {
+    free(key);
+    return program;
+  }
+
+  // Save binary for next time, writing to a temporary file first so that
+  // concurrent jobs never see a partial entry
+  size_t size = 0;
+  clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+  unsigned char *binary = size ? (unsigned char *)malloc(size) : NULL;
+  if (binary &&
+      clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary,
+                       NULL) == CL_SUCCESS)
+  {
+    char tmp[sizeof(file) + 32]; // room for ".<process id>.tmp"
+#if defined(_WIN32) && !defined(__MINGW32__)
+    snprintf(tmp, sizeof(tmp), "%s.%lu.tmp", file, GetCurrentProcessId());
+#else
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+#endif
+    FILE *out = fopen(tmp, "wb");
+    if (out)
+    {
+      unsigned long long storedLength = keyLength, length = size;
+      int ok = fwrite(&storedLength, sizeof(storedLength), 1, out) == 1 &&
+               fwrite(key, 1, keyLength, out) == keyLength &&
+               fwrite(&length, sizeof(length), 1, out) == 1 &&
+               fwrite(binary, 1, size, out) == size;
+      ok &= !fclose(out);
+      if (!ok || rename(tmp, file))
+        remove(tmp);
+    }
+  }
+  free(binary);
+  free(key);
+
+  return program;
+}
+
 // Utility to return the current time in nanoseconds since the epoch
 double getCurrentTimeNanoseconds()
 {
@@ -13,18 +13,25 @@
 
 #if defined(_WIN32)
 #include <windows.h>
+#include <direct.h>
 typedef unsigned __int64 uint64_t;
 #elif defined(__APPLE__) || defined(__MACOSX)
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #else
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #endif
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include <cstdio>
 #include <cstdlib>
 
 namespace util {
@@ -45,6 +52,209 @@ inline std::string loadProgram(std::string input)
         (std::istreambuf_iterator<char>()));
 }
 
+/*!
+ * \brief 64-bit FNV-1a hash of a string, used to key on-disk caches.
+ */
+inline uint64_t hashString(const std::string& str,
+                           uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*!
+ * \brief Returns true if name is one of the space separated extensions,
+ * so that cl_khr_fp does not match cl_khr_fp16 or cl_khr_fp64.
+ */
+inline bool hasExtension(const std::string& extensions, const std::string& name)
+{
+    std::istringstream tokens(extensions);
+    std::string token;
+    while (tokens >> token)
+    {
+        if (token == name)
+            return true;
+    }
+    return false;
+}
+
+/*!
+ * \brief Returns the directory used to cache program binaries.
+ *
+ * Defaults to ".clcache" in the working directory and can be changed
+ * with the OCL_CACHE_DIR environment variable. Setting OCL_NO_CACHE
+ * disables the cache, in which case an empty string is returned.
+ */
+inline std::string getCacheDir()
+{
+    if (getenv("OCL_NO_CACHE"))
+        return "";
+
+    const char *dir = getenv("OCL_CACHE_DIR");
+    std::string path = (dir && *dir) ? dir : ".clcache";
+#if defined(_WIN32)
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+    return path;
+}
+
+#ifdef CL_HPP_
+/*!
+ * \brief Builds a program for every device in a context, reusing a cached
+ * binary from a previous run when one is available.
+ *
+ * Cache entries are keyed on the source text, the build options and the
+ * name, version and driver version of each device, so a driver upgrade
+ * or a change to any -D option triggers a fresh compile. Headers pulled
+ * in with #include are not part of the key.
+ *
+ * Build failures throw cl::BuildError exactly as cl::Program::build does.
+ */
+inline cl::Program buildProgram(const cl::Context& context,
+                                const std::string& source,
+                                const std::string& options = "")
+{
+    std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+
+    // Generate cache key
+    std::stringstream key;
+    key << options << "\n";
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        cl::Platform platform(devices[d].getInfo<CL_DEVICE_PLATFORM>());
+        key << platform.getInfo<CL_PLATFORM_VERSION>() << "\n"
+            << devices[d].getInfo<CL_DEVICE_NAME>() << "\n"
+            << devices[d].getInfo<CL_DEVICE_VERSION>() << "\n"
+            << devices[d].getInfo<CL_DRIVER_VERSION>() << "\n";
+    }
+    key << source;
+
+    std::string dir = getCacheDir();
+    std::string file;
+    if (!dir.empty())
+    {
+        char name[32];
+        sprintf(name, "%016llx.bin", (unsigned long long)hashString(key.str()));
+        file = dir + "/" + name;
+    }
+
+    // Try to load binaries from a previous build
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if (in.is_open())
+    {
+        // Lengths that overrun the rest of the file come from a truncated
+        // or corrupt entry, which is treated as a cache miss
+        in.seekg(0, std::ios::end);
+        uint64_t remaining = in ? (uint64_t)in.tellg() : 0;
+        in.seekg(0, std::ios::beg);
+        auto readLength = [&](uint64_t& length)
+        {
+            length = 0;
+            if (remaining < sizeof(length))
+                return false;
+            in.read((char*)&length, sizeof(length));
+            remaining -= sizeof(length);
+            if (!in || length > remaining)
+                return false;
+            remaining -= length;
+            return true;
+        };
+
+        uint64_t keyLength = 0;
+        std::string cachedKey;
+        bool valid = readLength(keyLength) && keyLength == key.str().size();
+        if (valid)
+        {
+            cachedKey.resize(keyLength);
+            in.read(&cachedKey[0], keyLength);
+        }
+
+        std::vector<std::vector<unsigned char> > binaries(devices.size());
+        for (size_t d = 0; d < devices.size() && valid && in; d++)
+        {
+            uint64_t length = 0;
+            valid = readLength(length);
+            if (valid)
+            {
+                binaries[d].resize(length);
+                in.read((char*)binaries[d].data(), length);
+            }
+        }
+
+        if (valid && in && cachedKey == key.str())
+        {
+            std::vector<cl_device_id> ids(devices.size());
+            std::vector<size_t> lengths(devices.size());
+            std::vector<const unsigned char*> images(devices.size());
+            for (size_t d = 0; d < devices.size(); d++)
+            {
+                ids[d]     = devices[d]();
+                lengths[d] = binaries[d].size();
+                images[d]  = binaries[d].data();
+            }
+
+            // Use the C API so that a stale binary falls through to a
+            // source build instead of throwing
+            cl_int err;
+            cl_program program = clCreateProgramWithBinary(
+                context(), (cl_uint)devices.size(), ids.data(),
+                lengths.data(), images.data(), NULL, &err);
+            if (err == CL_SUCCESS)
+            {
+                err = clBuildProgram(program, (cl_uint)devices.size(),
+                                     ids.data(), options.c_str(), NULL, NULL);
+                if (err == CL_SUCCESS)
+                    return cl::Program(program);
+                clReleaseProgram(program);
+            }
+        }
+    }
+
+    // Cache miss - build from source
+    cl::Program program(context, source);
+    program.build(devices, options.c_str());
+
+    // Save binaries for next time, writing to a temporary file first so
+    // that concurrent jobs never see a partial entry
+    if (!file.empty())
+    {
+        std::vector<std::vector<unsigned char> > binaries =
+            program.getInfo<CL_PROGRAM_BINARIES>();
+
+        std::stringstream tmp;
+#if defined(_WIN32)
+        tmp << file << "." << GetCurrentProcessId() << ".tmp";
+#else
+        tmp << file << "." << getpid() << ".tmp";
+#endif
+        std::ofstream out(tmp.str().c_str(), std::ios::binary);
+        if (out.is_open())
+        {
+            uint64_t keyLength = key.str().size();
+            out.write((char*)&keyLength, sizeof(keyLength));
+            out.write(key.str().data(), keyLength);
+            for (size_t d = 0; d < binaries.size(); d++)
+            {
+                uint64_t length = binaries[d].size();
+                out.write((char*)&length, sizeof(length));
+                out.write((char*)binaries[d].data(), length);
+            }
+            out.close();
+            if (!out || rename(tmp.str().c_str(), file.c_str()))
+                remove(tmp.str().c_str());
+        }
+    }
+
+    return program;
+}
+#endif // CL_HPP_
+
 #if 1
 class Timer
 {
@@ -223,6 +433,16 @@ public:
 };
 #endif
 
+/*!
+ * \brief Monotonic host clock shared by the whole program.
+ * \returns The time in nano seconds since the clock was first read.
+ */
+inline uint64_t hostTimeNanoseconds()
+{
+    static Timer clock;
+    return clock.getTimeNanoseconds();
+}
+
 } // namespace util
 
 #endif // __UTIL_HDR
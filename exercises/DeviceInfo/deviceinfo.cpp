@@ -4,6 +4,10 @@
  * Script to print out some information about the OpenCL devices
  * and platforms available on your system
  *
+ * With --profile, also measures the bandwidth, FLOP/s and latency each
+ * device actually delivers and saves them for other programs to use
+ * (see device_profile.hpp)
+ *
  * History: C++ version written by Tom Deakin, 2012
  *          Updated by Tom Deakin, August 2013
 */
@@ -18,6 +22,8 @@
  *
  */
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
 #include <vector>
 
@@ -30,9 +36,38 @@
 #include <CL/cl2.hpp>
 
 #include <device_picker.hpp>
+#include <util.hpp>
+#include <device_profile.hpp>
+
+util::DeviceProfile profileDevice(const cl::Device& device);
 
-int main(void)
+int main(int argc, char *argv[])
 {
+  bool profile = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--profile"))
+    {
+      profile = true;
+    }
+    else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+    {
+      std::cout << std::endl;
+      std::cout << "Usage: ./deviceinfo [OPTIONS]" << std::endl << std::endl;
+      std::cout << "Options:" << std::endl;
+      std::cout << "  -h  --help               Print the message" << std::endl;
+      std::cout << "      --profile            Measure and save device performance" << std::endl;
+      std::cout << std::endl;
+      return 0;
+    }
+    else
+    {
+      std::cout << "Unrecognized argument '" << argv[i] << "' (try '--help')"
+                << std::endl;
+      return 1;
+    }
+  }
+
   try
   {
     // Discover number of platforms
@@ -94,6 +129,27 @@ int main(void)
           std::cout << *st << " ";
         std::cout << "\x08)" << std::endl;
 
+        if (profile)
+        {
+          std::cout << "\t\tMeasuring performance..." << std::endl;
+          util::DeviceProfile p = profileDevice(*dev);
+          std::cout << "\t\tGlobal Memory Bandwidth: " << p.globalBandwidth << " GB/s" << std::endl;
+          std::cout << "\t\tLocal Memory Bandwidth: " << p.localBandwidth << " GB/s" << std::endl;
+          std::cout << "\t\tFP32 Peak: " << p.fp32 << " GFLOP/s" << std::endl;
+          if (p.fp64 > 0)
+            std::cout << "\t\tFP64 Peak: " << p.fp64 << " GFLOP/s" << std::endl;
+          else
+            std::cout << "\t\tFP64 Peak: not supported" << std::endl;
+          std::cout << "\t\tKernel Launch Latency: " << p.launchLatency << " us" << std::endl;
+          std::cout << "\t\tHost to Device Bandwidth: " << p.hostToDevice << " GB/s" << std::endl;
+          std::cout << "\t\tDevice to Host Bandwidth: " << p.deviceToHost << " GB/s" << std::endl;
+
+          if (util::saveDeviceProfile(p))
+            std::cout << "\t\tSaved to " << util::getDeviceProfilePath(*dev) << std::endl;
+          else
+            std::cout << "\t\tCould not save profile" << std::endl;
+        }
+
         std::cout << "\t-------------------------" << std::endl;
 
       }
@@ -119,3 +175,128 @@ int main(void)
 
   return 0;
 }
+
+// Returns the fastest of several runs of a command in seconds, timed with
+// its profiling event
+double timeCommand(std::function<cl::Event()> run, unsigned reps = 5)
+{
+  run().wait();
+
+  double best = 0;
+  for (unsigned i = 0; i < reps; i++)
+  {
+    cl::Event event = run();
+    event.wait();
+    double time = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                   event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+    if (!i || time < best)
+      best = time;
+  }
+  return best;
+}
+
+util::DeviceProfile profileDevice(const cl::Device& device)
+{
+  util::DeviceProfile profile;
+  profile.name   = device.getInfo<CL_DEVICE_NAME>();
+  profile.driver = device.getInfo<CL_DRIVER_VERSION>();
+
+  cl::Context context(device);
+  cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+  std::string source = util::loadProgram("profile.cl");
+  cl::Program program = util::buildProgram(context, source, "-DREAL=float");
+
+  // Largest power of two work-group size up to 256
+  size_t maxWGSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  size_t wgsize = 1;
+  while (wgsize*2 <= std::min<size_t>(maxWGSize, 256))
+    wgsize *= 2;
+
+  // Use buffers of up to 128 MB
+  size_t bytes = std::min<cl_ulong>(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(),
+                                    128*1024*1024);
+  bytes -= bytes % (16*wgsize);
+  cl::Buffer d_a(context, CL_MEM_READ_WRITE, bytes);
+  cl::Buffer d_b(context, CL_MEM_READ_WRITE, bytes);
+
+  // Global memory bandwidth (read + write)
+  cl::KernelFunctor<cl::Buffer, cl::Buffer> copy(program, "copy");
+  double time = timeCommand([&]()
+  {
+    return copy(cl::EnqueueArgs(queue, cl::NDRange(bytes/16)), d_a, d_b);
+  });
+  profile.globalBandwidth = 2*bytes / time * 1e-9;
+
+  // Local memory bandwidth
+  const cl_uint localIters = 1024;
+  const size_t items = 1024*wgsize;
+  cl::Buffer d_out(context, CL_MEM_WRITE_ONLY, items*sizeof(cl_double));
+  cl::KernelFunctor<cl::Buffer, cl::LocalSpaceArg, cl_uint>
+    localRead(program, "local_read");
+  time = timeCommand([&]()
+  {
+    return localRead(cl::EnqueueArgs(queue, cl::NDRange(items), cl::NDRange(wgsize)),
+                     d_out, cl::Local(wgsize*sizeof(float)), localIters);
+  });
+  profile.localBandwidth = (double)items*localIters*sizeof(float) / time * 1e-9;
+
+  // Peak FLOP/s, 32 per iteration per work-item
+  const cl_uint flopIters = 256;
+  cl::KernelFunctor<cl::Buffer, cl_float, cl_uint> flops32(program, "flops");
+  time = timeCommand([&]()
+  {
+    return flops32(cl::EnqueueArgs(queue, cl::NDRange(items)),
+                   d_out, 0.999f, flopIters);
+  });
+  profile.fp32 = (double)items*flopIters*32 / time * 1e-9;
+
+  std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+  if (extensions.find("cl_khr_fp64") != std::string::npos)
+  {
+    cl::Program program64 =
+      util::buildProgram(context, source, "-DREAL=double -DUSE_FP64");
+    cl::KernelFunctor<cl::Buffer, cl_double, cl_uint> flops64(program64, "flops");
+    time = timeCommand([&]()
+    {
+      return flops64(cl::EnqueueArgs(queue, cl::NDRange(items)),
+                     d_out, 0.999, flopIters);
+    });
+    profile.fp64 = (double)items*flopIters*32 / time * 1e-9;
+  }
+
+  // Launch latency, as seen by the host, of an empty kernel
+  const unsigned launches = 100;
+  cl::KernelFunctor<> empty(program, "empty");
+  empty(cl::EnqueueArgs(queue, cl::NDRange(1)));
+  queue.finish();
+  util::Timer timer;
+  for (unsigned i = 0; i < launches; i++)
+  {
+    empty(cl::EnqueueArgs(queue, cl::NDRange(1)));
+    queue.finish();
+  }
+  profile.launchLatency = timer.getTimeNanoseconds() * 1e-3 / launches;
+
+  // Host <-> device transfers from pageable memory
+  std::vector<char> h_buffer(bytes, 1);
+  time = timeCommand([&]()
+  {
+    cl::Event event;
+    queue.enqueueWriteBuffer(d_a, CL_FALSE, 0, bytes, h_buffer.data(),
+                             NULL, &event);
+    return event;
+  });
+  profile.hostToDevice = bytes / time * 1e-9;
+
+  time = timeCommand([&]()
+  {
+    cl::Event event;
+    queue.enqueueReadBuffer(d_a, CL_FALSE, 0, bytes, h_buffer.data(),
+                            NULL, &event);
+    return event;
+  });
+  profile.deviceToHost = bytes / time * 1e-9;
+
+  return profile;
+}
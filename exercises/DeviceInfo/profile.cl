@@ -0,0 +1,67 @@
+/*
+ * Microbenchmark kernels for deviceinfo --profile
+ *
+ * REAL must be defined to float or double when building
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifdef USE_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+// Global memory bandwidth: each work-item copies one float4
+kernel void copy(global const float4 * restrict in,
+                 global       float4 * restrict out)
+{
+  size_t i = get_global_id(0);
+  out[i] = in[i];
+}
+
+// Local memory bandwidth: each work-item reads ITERS floats from local
+// memory. The local size must be a power of two.
+kernel void local_read(global float *out, local float *scratch,
+                       const uint iters)
+{
+  uint lid  = get_local_id(0);
+  uint mask = get_local_size(0) - 1;
+
+  scratch[lid] = lid;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  float sum = 0.f;
+  for (uint i = 0; i < iters; i++)
+    sum += scratch[(lid + i) & mask];
+
+  out[get_global_id(0)] = sum;
+}
+
+// Peak arithmetic: each iteration performs 16 dependent multiply-adds,
+// i.e. 32 FLOPs per iteration
+#define MAD_4(x, y) x = mad(y, x, y); y = mad(x, y, x); \
+                    x = mad(y, x, y); y = mad(x, y, x);
+#define MAD_16(x, y) MAD_4(x, y) MAD_4(x, y) MAD_4(x, y) MAD_4(x, y)
+
+kernel void flops(global REAL *out, const REAL a, const uint iters)
+{
+  REAL x = (REAL)get_global_id(0);
+  REAL y = a;
+  for (uint i = 0; i < iters; i++)
+  {
+    MAD_16(x, y)
+  }
+  out[get_global_id(0)] = x + y;
+}
+
+// Launch latency
+kernel void empty()
+{
+}
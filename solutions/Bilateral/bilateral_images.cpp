@@ -14,6 +14,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -40,6 +41,11 @@ HostImage* createHostImage(int width, int height);
 
 #include <device_picker.hpp>
 #include <util.hpp>
+#include <benchmark.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
+#include <autotune.hpp>
+#include <pinned_allocator.hpp>
 
 #undef main
 #undef min
@@ -61,43 +67,60 @@ int      width         =  1920;
 int      height        =  1080;
 #endif
 cl::NDRange wgsize     = cl::NullRange;
+bool     wgsizeSet     =  false;
+bool     tune          =  false;
+bool     pageable      =  false;
 const char *inputFile  =  "1080p.bmp";
+util::BenchmarkOptions benchOptions;
+std::string traceFile;
 
 int main(int argc, char *argv[])
 {
   try
   {
+    // Rows are split between every selected device
+    deviceSelection.multiDevice = true;
     parseArguments(argc, argv);
 
+    util::Trace trace(traceFile);
+
     // Get list of devices
     std::vector<cl::Device> devices;
     getDeviceList(devices);
 
-    // Check device index in range
-    if (deviceIndex >= devices.size())
+    // Check device indices in range
+    std::vector<cl::Device> selected = getSelectedDevices(devices, deviceIndex);
+    if (selected.empty())
     {
       std::cout << "Invalid device index (try '--list')" << std::endl;
       return 1;
     }
 
-    cl::Device device = devices[deviceIndex];
-
-    std::string name = getDeviceName(device);
-    std::cout << std::endl << "Using OpenCL device: " << name << std::endl
-              << std::endl;
-
-    cl_bool supportsImages = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>();
-    if (!supportsImages)
+    std::cout << std::endl;
+    for (unsigned d = 0; d < selected.size(); d++)
     {
-       std::cout << std::endl << "Device doesn't support images!" << std::endl
-                 << std::endl;
-       return 1;
+      std::cout << "Using OpenCL device: " << getDeviceName(selected[d])
+                << std::endl;
+
+      cl_bool supportsImages = selected[d].getInfo<CL_DEVICE_IMAGE_SUPPORT>();
+      if (!supportsImages)
+      {
+         std::cout << std::endl << "Device doesn't support images!" << std::endl
+                   << std::endl;
+         return 1;
+      }
     }
+    std::cout << std::endl;
 
-    cl::Context context(device);
-    cl::CommandQueue queue(context);
-    cl::Program program(context, util::loadProgram("bilateral_images.cl"));
+    util::Profiler profiler(trace.enabled() || tune);
+    std::vector<DeviceQueue> queues = createDeviceQueues(selected,
+      profiler.enabled() ? CL_QUEUE_PROFILING_ENABLE : 0);
+    unsigned numDevices = queues.size();
 
+    // The first device is used for tuning
+    cl::Device       device  = queues[0].device;
+    cl::Context      context = queues[0].context;
+    cl::CommandQueue queue   = queues[0].queue;
     std::stringstream options;
     options.setf(std::ios::fixed);
     options << " -cl-fast-relaxed-math";
@@ -105,12 +128,21 @@ int main(int argc, char *argv[])
     options << " -DRADIUS=" << radius;
     options << " -DSIGMA_DOMAIN=" << sigmaDomain;
     options << " -DSIGMA_RANGE=" << sigmaRange;
-    program.build(options.str().c_str());
-
-    cl::KernelFunctor<cl::Image2D, cl::Image2D>
-      kernel(program, "bilateral");
+    std::vector<cl::KernelFunctor<cl::Image2D, cl::Image2D> > kernels;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        cl::Program program =
+          util::buildProgram(queues[d].context, util::loadProgram("bilateral_images.cl"), options.str());
+        kernels.push_back(
+          cl::KernelFunctor<cl::Image2D, cl::Image2D>(program, "bilateral"));
+      }
+    }
+    cl::KernelFunctor<cl::Image2D, cl::Image2D>& kernel = kernels[0];
 
     // Load input image
+    uint64_t loadStart = util::hostTimeNanoseconds();
 #ifdef USE_SDL
     SDL_Surface *image = SDL_LoadBMP(inputFile);
     if (!image)
@@ -125,14 +157,35 @@ int main(int argc, char *argv[])
       image->pixels[i] = rand() % 256;
     }
 #endif
+    trace.add("load image", loadStart, util::hostTimeNanoseconds());
     std::cout << "Processing image of size " << image->w << "x" << image->h
               << std::endl << std::endl;
 
+    // Stage transfers through pinned memory unless --pageable was given
+    size_t imageBytes = (size_t)image->w*image->h*4;
+    util::cl_pinned_allocator<uint8_t> alloc(context, queue, !pageable);
+    util::pinned_vector<uint8_t> staging(imageBytes, 0, alloc);
+    memcpy(staging.data(), image->pixels, imageBytes);
+
+    // Each device gets the whole input image, and writes its own rows
+    // of the output
     cl::ImageFormat format(CL_RGBA, CL_UNORM_INT8);
-    cl::Image2D input(context, CL_MEM_READ_ONLY, format, image->w, image->h);
-    cl::Image2D output(context, CL_MEM_WRITE_ONLY, format, image->w, image->h);
+    std::vector<cl::Image2D> inputs, outputs;
+    for (unsigned d = 0; d < numDevices; d++)
+    {
+      inputs.push_back(cl::Image2D(queues[d].context, CL_MEM_READ_ONLY,
+                                   format, image->w, image->h));
+      outputs.push_back(cl::Image2D(queues[d].context, CL_MEM_WRITE_ONLY,
+                                    format, image->w, image->h));
+
+      // Keep each copy in memory local to its (sub-)device
+      firstTouch(queues[d], inputs[d]);
+      firstTouch(queues[d], outputs[d]);
+    }
+    cl::Image2D& input  = inputs[0];
+    cl::Image2D& output = outputs[0];
 
-    // Write image to device
+    // Write image to devices
     cl::array<cl::size_type, 3> origin;
     origin[0] = 0;
     origin[1] = 0;
@@ -141,42 +194,116 @@ int main(int argc, char *argv[])
     region[0] = image->w;
     region[1] = image->h;
     region[2] = 1;
-    queue.enqueueWriteImage(input, CL_TRUE, origin, region,
-                            0, 0, image->pixels);
+    for (unsigned d = 0; d < numDevices; d++)
+    {
+      queues[d].queue.enqueueWriteImage(inputs[d], CL_TRUE, origin, region,
+                                        0, 0, staging.data(), NULL,
+                                        profiler.event("write image"));
+    }
 
 
     cl::NDRange global(image->w, image->h);
 
+    // Use the tuned work-group size unless one was given
+    if (tune || !wgsizeSet)
+    {
+      std::stringstream problem;
+      problem << image->w << "x" << image->h << ",r=" << radius;
+      util::Tuner tuner(device, "bilateral_images", problem.str());
+      tuner.addParameter("LX", {1, 2, 4, 8, 16, 32, 64}, util::Tuner::LOCAL_SIZE);
+      tuner.addParameter("LY", {1, 2, 4, 8, 16, 32}, util::Tuner::LOCAL_SIZE);
+      tuner.addConstraint([&](const util::TuningConfig& c)
+                          { return global[0] % c.at("LX") == 0 &&
+                                   global[1] % c.at("LY") == 0; });
+
+      // No defaults - leave the choice to the runtime if not tuned
+      util::TuningConfig config = tuner.select(tune, util::TuningConfig(),
+        [&](const util::TuningConfig& c)
+        {
+          return kernel(cl::EnqueueArgs(queue, global,
+                                        cl::NDRange(c.at("LX"), c.at("LY"))),
+                        input, output);
+        });
+      if (!config.empty())
+      {
+        wgsize = cl::NDRange(config.at("LX"), config.at("LY"));
+        std::cout << "Work-group size: " << config.at("LX") << "x"
+                  << config.at("LY") << std::endl << std::endl;
+      }
+    }
+
+    // Split the rows between devices in whole work-groups
+    std::vector<size_t> rows = partitionWork(image->h, getDeviceWeights(selected),
+                                             wgsize.dimensions() ? wgsize.get()[1] : 1);
+    if (numDevices > 1)
+    {
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        std::cout << "Device " << d << ": rows " << rows[d]
+                  << " to " << rows[d+1] << std::endl;
+      }
+      std::cout << std::endl;
+    }
+
+    // Reads each device's rows of the output into pixels
+    auto readOutput = [&](void *pixels)
+    {
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        cl::array<cl::size_type, 3> rowOrigin = origin;
+        cl::array<cl::size_type, 3> rowRegion = region;
+        rowOrigin[1] = rows[d];
+        rowRegion[1] = rows[d+1] - rows[d];
+        if (!rowRegion[1])
+          continue;
+        queues[d].queue.enqueueReadImage(outputs[d], CL_TRUE, rowOrigin, rowRegion,
+                                         0, 0, (uint8_t*)pixels + rows[d]*image->w*4,
+                                         NULL, profiler.event("read image"));
+      }
+    };
+
     // Apply filter
     std::cout << "Running OpenCL..." << std::endl;
-    util::Timer timer;
-    uint64_t startTime = timer.getTimeMicroseconds();
-    for (unsigned i = 0; i < iterations; i++)
+    util::Benchmark bench(benchOptions);
+    util::BenchmarkResult timing = bench.run("bilateral", [&]()
     {
-      kernel(cl::EnqueueArgs(queue, global, wgsize),
-             input, output);
-    }
-    queue.finish();
-    uint64_t endTime = timer.getTimeMicroseconds();
-    double total = ((endTime-startTime)*1e-3);
+      for (unsigned i = 0; i < iterations; i++)
+      {
+        for (unsigned d = 0; d < numDevices; d++)
+        {
+          size_t count = rows[d+1] - rows[d];
+          if (!count)
+            continue;
+          profiler.record("bilateral",
+            kernels[d](cl::EnqueueArgs(queues[d].queue,
+                                       cl::NDRange(0, rows[d]),
+                                       cl::NDRange(image->w, count), wgsize),
+                       inputs[d], outputs[d]));
+        }
+      }
+      for (unsigned d = 0; d < numDevices; d++)
+        queues[d].queue.finish();
+    }, iterations*(double)image->w*image->h*4*2*1e-9, "GB/s");
+    double total = timing.stats.median*1e3;
     std::cout << std::fixed << std::setprecision(1);
     std::cout << "OpenCL took " << total << "ms"
               << " (" << (total/iterations) << "ms / frame)"
-              << std::endl << std::endl;
+              << std::endl;
+    bench.report();
 
 #ifdef USE_SDL
     // Save result to file
     SDL_Surface *result = SDL_ConvertSurface(image,
                                              image->format, image->flags);
     SDL_LockSurface(result);
-    queue.enqueueReadImage(output, CL_TRUE, origin, region,
-                           0, 0, result->pixels);
+    readOutput(staging.data());
+    memcpy(result->pixels, staging.data(), imageBytes);
     SDL_UnlockSurface(result);
     SDL_SaveBMP(result, "output.bmp");
 #else
     HostImage *result = createHostImage(image->w, image->h);
-    queue.enqueueReadImage(output, CL_TRUE, origin, region,
-                           0, 0, result->pixels);
+    readOutput(staging.data());
+    memcpy(result->pixels, staging.data(), imageBytes);
 #endif
 
     if (verify)
@@ -187,10 +314,11 @@ int main(int argc, char *argv[])
 #ifdef USE_SDL
       SDL_LockSurface(image);
 #endif
-      startTime = timer.getTimeMicroseconds();
+      uint64_t startTime = util::hostTimeNanoseconds();
       runReference((uint8_t*)image->pixels, reference, image->w, image->h);
-      endTime = timer.getTimeMicroseconds();
-      std::cout << "Reference took " << ((endTime-startTime)*1e-3) << "ms"
+      uint64_t endTime = util::hostTimeNanoseconds();
+      trace.add("runReference", startTime, endTime);
+      std::cout << "Reference took " << ((endTime-startTime)*1e-6) << "ms"
                 << std::endl << std::endl;
 
       // Check results
@@ -236,6 +364,8 @@ int main(int argc, char *argv[])
 
       delete[] reference;
     }
+
+    trace.write(profiler);
   }
   catch (cl::BuildError error)
   {
@@ -295,13 +425,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--image"))
     {
@@ -362,6 +488,28 @@ void parseArguments(int argc, char *argv[])
         exit(1);
       }
       wgsize = cl::NDRange(width, height);
+      wgsizeSet = true;
+    }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
+    else if (!strcmp(argv[i], "--tune"))
+    {
+      tune = true;
+    }
+    else if (!strcmp(argv[i], "--pageable"))
+    {
+      pageable = true;
+    }
+    else if (util::parseBenchmarkArgument(argc, argv, i, benchOptions))
+    {
+      continue;
     }
 #ifndef USE_SDL
     else if (!strcmp(argv[i], "--width"))
@@ -388,7 +536,7 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "      --image      FILE    Use FILE as input (must be 32-bit RGBA)" << std::endl;
       std::cout << "  -i  --iterations ITRS    Number of benchmark iterations" << std::endl;
       std::cout << "      --noverify           Skip verification" << std::endl;
@@ -396,6 +544,10 @@ void parseArguments(int argc, char *argv[])
       std::cout << "      --sd         D       Set sigma domain" << std::endl;
       std::cout << "      --sr         R       Set sigma range" << std::endl;
       std::cout << "      --wgsize     W H     Work-group width and height" << std::endl;
+      std::cout << "      --tune               Search for the best work-group size" << std::endl;
+      std::cout << "      --pageable           Use pageable instead of pinned host memory" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
+      util::printBenchmarkUsage();
 #ifndef USE_SDL
       std::cout << "      --width      W       Set image width" << std::endl;
       std::cout << "      --height     H       Set image height" << std::endl;
@@ -14,6 +14,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -40,6 +41,11 @@ HostImage* createHostImage(int width, int height);
 
 #include <device_picker.hpp>
 #include <util.hpp>
+#include <benchmark.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
+#include <autotune.hpp>
+#include <pinned_allocator.hpp>
 
 #undef main
 #undef min
@@ -61,7 +67,12 @@ int      width         =  1920;
 int      height        =  1080;
 #endif
 cl::NDRange wgsize     = cl::NullRange;
+bool     wgsizeSet     =  false;
+bool     tune          =  false;
+bool     pageable      =  false;
 const char *inputFile  =  "1080p.bmp";
+util::BenchmarkOptions benchOptions;
+std::string traceFile;
 
 int main(int argc, char *argv[])
 {
@@ -69,6 +80,8 @@ int main(int argc, char *argv[])
   {
     parseArguments(argc, argv);
 
+    util::Trace trace(traceFile);
+
     // Get list of devices
     std::vector<cl::Device> devices;
     getDeviceList(devices);
@@ -87,9 +100,8 @@ int main(int argc, char *argv[])
               << std::endl;
 
     cl::Context context(device);
-    cl::CommandQueue queue(context);
-    cl::Program program(context, util::loadProgram("bilateral_meta.cl"));
-
+    util::Profiler profiler(trace.enabled() || tune);
+    cl::CommandQueue queue = profiler.createQueue(context, device);
     std::stringstream options;
     options.setf(std::ios::fixed);
     options << " -cl-fast-relaxed-math";
@@ -97,12 +109,18 @@ int main(int argc, char *argv[])
     options << " -DRADIUS=" << radius;
     options << " -DSIGMA_DOMAIN=" << sigmaDomain;
     options << " -DSIGMA_RANGE=" << sigmaRange;
-    program.build(options.str().c_str());
+    cl::Program program;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      program =
+        util::buildProgram(context, util::loadProgram("bilateral_meta.cl"), options.str());
+    }
 
     cl::KernelFunctor<cl::Buffer, cl::Buffer>
       kernel(program, "bilateral");
 
     // Load input image
+    uint64_t loadStart = util::hostTimeNanoseconds();
 #ifdef USE_SDL
     SDL_Surface *image = SDL_LoadBMP(inputFile);
     if (!image)
@@ -117,35 +135,74 @@ int main(int argc, char *argv[])
       image->pixels[i] = rand() % 256;
     }
 #endif
+    trace.add("load image", loadStart, util::hostTimeNanoseconds());
     std::cout << "Processing image of size " << image->w << "x" << image->h
               << std::endl << std::endl;
 
+    // Stage transfers through pinned memory unless --pageable was given
+    size_t imageBytes = (size_t)image->w*image->h*4;
+    util::cl_pinned_allocator<uint8_t> alloc(context, queue, !pageable);
+    util::pinned_vector<uint8_t> staging(imageBytes, 0, alloc);
+    memcpy(staging.data(), image->pixels, imageBytes);
+
     cl::Buffer input(context, CL_MEM_READ_ONLY, image->w*image->h*4);
     cl::Buffer output(context, CL_MEM_WRITE_ONLY, image->w*image->h*4);
 
     // Write image to device
     queue.enqueueWriteBuffer(input, CL_TRUE, 0,
-                             image->w*image->h*4, image->pixels);
+                             imageBytes, staging.data(), NULL,
+                             profiler.event("write image"));
 
 
     cl::NDRange global(image->h, image->w);
 
+    // Use the tuned work-group size unless one was given
+    if (tune || !wgsizeSet)
+    {
+      std::stringstream problem;
+      problem << image->w << "x" << image->h << ",r=" << radius;
+      util::Tuner tuner(device, "bilateral_meta", problem.str());
+      tuner.addParameter("LX", {1, 2, 4, 8, 16, 32, 64}, util::Tuner::LOCAL_SIZE);
+      tuner.addParameter("LY", {1, 2, 4, 8, 16, 32}, util::Tuner::LOCAL_SIZE);
+      tuner.addConstraint([&](const util::TuningConfig& c)
+                          { return global[0] % c.at("LX") == 0 &&
+                                   global[1] % c.at("LY") == 0; });
+
+      // No defaults - leave the choice to the runtime if not tuned
+      util::TuningConfig config = tuner.select(tune, util::TuningConfig(),
+        [&](const util::TuningConfig& c)
+        {
+          return kernel(cl::EnqueueArgs(queue, global,
+                                        cl::NDRange(c.at("LX"), c.at("LY"))),
+                        input, output);
+        });
+      if (!config.empty())
+      {
+        wgsize = cl::NDRange(config.at("LX"), config.at("LY"));
+        std::cout << "Work-group size: " << config.at("LX") << "x"
+                  << config.at("LY") << std::endl << std::endl;
+      }
+    }
+
     // Apply filter
     std::cout << "Running OpenCL..." << std::endl;
-    util::Timer timer;
-    uint64_t startTime = timer.getTimeMicroseconds();
-    for (unsigned i = 0; i < iterations; i++)
+    util::Benchmark bench(benchOptions);
+    util::BenchmarkResult timing = bench.run("bilateral", [&]()
     {
-      kernel(cl::EnqueueArgs(queue, global, wgsize),
-             input, output);
-    }
-    queue.finish();
-    uint64_t endTime = timer.getTimeMicroseconds();
-    double total = ((endTime-startTime)*1e-3);
+      for (unsigned i = 0; i < iterations; i++)
+      {
+        profiler.record("bilateral",
+          kernel(cl::EnqueueArgs(queue, global, wgsize),
+                 input, output));
+      }
+      queue.finish();
+    }, iterations*(double)image->w*image->h*4*2*1e-9, "GB/s");
+    double total = timing.stats.median*1e3;
     std::cout << std::fixed << std::setprecision(1);
     std::cout << "OpenCL took " << total << "ms"
               << " (" << (total/iterations) << "ms / frame)"
-              << std::endl << std::endl;
+              << std::endl;
+    bench.report();
 
 #ifdef USE_SDL
     // Save result to file
@@ -153,13 +210,17 @@ int main(int argc, char *argv[])
                                              image->format, image->flags);
     SDL_LockSurface(result);
     queue.enqueueReadBuffer(output, CL_TRUE, 0,
-                            image->w*image->h*4, result->pixels);
+                            imageBytes, staging.data(), NULL,
+                            profiler.event("read image"));
+    memcpy(result->pixels, staging.data(), imageBytes);
     SDL_UnlockSurface(result);
     SDL_SaveBMP(result, "output.bmp");
 #else
     HostImage *result = createHostImage(image->w, image->h);
     queue.enqueueReadBuffer(output, CL_TRUE, 0,
-                            image->w*image->h*4, result->pixels);
+                            imageBytes, staging.data(), NULL,
+                            profiler.event("read image"));
+    memcpy(result->pixels, staging.data(), imageBytes);
 #endif
 
     if (verify)
@@ -170,10 +231,11 @@ int main(int argc, char *argv[])
 #ifdef USE_SDL
       SDL_LockSurface(image);
 #endif
-      startTime = timer.getTimeMicroseconds();
+      uint64_t startTime = util::hostTimeNanoseconds();
       runReference((uint8_t*)image->pixels, reference, image->w, image->h);
-      endTime = timer.getTimeMicroseconds();
-      std::cout << "Reference took " << ((endTime-startTime)*1e-3) << "ms"
+      uint64_t endTime = util::hostTimeNanoseconds();
+      trace.add("runReference", startTime, endTime);
+      std::cout << "Reference took " << ((endTime-startTime)*1e-6) << "ms"
                 << std::endl << std::endl;
 
       // Check results
@@ -219,6 +281,8 @@ int main(int argc, char *argv[])
 
       delete[] reference;
     }
+
+    trace.write(profiler);
   }
   catch (cl::BuildError error)
   {
@@ -278,13 +342,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--image"))
     {
@@ -345,6 +405,28 @@ void parseArguments(int argc, char *argv[])
         exit(1);
       }
       wgsize = cl::NDRange(width, height);
+      wgsizeSet = true;
+    }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
+    else if (!strcmp(argv[i], "--tune"))
+    {
+      tune = true;
+    }
+    else if (!strcmp(argv[i], "--pageable"))
+    {
+      pageable = true;
+    }
+    else if (util::parseBenchmarkArgument(argc, argv, i, benchOptions))
+    {
+      continue;
     }
 #ifndef USE_SDL
     else if (!strcmp(argv[i], "--width"))
@@ -371,7 +453,7 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "      --image      FILE    Use FILE as input (must be 32-bit RGBA)" << std::endl;
       std::cout << "  -i  --iterations ITRS    Number of benchmark iterations" << std::endl;
       std::cout << "      --noverify           Skip verification" << std::endl;
@@ -379,6 +461,10 @@ void parseArguments(int argc, char *argv[])
       std::cout << "      --sd         D       Set sigma domain" << std::endl;
       std::cout << "      --sr         R       Set sigma range" << std::endl;
       std::cout << "      --wgsize     W H     Work-group width and height" << std::endl;
+      std::cout << "      --tune               Search for the best work-group size" << std::endl;
+      std::cout << "      --pageable           Use pageable instead of pinned host memory" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
+      util::printBenchmarkUsage();
 #ifndef USE_SDL
       std::cout << "      --width      W       Set image width" << std::endl;
       std::cout << "      --height     H       Set image height" << std::endl;
@@ -92,11 +92,8 @@ int main(int argc, char *argv[])
   cl_command_queue queue = clCreateCommandQueue(context, device, 0, &err);
   checkError(err, "creating command queue");
 
-  // Create the program from the source buffer
+  // Load the kernel source
   char *source = loadProgram("bilateral_opt.cl");
-  cl_program program =
-    clCreateProgramWithSource(context, 1, (const char **)&source, NULL, &err);
-  checkError(err, "creating program");
 
   // Build the program
   char options[1024];
@@ -107,7 +104,7 @@ int main(int argc, char *argv[])
     " -DSIGMA_DOMAIN=%.5ff"
     " -DSIGMA_RANGE=%.5ff",
     radius, sigmaDomain, sigmaRange);
-  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  cl_program program = buildProgram(context, device, source, options, &err);
   checkError(err, "building program");
 
   // Create the kernel
@@ -284,13 +281,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, &i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        printf("Invalid device index\n");
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--image"))
     {
@@ -379,7 +372,7 @@ void parseArguments(int argc, char *argv[])
       printf("Options:\n");
       printf("  -h  --help               Print the message\n");
       printf("      --list               List available devices\n");
-      printf("      --device     INDEX   Select device at INDEX\n");
+      printDeviceUsage();
       printf("      --image      FILE    Use FILE as input (must be 32-bit RGBA)\n");
       printf("  -i  --iterations ITRS    Number of benchmark iterations\n");
       printf("      --noverify           Skip verification\n");
@@ -173,10 +173,7 @@ int main(int argc, char *argv[])
   cl_command_queue queue = clCreateCommandQueue(context, device, 0, &err);
   checkError(err, "Creating command queue");
 
-  cl_program program = clCreateProgramWithSource(context, 1, (const char **)&kernel_source, NULL, &err);
-  checkError(err, "Creating program");
-
-  err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+  cl_program program = buildProgram(context, device, kernel_source, NULL, &err);
   if (err != CL_SUCCESS)
   {
       size_t len;
@@ -282,13 +279,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, &i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        printf("Invalid device index\n");
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--size") || !strcmp(argv[i], "-s"))
     {
@@ -313,7 +306,7 @@ void parseArguments(int argc, char *argv[])
       printf("Options:\n");
       printf("  -h  --help               Print the message\n");
       printf("      --list               List available devices\n");
-      printf("      --device     INDEX   Select device at INDEX\n");
+      printDeviceUsage();
       printf("  -s  --size       S       Buffer size in MB\n");
       printf("  -i  --iterations ITRS    Number of benchmark iterations\n");
       printf("\n");
@@ -14,6 +14,7 @@
 
 #include <iomanip>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #ifdef __APPLE__
@@ -26,13 +27,18 @@
 
 #include <device_picker.hpp>
 #include <util.hpp>
+#include <benchmark.hpp>
+#include <pinned_allocator.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
 
 void parseArguments(int argc, char *argv[]);
 
 // Benchmark parameters, with default values.
 unsigned deviceIndex   =      0;
 unsigned bufferSize    =      2; // Size in MB
-unsigned iterations    =     32;
+util::BenchmarkOptions benchOptions;
+std::string traceFile;
 
 const char *kernel_source =
 "kernel void fill(global uint *data, uint value)"
@@ -54,68 +60,84 @@ bool checkOutput(cl_uint *data, cl_uint value)
   return pass;
 }
 
-void runBenchmark(cl::Context& context, cl::CommandQueue& queue,
+void runBenchmark(util::Benchmark& bench, util::Profiler& profiler,
+                  util::Trace& trace, const std::string& name,
+                  cl::CommandQueue& queue,
                   cl::KernelFunctor<cl::Buffer, cl_uint> fill,
                   cl::Buffer& d_buffer, // device buffer
                   cl_uint    *h_buffer, // host buffer, ignored for zero-copy
                   bool zeroCopy)
 {
   bool pass = true;
-  util::Timer timer;
-  uint64_t transferTime = 0;
-  uint64_t startTime = timer.getTimeMicroseconds();
-  for (cl_uint i = 0; i < iterations; i++)
+  bool pending = false; // transfer waiting to be checked
+  cl_uint value = 0;
+
+  // Check data from the previous transfer and release any mapping
+  std::function<void()> check = [&]()
   {
-    // Run fill kernel
-    fill(cl::EnqueueArgs(queue, cl::NDRange(bufferSize/4)), d_buffer, i);
-    queue.finish();
+    if (!pending)
+      return;
 
-    uint64_t startTransfer = timer.getTimeMicroseconds();
+    pass &= checkOutput(h_buffer, value);
 
+    if (zeroCopy)
+    {
+      // Unmap host pointer
+      queue.enqueueUnmapMemObject(d_buffer, h_buffer, NULL,
+                                  profiler.event(name + " unmap"));
+    }
+    pending = false;
+  };
+
+  util::Timer timer;
+  uint64_t startTime = timer.getTimeMicroseconds();
+  util::BenchmarkResult result = bench.run(name, [&]()
+  {
+    util::Trace::Region region(trace, name);
     if (zeroCopy)
     {
       // Map device buffer to get host pointer
       h_buffer = (cl_uint*)queue.enqueueMapBuffer(
-        d_buffer, CL_TRUE, CL_MAP_READ, 0, bufferSize
+        d_buffer, CL_TRUE, CL_MAP_READ, 0, bufferSize,
+        NULL, profiler.event(name + " map")
       );
     }
     else
     {
       // Read data from device buffer to host buffer
-      queue.enqueueReadBuffer(d_buffer, CL_TRUE, 0, bufferSize, h_buffer);
-    }
-    uint64_t endTransfer = timer.getTimeMicroseconds();
-
-    // Check data
-    pass &= checkOutput(h_buffer, i);
-
-    if (zeroCopy)
-    {
-      // Unmap host pointer
-      queue.enqueueUnmapMemObject(d_buffer, h_buffer);
+      queue.enqueueReadBuffer(d_buffer, CL_TRUE, 0, bufferSize, h_buffer,
+                              NULL, profiler.event(name + " read"));
     }
+    pending = true;
+  }, bufferSize*1e-9, "GB/s",
+  [&]()
+  {
+    check();
 
-    transferTime += (endTransfer - startTransfer);
-  }
+    // Run fill kernel
+    value++;
+    profiler.record("fill",
+      fill(cl::EnqueueArgs(queue, cl::NDRange(bufferSize/4)), d_buffer, value));
+    queue.finish();
+  });
+  check();
   queue.finish();
 
   // Print stats
   uint64_t endTime  = timer.getTimeMicroseconds();
   double seconds    = (endTime - startTime) * 1e-6;
-  double totalBytes = iterations * (double)bufferSize;
-  double bandwidth  = (totalBytes / transferTime) * 1e-3;
   std::cout << std::fixed << std::setprecision(2);
   if (pass)
   {
     std::cout << "   " << std::setw(6) << seconds   << "s"
-              << "   " << std::setw(7) << transferTime*1e-6 << "s"
-              << "   " << std::setw(8) << bandwidth << " GB/s"
+              << "   " << std::setw(7) << result.stats.median*1e3 << "ms"
+              << "   " << std::setw(8) << result.throughput() << " GB/s"
               << std::endl;
   }
   else
   {
     std::cout << "   " << std::setw(6) << "-" << "s"
-              << "   " << std::setw(7) << "-" << "s"
+              << "   " << std::setw(7) << "-" << "ms"
               << "   " << std::setw(8) << "-" << " GB/s"
               << "   FAILED"
               << std::endl;
@@ -126,8 +148,11 @@ int main(int argc, char *argv[])
 {
   try
   {
+    benchOptions.repetitions = 32;
     parseArguments(argc, argv);
 
+    util::Trace trace(traceFile);
+
     // Get list of devices
     std::vector<cl::Device> devices;
     getDeviceList(devices);
@@ -144,7 +169,7 @@ int main(int argc, char *argv[])
     std::string name = getDeviceName(device);
     std::cout << std::endl << "Using OpenCL device: " << name << std::endl
               << "Buffer size = " << bufferSize << " MB" << std::endl
-              << "Iterations  = " << iterations << std::endl;
+              << "Iterations  = " << benchOptions.repetitions << std::endl;
 
     bool unifiedMemory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
     std::cout << (unifiedMemory ?
@@ -157,11 +182,18 @@ int main(int argc, char *argv[])
     bufferSize *= 1024*1024;
 
     cl::Context context(device);
-    cl::CommandQueue queue(context);
-    cl::Program program(context, kernel_source, true);
+    util::Profiler profiler(trace.enabled());
+    cl::CommandQueue queue = profiler.createQueue(context, device);
+    cl::Program program;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      program = util::buildProgram(context, kernel_source);
+    }
     cl::KernelFunctor<cl::Buffer, cl_uint> fill(program, "fill");
 
-    std::cout << "Type          Total   Transfer       Bandwidth" << std::endl
+    util::Benchmark bench(benchOptions);
+
+    std::cout << "Type          Total     Median       Bandwidth" << std::endl
               << "----------------------------------------------" << std::endl;
 
 
@@ -174,7 +206,7 @@ int main(int argc, char *argv[])
       cl_uint *h_buffer = new cl_uint[bufferSize/4];
 
       std::cout << "Baseline ";
-      runBenchmark(context, queue, fill, d_buffer, h_buffer, false);
+      runBenchmark(bench, profiler, trace, "Baseline", queue, fill, d_buffer, h_buffer, false);
 
       delete[] h_buffer;
     }
@@ -187,25 +219,24 @@ int main(int argc, char *argv[])
       // No separate host buffer needed
 
       std::cout << "Zero-Copy";
-      runBenchmark(context, queue, fill, d_buffer, NULL, true);
+      runBenchmark(bench, profiler, trace, "Zero-Copy", queue, fill, d_buffer, NULL, true);
     }
     else
     {
       // Create device buffer
       cl::Buffer d_buffer(context, CL_MEM_READ_WRITE, bufferSize);
 
-      // Create a pinned host buffer (using a mapped device buffer)
-      cl::Buffer d_pinned(context, CL_MEM_ALLOC_HOST_PTR, bufferSize);
-      cl_uint *h_pinned = (cl_uint*)queue.enqueueMapBuffer(
-        d_pinned, CL_TRUE, CL_MAP_READ, 0, bufferSize
-      );
+      // Create a pinned host buffer (backed by a mapped device buffer)
+      util::cl_pinned_allocator<cl_uint> alloc(context, queue);
+      util::pinned_vector<cl_uint> h_pinned(bufferSize/4, 0, alloc);
 
       std::cout << "Pinned   ";
-      runBenchmark(context, queue, fill, d_buffer, h_pinned, false);
-
-      // Unmap pinned host buffer
-      queue.enqueueUnmapMemObject(d_pinned, h_pinned);
+      runBenchmark(bench, profiler, trace, "Pinned", queue, fill, d_buffer, h_pinned.data(), false);
     }
+
+    bench.report();
+
+    trace.write(profiler);
   }
   catch (cl::BuildError error)
   {
@@ -258,13 +289,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--size") || !strcmp(argv[i], "-s"))
     {
@@ -276,12 +303,25 @@ void parseArguments(int argc, char *argv[])
     }
     else if (!strcmp(argv[i], "--iterations") || !strcmp(argv[i], "-i"))
     {
-      if (++i >= argc || !parseUInt(argv[i], &iterations))
+      if (++i >= argc || !parseUInt(argv[i], &benchOptions.repetitions))
       {
         std::cout << "Invalid number of iterations" << std::endl;
         exit(1);
       }
     }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
+    else if (util::parseBenchmarkArgument(argc, argv, i, benchOptions))
+    {
+      continue;
+    }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
       std::cout << std::endl;
@@ -289,9 +329,11 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "  -s  --size       S       Buffer size in MB" << std::endl;
       std::cout << "  -i  --iterations ITRS    Number of benchmark iterations" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
+      util::printBenchmarkUsage();
       std::cout << std::endl;
       exit(0);
     }
@@ -0,0 +1,122 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Batched Matrix Multipliplication kernels
+//
+//  PURPOSE: Computes the products of a batch of small,
+//           independent n x n matrices in one launch
+//
+//              C[m] = A[m] * B[m]     m = 0 .. batch-1
+//
+//           mmul_strided finds matrix m at m*stride in each
+//           buffer, while mmul_indexed reads its offset from an
+//           array (the OpenCL 1.2 equivalent of an array of
+//           pointers), so the matrices can be anywhere in the
+//           buffers and in any order.
+//
+//           The work-group is TS x TS x MPG: each of the MPG
+//           slices computes a TS x TS block of a different
+//           matrix, so several very small matrices share one
+//           work-group.  The NDRange is
+//
+//              (roundUp(n,TS), roundUp(n,TS), roundUp(batch,MPG))
+//
+//           and blocks that overhang a matrix, or matrices past
+//           the end of the batch, are padded with zeros.
+//
+//           Build-time constants:
+//             TS   ... block size (work-group is TS x TS x MPG)
+//             MPG  ... matrices per work-group
+//
+//  LICENSE: This work is licensed under the Creative Commons
+//           Attribution 4.0 International License.
+//           To view a copy of this license, visit
+//           http://creativecommons.org/licenses/by/4.0/
+//           or send a letter to:
+//              Creative Commons,
+//              444 Castro Street, Suite 900,
+//              Mountain View, California, 94041, USA.
+//
+//-------------------------------------------------------------
+
+// Computes one TS x TS block of C = A * B.  Every work-item in the
+// group must call this, even those with valid == 0, so that they all
+// reach the barriers.
+void mmul_block(
+                const int                      n,
+                const int                      valid,
+                __global const float* restrict A,
+                __global const float* restrict B,
+                __global       float* restrict C,
+                __local        float* restrict Asub,
+                __local        float* restrict Bsub)
+{
+    const int tx  = get_local_id(0);
+    const int ty  = get_local_id(1);
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+
+    float acc = 0.0f;
+
+    for (int k0 = 0; k0 < n; k0 += TS)
+    {
+        Asub[ty*TS+tx] = (valid && row < n && k0+tx < n) ? A[row*n + k0+tx]   : 0.0f;
+        Bsub[ty*TS+tx] = (valid && k0+ty < n && col < n) ? B[(k0+ty)*n + col] : 0.0f;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TS; k++)
+            acc += Asub[ty*TS+k] * Bsub[k*TS+tx];
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (valid && row < n && col < n)
+        C[row*n + col] = acc;
+}
+
+__attribute__((reqd_work_group_size(TS, TS, MPG)))
+__kernel void mmul_strided(
+                const int                      n,
+                const int                      batch,
+                const unsigned int             strideA,
+                const unsigned int             strideB,
+                const unsigned int             strideC,
+                __global const float* restrict A,
+                __global const float* restrict B,
+                __global       float* restrict C)
+{
+    __local float Asub[MPG*TS*TS];
+    __local float Bsub[MPG*TS*TS];
+
+    const int z     = get_local_id(2);
+    const int m     = get_global_id(2);
+    const int valid = m < batch;
+    const size_t mm = valid ? m : 0;
+
+    mmul_block(n, valid, A + mm*strideA, B + mm*strideB, C + mm*strideC,
+               Asub + z*TS*TS, Bsub + z*TS*TS);
+}
+
+__attribute__((reqd_work_group_size(TS, TS, MPG)))
+__kernel void mmul_indexed(
+                const int                            n,
+                const int                            batch,
+                __global const unsigned int* restrict offsetA,
+                __global const unsigned int* restrict offsetB,
+                __global const unsigned int* restrict offsetC,
+                __global const float*        restrict A,
+                __global const float*        restrict B,
+                __global       float*        restrict C)
+{
+    __local float Asub[MPG*TS*TS];
+    __local float Bsub[MPG*TS*TS];
+
+    const int z     = get_local_id(2);
+    const int m     = get_global_id(2);
+    const int valid = m < batch;
+    const int mm    = valid ? m : 0;
+
+    mmul_block(n, valid, A + offsetA[mm], B + offsetB[mm], C + offsetC[mm],
+               Asub + z*TS*TS, Bsub + z*TS*TS);
+}
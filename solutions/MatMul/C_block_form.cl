@@ -27,6 +27,15 @@
 //             i,j,k            ... indices of full, global matrices 
 //             Iblk, Jblk, Kblk ... indices of matrix blocks
 //             iloc, jloc, kloc ... indices inside blocks
+//
+//           A is M x K, B is K x N and C is M x N.  The sizes
+//           need not be multiples of blksz: the NDRange is rounded
+//           up to whole blocks, elements of A and B outside the
+//           matrices are loaded as zero, and work-items outside C
+//           store nothing.
+//
+//           The matrices are float unless -DPRECISION=16 (half
+//           storage, float arithmetic) or 64 (double) is given.
 //                 
 //  HISTORY: Written by Tim Mattson, November 2013 
 //           Updated by Simon McIntosh-Smith, August 2014 
@@ -48,16 +57,94 @@
 // BLKSZ must be passed in as a kernel build time constant from the host code
 #define blksz BLKSZ
 
+// Storage and arithmetic types, selected with -DPRECISION:
+//
+//   16  half storage, read and written with vload_half/vstore_half
+//       (so cl_khr_fp16 is not needed) and float arithmetic
+//   32  float (the default)
+//   64  double, which needs cl_khr_fp64
+#ifndef PRECISION
+#define PRECISION 32
+#endif
+#if PRECISION == 16
+typedef half   storage_t;
+typedef float  real_t;
+typedef float4 real4_t;
+#define LOAD(p)     vload_half(0, (p))
+#define LOAD4(p)    vload_half4(0, (p))
+#define STORE(p, x) vstore_half((x), 0, (p))
+#elif PRECISION == 64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double  storage_t;
+typedef double  real_t;
+typedef double4 real4_t;
+#define LOAD(p)     (*(p))
+#define LOAD4(p)    vload4(0, (p))
+#define STORE(p, x) (*(p) = (x))
+#else
+typedef float  storage_t;
+typedef float  real_t;
+typedef float4 real4_t;
+#define LOAD(p)     (*(p))
+#define LOAD4(p)    vload4(0, (p))
+#define STORE(p, x) (*(p) = (x))
+#endif
+
+// Optional epilogue, applied to each element of C in registers before
+// it is stored.  Everything is selected at build time, so the plain
+// product pays nothing for it:
+//
+//   -DEPILOGUE              C = act(alpha*A*B + beta*C + bias), and the
+//                           kernel takes alpha, beta and bias after its
+//                           other arguments
+//   -DEPILOGUE_BETA         include beta*C (reads the old value of C)
+//   -DEPILOGUE_BIAS=1 or 2  add bias[row] or bias[column]
+//   -DEPILOGUE_ACT=1 or 2   apply ReLU or GELU (tanh approximation)
+#ifdef EPILOGUE
+#define EPILOGUE_ARGS , const float alpha, const float beta, \
+                        __global const float* restrict bias
+
+inline real_t epilogue(real_t acc, __global const storage_t* c,
+                       const float alpha, const float beta,
+                       __global const float* bias, int row, int col)
+{
+    real_t x = alpha * acc;
+#ifdef EPILOGUE_BETA
+    x += beta * LOAD(c);
+#endif
+#if EPILOGUE_BIAS == 1
+    x += bias[row];
+#elif EPILOGUE_BIAS == 2
+    x += bias[col];
+#endif
+#if EPILOGUE_ACT == 1
+    x = fmax(x, (real_t)0.0f);
+#elif EPILOGUE_ACT == 2
+    x = 0.5f * x * (1.0f + tanh(0.7978845608f * (x + 0.044715f * x*x*x)));
+#endif
+    return x;
+}
+
+#define EPILOGUE_STORE(c, acc, row, col) \
+    STORE((c), epilogue((acc), (c), alpha, beta, bias, (row), (col)))
+#else
+#define EPILOGUE_ARGS
+#define EPILOGUE_STORE(c, acc, row, col) STORE((c), (acc))
+#endif
+
 __kernel void mmul(
+                const unsigned int             M,
                 const unsigned int             N,
-                __global const float* restrict A,
-                __global const float* restrict B,
-                __global       float* restrict C,
-                __local        float* restrict Awrk,
-                __local        float* restrict Bwrk)
+                const unsigned int             K,
+                __global const storage_t* restrict A,
+                __global const storage_t* restrict B,
+                __global       storage_t* restrict C,
+                __local        real_t*    restrict Awrk,
+                __local        real_t*    restrict Bwrk
+                EPILOGUE_ARGS)
 {
     int kloc, Kblk;
-    float Ctmp=0.0f;
+    real_t Ctmp=0.0f;
 
     //  This work-item will compute element C(i,j)
     const int i = get_global_id(0);
@@ -71,17 +158,19 @@ __kernel void mmul(
     const int iloc = get_local_id(0);
     const int jloc = get_local_id(1);
 
-    // The number of blocks are the same in each dimension
-    const int Num_BLK = N/blksz;
+    // The number of blocks along the inner dimension, including
+    // any partial block at the end
+    const int Num_BLK = (K + blksz - 1)/blksz;
 
     // Setup the upper-left-corner (base address) for the A and
     // B blocks plus the increments to advance base addresses as
-    // we loop over blocks
-          int Abase = Jblk*N*blksz;
-    const int Ainc  = blksz;
+    // we loop over blocks.  These are size_t, as the offsets into
+    // large matrices can exceed 2^31 elements
+          size_t Abase = (size_t)Jblk*K*blksz;
+    const size_t Ainc  = blksz;
 
-          int Bbase = Iblk*blksz;
-    const int Binc  = blksz*N;
+          size_t Bbase = Iblk*blksz;
+    const size_t Binc  = (size_t)blksz*N;
 
 
     // C(Iblk,Jblk) = (sum over Kblk) A(Iblk,Kblk)*B(Kblk,Jblk)
@@ -91,8 +180,11 @@ __kernel void mmul(
        // Each work-item loads a single element of the two blocks
        // which are shared with the entire work-group.
 
-       Awrk[jloc*blksz+iloc] = A[Abase+jloc*N+iloc];
-       Bwrk[jloc*blksz+iloc] = B[Bbase+jloc*N+iloc];
+       // Element A(j, Kblk*blksz+iloc) and B(Kblk*blksz+jloc, i)
+       const int kA = Kblk*blksz + iloc;
+       const int kB = Kblk*blksz + jloc;
+       Awrk[jloc*blksz+iloc] = (j < M && kA < K) ? LOAD(&A[Abase+(size_t)jloc*K+iloc]) : 0.0f;
+       Bwrk[jloc*blksz+iloc] = (kB < K && i < N) ? LOAD(&B[Bbase+(size_t)jloc*N+iloc]) : 0.0f;
 
        barrier(CLK_LOCAL_MEM_FENCE);
 
@@ -108,6 +200,7 @@ __kernel void mmul(
     }
  
     // update global C matrix 
-    C[j*N+i] = Ctmp;
+    if (i < N && j < M)
+        EPILOGUE_STORE(&C[(size_t)j*N+i], Ctmp, j, i);
 
 }
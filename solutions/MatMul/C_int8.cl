@@ -0,0 +1,128 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Quantized (int8) Matrix Multipliplication kernel
+//
+//  PURPOSE: Computes the product of int8 matrices with int32
+//           accumulation
+//
+//              C(M,N) = A(M,K) * B(K,N)
+//
+//           A is stored by rows and B is stored transposed (N x K
+//           by rows), each row padded with zeros to K4 = K/4
+//           rounded up char4 vectors, so both operands of the
+//           inner loop are contiguous char4s.  Each work-item
+//           computes one element of C, and a TS x TS work-group
+//           stages a TS x TS char4 (4*TS deep) tile of A and of B
+//           in local memory.  The NDRange is
+//
+//              (roundUp(N,TS), roundUp(M,TS))
+//
+//           and tiles past the edges of A and B load zeros.
+//
+//           Build-time constants:
+//             TS       ... tile size (work-group is TS x TS)
+//             REQUANT  ... 0: C is the int32 accumulator
+//                          1: C is int8, requantized with one
+//                             scale and zero point
+//                          2: C is int8, requantized with a
+//                             scale and zero point per row
+//             DOT8     ... use dot() from cl_khr_integer_dot_product, if the
+//                          4x8-bit input feature is available
+//
+//           Requantization computes
+//
+//              C = sat8(rint(acc * scale) + zero)
+//
+//           in float, with the scale and zero point of the row
+//           (or element 0 for REQUANT=1).
+//
+//  LICENSE: This work is licensed under the Creative Commons
+//           Attribution 4.0 International License.
+//           To view a copy of this license, visit
+//           http://creativecommons.org/licenses/by/4.0/
+//           or send a letter to:
+//              Creative Commons,
+//              444 Castro Street, Suite 900,
+//              Mountain View, California, 94041, USA.
+//
+//-------------------------------------------------------------
+
+#ifndef REQUANT
+#define REQUANT 0
+#endif
+
+// Dot product of four int8 pairs, in one instruction where the
+// device supports it (the feature macro is only defined when the
+// compiler provides dot() for char4 inputs)
+#if defined(DOT8) && defined(__opencl_c_integer_dot_product_input_4x8bit)
+#pragma OPENCL EXTENSION cl_khr_integer_dot_product : enable
+#define dot4(a, b) dot((a), (b))
+#else
+inline int dot4(char4 a, char4 b)
+{
+    int4 p = convert_int4(a) * convert_int4(b);
+    return p.x + p.y + p.z + p.w;
+}
+#endif
+
+#if REQUANT == 0
+typedef int  out_t;
+#define REQUANT_ARGS
+#define OUTPUT(acc, row) (acc)
+#else
+typedef char out_t;
+#define REQUANT_ARGS , __global const float* restrict scale, \
+                       __global const int*   restrict zero
+#if REQUANT == 1
+#define QROW(row) 0
+#else
+#define QROW(row) (row)
+#endif
+#define OUTPUT(acc, row) \
+    convert_char_sat(add_sat(convert_int_sat_rte(convert_float(acc) * scale[QROW(row)]), \
+                             zero[QROW(row)]))
+#endif
+
+__attribute__((reqd_work_group_size(TS, TS, 1)))
+__kernel void mmul_int8(
+                const int                      M,
+                const int                      N,
+                const int                      K4,
+                __global const char4* restrict A,
+                __global const char4* restrict Bt,
+                __global       out_t* restrict C
+                REQUANT_ARGS)
+{
+    // Bsub is read down its columns, so pad the rows
+    __local char4 Asub[TS][TS];
+    __local char4 Bsub[TS][TS+1];
+
+    const int tx  = get_local_id(0);
+    const int ty  = get_local_id(1);
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+
+    // Rows of A and Bt loaded by this work-item
+    const int arow = get_group_id(1)*TS + ty;
+    const int brow = get_group_id(0)*TS + ty;
+
+    int acc = 0;
+
+    for (int k0 = 0; k0 < K4; k0 += TS)
+    {
+        const int k = k0 + tx;
+        Asub[ty][tx] = (arow < M && k < K4) ? A[(size_t)arow*K4 + k]  : (char4)(0);
+        Bsub[ty][tx] = (brow < N && k < K4) ? Bt[(size_t)brow*K4 + k] : (char4)(0);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int kk = 0; kk < TS; kk++)
+            acc += dot4(Asub[ty][kk], Bsub[tx][kk]);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (row < M && col < N)
+        C[(size_t)row*N + col] = OUTPUT(acc, row);
+}
@@ -1,6 +1,8 @@
 
 __kernel void mmul(
+    const int M,
     const int N,
+    const int K,
     __global float* A,
     __global float* B,
     __global float* C)
@@ -8,11 +10,11 @@ __kernel void mmul(
     int k, j;
     int i = get_global_id(0);
     float tmp;
-    if (i < N) {
+    if (i < M) {
         for (j = 0; j < N; j++) {
             tmp = 0.0;
-            for (k = 0; k < N; k++)
-                tmp += A[i*N+k] * B[k*N+j];
+            for (k = 0; k < K; k++)
+                tmp += A[i*K+k] * B[k*N+j];
             C[i*N+j] = tmp;
         }
     }
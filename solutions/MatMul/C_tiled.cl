@@ -0,0 +1,240 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Register tiled Matrix Multipliplication kernel
+//
+//  PURPOSE: Computes a tile of the product matrix
+//
+//              C = A * B
+//
+//           Each work-group computes a BM x BN tile of C, where
+//           BM = WY*TM and BN = WX*TN.  Each work-item computes
+//           TM x TN elements of that tile and keeps them in
+//           registers, so every value it reads from local memory
+//           is used TM or TN times instead of once.
+//
+//           The K dimension is walked TK columns of A (rows of B)
+//           at a time.  The A and B tiles are loaded with float4
+//           vector loads and stored in local memory with one
+//           column of padding, so that the transposed stores of A
+//           and the strided reads of both tiles do not all land in
+//           the same local memory bank.
+//
+//           Work-item (tx,ty) computes the elements in rows
+//           ty, ty+WY, ty+2*WY, ... and columns tx, tx+WX, ... of
+//           the tile, so neighbouring work-items read neighbouring
+//           words of local memory and write neighbouring words of C.
+//
+//           Build-time constants:
+//             TM, TN  ... micro-tile of C per work-item
+//             TK      ... depth of the A and B tiles (multiple of 4)
+//             WX, WY  ... work-group size (WX*TN a multiple of 4)
+//
+//           A is M x K, B is K x N and C is M x N, with no
+//           restriction on the sizes.  The NDRange is rounded up to
+//           whole tiles; tiles that overhang the edge of A or B are
+//           loaded with scalar loads that pad with zeros, and
+//           elements outside C are not stored.  All other tiles take
+//           the vector path, so performance holds up for sizes that
+//           are not multiples of the tile size.
+//
+//           -DPRECISION=16 stores the matrices as half (converted
+//           to float as they are loaded, so the tiles and the
+//           accumulation are float) and 64 makes everything double;
+//           the default is float.
+//
+//  LICENSE: This work is licensed under the Creative Commons
+//           Attribution 4.0 International License.
+//           To view a copy of this license, visit
+//           http://creativecommons.org/licenses/by/4.0/
+//           or send a letter to:
+//              Creative Commons,
+//              444 Castro Street, Suite 900,
+//              Mountain View, California, 94041, USA.
+//
+//-------------------------------------------------------------
+
+// Storage and arithmetic types (-DPRECISION=16, 32 or 64), as in
+// C_block_form.cl
+#ifndef PRECISION
+#define PRECISION 32
+#endif
+#if PRECISION == 16
+typedef half   storage_t;
+typedef float  real_t;
+typedef float4 real4_t;
+#define LOAD(p)     vload_half(0, (p))
+#define LOAD4(p)    vload_half4(0, (p))
+#define STORE(p, x) vstore_half((x), 0, (p))
+#elif PRECISION == 64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double  storage_t;
+typedef double  real_t;
+typedef double4 real4_t;
+#define LOAD(p)     (*(p))
+#define LOAD4(p)    vload4(0, (p))
+#define STORE(p, x) (*(p) = (x))
+#else
+typedef float  storage_t;
+typedef float  real_t;
+typedef float4 real4_t;
+#define LOAD(p)     (*(p))
+#define LOAD4(p)    vload4(0, (p))
+#define STORE(p, x) (*(p) = (x))
+#endif
+
+#define BM (WY*TM)
+#define BN (WX*TN)
+#define PAD 1
+
+// Optional epilogue on the accumulators, with the same build options
+// and extra arguments as C_block_form.cl:
+//
+//   -DEPILOGUE              C = act(alpha*A*B + beta*C + bias), and the
+//                           kernel takes alpha, beta and bias after its
+//                           other arguments
+//   -DEPILOGUE_BETA         include beta*C (reads the old value of C)
+//   -DEPILOGUE_BIAS=1 or 2  add bias[row] or bias[column]
+//   -DEPILOGUE_ACT=1 or 2   apply ReLU or GELU (tanh approximation)
+#ifdef EPILOGUE
+#define EPILOGUE_ARGS , const float alpha, const float beta, \
+                        __global const float* restrict bias
+
+inline real_t epilogue(real_t acc, __global const storage_t* c,
+                       const float alpha, const float beta,
+                       __global const float* bias, int row, int col)
+{
+    real_t x = alpha * acc;
+#ifdef EPILOGUE_BETA
+    x += beta * LOAD(c);
+#endif
+#if EPILOGUE_BIAS == 1
+    x += bias[row];
+#elif EPILOGUE_BIAS == 2
+    x += bias[col];
+#endif
+#if EPILOGUE_ACT == 1
+    x = fmax(x, (real_t)0.0f);
+#elif EPILOGUE_ACT == 2
+    x = 0.5f * x * (1.0f + tanh(0.7978845608f * (x + 0.044715f * x*x*x)));
+#endif
+    return x;
+}
+
+#define EPILOGUE_STORE(c, acc, row, col) \
+    STORE((c), epilogue((acc), (c), alpha, beta, bias, (row), (col)))
+#else
+#define EPILOGUE_ARGS
+#define EPILOGUE_STORE(c, acc, row, col) STORE((c), (acc))
+#endif
+
+__attribute__((reqd_work_group_size(WX, WY, 1)))
+__kernel void mmul(
+                const unsigned int             M,
+                const unsigned int             N,
+                const unsigned int             K,
+                __global const storage_t* restrict A,
+                __global const storage_t* restrict B,
+                __global       storage_t* restrict C
+                EPILOGUE_ARGS)
+{
+    // A tile is stored transposed, so both tiles are indexed [k][...]
+    __local real_t Asub[TK][BM+PAD];
+    __local real_t Bsub[TK][BN+PAD];
+
+    const int tx  = get_local_id(0);
+    const int ty  = get_local_id(1);
+    const int lid = ty*WX + tx;
+
+    // Upper-left corner of this work-group's tile of C.  Element offsets
+    // into the matrices are size_t, as they can exceed 2^31
+    const int row0 = get_group_id(1)*BM;
+    const int col0 = get_group_id(0)*BN;
+
+    real_t acc[TM][TN];
+    for (int i = 0; i < TM; i++)
+        for (int j = 0; j < TN; j++)
+            acc[i][j] = 0.0f;
+
+    real_t Areg[TM];
+    real_t Breg[TN];
+
+    for (int k0 = 0; k0 < K; k0 += TK)
+    {
+        // Load A(row0:row0+BM, k0:k0+TK), four elements of a row at a time
+        if (row0 + BM <= M && k0 + TK <= K)
+        {
+            for (int l = lid; l < BM*TK/4; l += WX*WY)
+            {
+                int row = l / (TK/4);
+                int k   = (l % (TK/4)) * 4;
+                real4_t a = LOAD4(A + (size_t)(row0+row)*K + k0 + k);
+                Asub[k+0][row] = a.x;
+                Asub[k+1][row] = a.y;
+                Asub[k+2][row] = a.z;
+                Asub[k+3][row] = a.w;
+            }
+        }
+        else
+        {
+            for (int l = lid; l < BM*TK; l += WX*WY)
+            {
+                int row = l / TK;
+                int k   = l % TK;
+                Asub[k][row] = (row0+row < M && k0+k < K) ?
+                               LOAD(A + (size_t)(row0+row)*K + k0 + k) : 0.0f;
+            }
+        }
+
+        // Load B(k0:k0+TK, col0:col0+BN), four elements of a row at a time
+        if (k0 + TK <= K && col0 + BN <= N)
+        {
+            for (int l = lid; l < BN*TK/4; l += WX*WY)
+            {
+                int k   = l / (BN/4);
+                int col = (l % (BN/4)) * 4;
+                vstore4(LOAD4(B + (size_t)(k0+k)*N + col0 + col), 0, &Bsub[k][col]);
+            }
+        }
+        else
+        {
+            for (int l = lid; l < BN*TK; l += WX*WY)
+            {
+                int k   = l / BN;
+                int col = l % BN;
+                Bsub[k][col] = (k0+k < K && col0+col < N) ?
+                               LOAD(B + (size_t)(k0+k)*N + col0 + col) : 0.0f;
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Accumulate the outer product of each column of the A tile
+        // and row of the B tile
+        #pragma unroll
+        for (int k = 0; k < TK; k++)
+        {
+            for (int i = 0; i < TM; i++)
+                Areg[i] = Asub[k][ty + i*WY];
+            for (int j = 0; j < TN; j++)
+                Breg[j] = Bsub[k][tx + j*WX];
+
+            for (int i = 0; i < TM; i++)
+                for (int j = 0; j < TN; j++)
+                    acc[i][j] = mad(Areg[i], Breg[j], acc[i][j]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // update global C matrix
+    for (int i = 0; i < TM; i++)
+    {
+        int row = row0 + ty + i*WY;
+        for (int j = 0; j < TN; j++)
+        {
+            int col = col0 + tx + j*WX;
+            if (row < M && col < N)
+                EPILOGUE_STORE(&C[(size_t)row*N + col], acc[i][j], row, col);
+        }
+    }
+}
@@ -1,6 +1,8 @@
 
 __kernel void mmul(
+    const int M,
     const int N,
+    const int K,
     __global float* A,
     __global float* B,
     __global float* C)
@@ -9,11 +11,11 @@ __kernel void mmul(
     int i = get_global_id(0);
     int j = get_global_id(1);
     float tmp;
-    if ((i < N) && (j < N))
+    if ((i < M) && (j < N))
     {
         tmp = 0.0;
-        for (k = 0; k < N; k++)
-            tmp += A[i*N+k] * B[k*N+j];
+        for (k = 0; k < K; k++)
+            tmp += A[i*K+k] * B[k*N+j];
         C[i*N+j] = tmp;
     }
 }
@@ -1,23 +1,32 @@
 
+// Rows of A longer than this are processed in chunks, accumulating
+// partial sums in C
+#define AWRK_SIZE 1024
+
 __kernel void mmul(
+    const int M,
     const int N,
+    const int K,
     __global float* A,
     __global float* B,
     __global float* C)
 {
-    int k, j;
+    int k, j, k0, klen;
     int i = get_global_id(0);
-    float Awrk[1024];
+    float Awrk[AWRK_SIZE];
     float tmp;
-    if (i < N) {
-        for (k = 0; k < N; k++)
-            Awrk[k] = A[i*N+k];
+    if (i < M) {
+        for (k0 = 0; k0 < K; k0 += AWRK_SIZE) {
+            klen = min(AWRK_SIZE, K - k0);
+            for (k = 0; k < klen; k++)
+                Awrk[k] = A[i*K+k0+k];
 
-        for (j = 0; j < N; j++) {
-            tmp = 0.0f;
-            for (k = 0; k < N; k++)
-                tmp += Awrk[k] * B[k*N+j];
-            C[i*N+j] = tmp;
+            for (j = 0; j < N; j++) {
+                tmp = (k0 == 0) ? 0.0f : C[i*N+j];
+                for (k = 0; k < klen; k++)
+                    tmp += Awrk[k] * B[(k0+k)*N+j];
+                C[i*N+j] = tmp;
+            }
         }
     }
 }
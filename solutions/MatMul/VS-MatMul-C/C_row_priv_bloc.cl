@@ -1,30 +1,44 @@
 
+// Rows of A longer than this are processed in chunks, accumulating
+// partial sums in C. Bwrk must hold min(K, AWRK_SIZE) floats.
+#define AWRK_SIZE 1024
+
 __kernel void mmul(
+    const int M,
     const int N,
+    const int K,
     __global float* A,
     __global float* B,
     __global float* C,
     __local float* Bwrk)
 {
-    int k, j;
+    int k, j, k0, klen;
     int i    = get_global_id(0);
     int iloc = get_local_id(0);
     int nloc = get_local_size(0);
-    float Awrk[1024];
+    float Awrk[AWRK_SIZE];
     float tmp;
-    if (i < N) {
-        for (k = 0; k < N; k++)
-            Awrk[k] = A[i*N+k];
+
+    // Work-items past the last row of C still help to load Bwrk,
+    // so every work-item reaches the barriers
+    for (k0 = 0; k0 < K; k0 += AWRK_SIZE) {
+        klen = min(AWRK_SIZE, K - k0);
+        if (i < M) {
+            for (k = 0; k < klen; k++)
+                Awrk[k] = A[i*K+k0+k];
+        }
 
         for (j = 0; j < N; j++) {
             barrier(CLK_LOCAL_MEM_FENCE);
-            for (k = iloc; k < N; k += nloc)
-                Bwrk[k] = B[k*N+j];
+            for (k = iloc; k < klen; k += nloc)
+                Bwrk[k] = B[(k0+k)*N+j];
             barrier(CLK_LOCAL_MEM_FENCE);
-            tmp = 0.0f;
-            for (k = 0; k < N; k++)
-                tmp += Awrk[k] * Bwrk[k];
-            C[i*N+j] = tmp;
+            if (i < M) {
+                tmp = (k0 == 0) ? 0.0f : C[i*N+j];
+                for (k = 0; k < klen; k++)
+                    tmp += Awrk[k] * Bwrk[k];
+                C[i*N+j] = tmp;
+            }
         }
     }
 }
@@ -11,7 +11,8 @@
 //           can make a quick test of the multiplication.
 //
 //  USAGE:   The matrices are constant matrices, square and the order is
-//           set as a constant, ORDER (see mult.h).
+//           set as a constant, ORDER (see mult.h).  The kernels take
+//           separate M, N and K sizes, which are all ORDER here.
 //
 //  HISTORY: Written by Tim Mattson, August 2010
 //           Modified by Simon McIntosh-Smith, September 2011
@@ -95,18 +96,18 @@ int main(int argc, char *argv[])
 // Run sequential version on the host
 //--------------------------------------------------------------------------------
 
-    initmat(N, h_A, h_B, h_C);
+    initmat(N, N, N, h_A, h_B, h_C);
 
     printf("\n===== Sequential, matrix mult (dot prod), order %d on host CPU ======\n",ORDER);
     for(int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
         start_time = wtime();
 
-        seq_mat_mul_sdot(N, h_A, h_B, h_C);
+        seq_mat_mul_sdot(N, N, N, h_A, h_B, h_C);
 
         run_time  = wtime() - start_time;
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
     }
 
 
@@ -115,7 +116,7 @@ int main(int argc, char *argv[])
 //--------------------------------------------------------------------------------
 
     //  Reset A, B and C matrices (just to play it safe)
-    initmat(N, h_A, h_B, h_C);
+    initmat(N, N, N, h_A, h_B, h_C);
 
     d_a = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
                             sizeof(float) * size, h_A, &err);
@@ -134,13 +135,11 @@ int main(int argc, char *argv[])
 // OpenCL matrix multiplication ... Naive
 //--------------------------------------------------------------------------------
 
-    // Create the comput program from the source buffer
+    // Load the kernel source
     kernelsource = loadProgram("C_elem.cl");
-    program = clCreateProgramWithSource(context, 1, (const char **) & kernelsource, NULL, &err);
-    checkError(err, "Creating program");
 
    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    program = buildProgram(context, device, kernelsource, NULL, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -161,12 +160,14 @@ int main(int argc, char *argv[])
     // Do the multiplication COUNT times
     for (int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
 
         err =  clSetKernelArg(kernel, 0, sizeof(int),    &N);
-        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_a);
-        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_b);
-        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(kernel, 1, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 2, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &d_c);
         checkError(err, "Setting kernel arguments");
 
         start_time = wtime();
@@ -196,7 +197,7 @@ int main(int argc, char *argv[])
             0, NULL, NULL);
         checkError(err, "Reading back buffer d_c");
 
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
 
     } // end for loop
 
@@ -204,13 +205,11 @@ int main(int argc, char *argv[])
 // OpenCL matrix multiplication ... C row per work item
 //--------------------------------------------------------------------------------
 
-    // Create the comput program from the source buffer
+    // Load the kernel source
     kernelsource = loadProgram("C_row.cl");
-    program = clCreateProgramWithSource(context, 1, (const char **) & kernelsource, NULL, &err);
-    checkError(err, "Creating program");
 
    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    program = buildProgram(context, device, kernelsource, NULL, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -231,12 +230,14 @@ int main(int argc, char *argv[])
     // Do the multiplication COUNT times
     for (int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
 
         err =  clSetKernelArg(kernel, 0, sizeof(int),    &N);
-        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_a);
-        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_b);
-        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(kernel, 1, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 2, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &d_c);
         checkError(err, "Setting kernel arguments");
 
         start_time = wtime();
@@ -262,7 +263,7 @@ int main(int argc, char *argv[])
             0, NULL, NULL);
         checkError(err, "Reading back buffer d_c");
 
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
 
     } // end for loop
 
@@ -270,13 +271,11 @@ int main(int argc, char *argv[])
 // OpenCL matrix multiplication ... C row per work item, A row in private memory
 //--------------------------------------------------------------------------------
 
-    // Create the comput program from the source buffer
+    // Load the kernel source
     kernelsource = loadProgram("C_row_priv.cl");
-    program = clCreateProgramWithSource(context, 1, (const char **) & kernelsource, NULL, &err);
-    checkError(err, "Creating program");
 
    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    program = buildProgram(context, device, kernelsource, NULL, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -297,12 +296,14 @@ int main(int argc, char *argv[])
     // Do the multiplication COUNT times
     for (int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
 
         err =  clSetKernelArg(kernel, 0, sizeof(int),    &N);
-        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_a);
-        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_b);
-        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(kernel, 1, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 2, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &d_c);
         checkError(err, "Setting kernel arguments");
 
         start_time = wtime();
@@ -329,7 +330,7 @@ int main(int argc, char *argv[])
             0, NULL, NULL);
         checkError(err, "Reading back buffer d_c");
 
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
 
     } // end for loop
 
@@ -337,13 +338,11 @@ int main(int argc, char *argv[])
 // OpenCL matrix multiplication ... C row per work item, A row private, B col local
 //--------------------------------------------------------------------------------
 
-    // Create the comput program from the source buffer
+    // Load the kernel source
     kernelsource = loadProgram("C_row_priv_bloc.cl");
-    program = clCreateProgramWithSource(context, 1, (const char **) & kernelsource, NULL, &err);
-    checkError(err, "Creating program");
 
    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    program = buildProgram(context, device, kernelsource, NULL, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -364,13 +363,15 @@ int main(int argc, char *argv[])
     // Do the multiplication COUNT times
     for (int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
 
         err =  clSetKernelArg(kernel, 0, sizeof(int),    &N);
-        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_a);
-        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_b);
-        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
-        err |= clSetKernelArg(kernel, 4, sizeof(cl_float) * N, NULL);
+        err |= clSetKernelArg(kernel, 1, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 2, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(kernel, 6, sizeof(cl_float) * N, NULL);
         checkError(err, "Setting kernel arguments");
 
         start_time = wtime();
@@ -397,7 +398,7 @@ int main(int argc, char *argv[])
             0, NULL, NULL);
         checkError(err, "Reading back buffer d_c");
 
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
 
     } // end for loop
 
@@ -406,17 +407,15 @@ int main(int argc, char *argv[])
 // OpenCL matrix multiplication ... blocked
 //--------------------------------------------------------------------------------
 
-    // Create the comput program from the source buffer
+    // Load the kernel source
     kernelsource = loadProgram("C_block_form.cl");
-    program = clCreateProgramWithSource(context, 1, (const char **) & kernelsource, NULL, &err);
-    checkError(err, "Creating program");
 
     // Setup the kernel build options
     char options[1024];
     sprintf(options, "-DBLKSZ=%d", BLOCKSIZE);
 
     // Build the program
-    err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
+    program = buildProgram(context, device, kernelsource, options, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -437,7 +436,7 @@ int main(int argc, char *argv[])
     // Do the multiplication COUNT times
     for (int i = 0; i < COUNT; i++)
     {
-        zero_mat(N, h_C);
+        zero_mat(N, N, h_C);
 
         // Work-group computes a block of C.  This size is also set
         // in a #define inside the kernel function.  Note this blocksize
@@ -445,11 +444,13 @@ int main(int argc, char *argv[])
         int blocksize = BLOCKSIZE;
 
         err =  clSetKernelArg(kernel, 0, sizeof(int),    &N);
-        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &d_a);
-        err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_b);
-        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_c);
-        err |= clSetKernelArg(kernel, 4, sizeof(cl_float) * blocksize * blocksize, NULL);
-        err |= clSetKernelArg(kernel, 5, sizeof(cl_float) * blocksize * blocksize, NULL);
+        err |= clSetKernelArg(kernel, 1, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 2, sizeof(int),    &N);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &d_a);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &d_b);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &d_c);
+        err |= clSetKernelArg(kernel, 6, sizeof(cl_float) * blocksize * blocksize, NULL);
+        err |= clSetKernelArg(kernel, 7, sizeof(cl_float) * blocksize * blocksize, NULL);
         checkError(err, "Setting kernel arguments");
 
         start_time = wtime();
@@ -476,7 +477,7 @@ int main(int argc, char *argv[])
             0, NULL, NULL);
         checkError(err, "Reading back buffer d_c");
 
-        results(N, h_C, run_time);
+        results(N, N, N, h_C, run_time);
 
     } // end for loop
 
@@ -10,8 +10,15 @@
 //           A and B are set to constant matrices so we
 //           can make a quick test of the multiplication.
 //
-//  USAGE:   The matrices are constant matrices, square and the order is
-//           set as a constant, ORDER (see mult.h).
+//  USAGE:   The matrices are constant matrices.  A is M x K, B is K x N
+//           and C is M x N, with each size set by --M, --N and --K
+//           (default ORDER, see matmul.hpp).  --batch B --size n
+//           multiplies B independent n x n pairs instead.
+//           --precision runs the plan with half, float or double
+//           storage and reports the error against a double product.
+//           --int8 adds an int8 product with int32 accumulation.
+//           --random uses random matrices instead, checked in
+//           O(N^2) by Freivalds' algorithm (--verify).
 //
 //  HISTORY: Written by Tim Mattson, August 2010
 //           Modified by Simon McIntosh-Smith, September 2011
@@ -25,27 +32,76 @@
 #include "matrix_lib.hpp"
 #include <util.hpp>
 #include "device_picker.hpp"
+#include <benchmark.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
+#include <autotune.hpp>
 
+#include <algorithm>
+#include <random>
 #include <sstream>
 
-int main(int argc, char *argv[])
-{
-
-    int N;   // A[N][N], B[N][N], C[N][N]
-    int size;      // Number of elements in each matrix
-
+// From cl_khr_integer_dot_product, for headers that predate it
+#ifndef CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR
+#define CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR 0x1073
+#endif
+#ifndef CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR
+#define CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR (1 << 1)
+#endif
 
-    double start_time;      // Starting time
-    double run_time;        // Timing data
-    util::Timer timer;      // timing
+void parseArguments(int argc, char *argv[]);
+void runBatched(const cl::Device& device, const cl::Context& context,
+                cl::CommandQueue& queue, util::Benchmark& bench,
+                util::Profiler& profiler, util::Trace& trace);
+void runOutOfCore(const cl::Device& device, const cl::Context& context,
+                  cl::CommandQueue& queue, int M, int N, int K,
+                  util::pinned_vector<float>& h_A, util::pinned_vector<float>& h_B,
+                  util::pinned_vector<float>& h_C, util::Benchmark& bench,
+                  util::Profiler& profiler, util::Trace& trace);
+void runPrecisions(const cl::Device& device, const cl::Context& context,
+                   cl::CommandQueue& queue, int M, int N, int K,
+                   util::Benchmark& bench, util::Profiler& profiler, util::Trace& trace);
+void runInt8(const cl::Device& device, const cl::Context& context,
+             cl::CommandQueue& queue, int M, int N, int K,
+             util::Benchmark& bench, util::Profiler& profiler, util::Trace& trace);
+
+// Parameters, with default values.
+cl_uint deviceIndex = 0;
+util::BenchmarkOptions benchOptions;
+bool    profile = false;
+bool    tune = false;
+bool    pageable = false;
+std::string traceFile;
+cl_uint Mdim = ORDER;
+cl_uint Ndim = ORDER;
+cl_uint Kdim = ORDER;
+cl_uint hostThreads = 0;
+cl_uint batchCount = 0;  // 0 multiplies one M x K by K x N pair instead
+cl_uint batchSize = 32;
+bool    outOfCore = false;
+cl_uint budgetMB = 0;    // 0 sizes the out-of-core budget from the device
+Epilogue epilogue;       // fused after the product, if enabled
+std::vector<MatMulPlan::DataType> precisions;  // storage types to compare
+bool    int8 = false;
+bool    randomInputs = false;
+bool    skipHost = false;
+bool    skipNaive = false;
+cl_uint verifyTrials = 0;  // 0 checks constant inputs exactly, 3 trials if random
+
+// Rounds value up to a whole number of multiples, for NDRanges that
+// must be divisible by the work-group size
+int roundUp(int value, int multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
 
-    N = ORDER;
+int main(int argc, char *argv[])
+{
 
-    size = N * N;
+    int M, N, K;   // A[M][K], B[K][N], C[M][N]
+    size_t sizeA, sizeB, sizeC;   // Number of elements in each matrix
 
-    std::vector<float> h_A(size); // Host memory for Matrix A
-    std::vector<float> h_B(size); // Host memory for Matrix B
-    std::vector<float> h_C(size); // Host memory for Matrix C
+    double gflop;           // Floating point work in one multiplication
 
     cl::Buffer d_a, d_b, d_c;   // Matrices in device memory
 
@@ -56,46 +112,124 @@ int main(int argc, char *argv[])
     try
     {
 
-        cl_uint deviceIndex = 0;
-        parseArguments(argc, argv, &deviceIndex);
+        // The multi-device blocked version uses every selected device
+        deviceSelection.multiDevice = true;
+        parseArguments(argc, argv);
+
+        M = Mdim;
+        N = Ndim;
+        K = Kdim;
+
+        sizeA = (size_t)M * K;
+        sizeB = (size_t)K * N;
+        sizeC = (size_t)M * N;
+
+        gflop = 2.0 * M * N * K * 1e-9;
+
+        util::Benchmark bench(benchOptions);
+        util::Trace trace(traceFile);
 
         // Get list of devices
         std::vector<cl::Device> devices;
-        unsigned numDevices = getDeviceList(devices);
+        getDeviceList(devices);
 
-        // Check device index in range
-        if (deviceIndex >= numDevices)
+        // Check device indices in range
+        std::vector<cl::Device> chosen_devices = getSelectedDevices(devices, deviceIndex);
+        if (chosen_devices.empty())
         {
           std::cout << "Invalid device index (try '--list')\n";
           return EXIT_FAILURE;
         }
 
-        cl::Device device = devices[deviceIndex];
+        std::cout << "\n";
+        for (unsigned d = 0; d < chosen_devices.size(); d++)
+            std::cout << "Using OpenCL device: " << getDeviceName(chosen_devices[d]) << "\n";
+
+        util::Profiler profiler(profile || trace.enabled() || tune);
+        std::vector<DeviceQueue> deviceQueues = createDeviceQueues(chosen_devices,
+            profiler.enabled() ? CL_QUEUE_PROFILING_ENABLE : 0);
+
+        // The single device versions run on the first device
+        cl::Device       device  = deviceQueues[0].device;
+        cl::Context      context = deviceQueues[0].context;
+        cl::CommandQueue queue   = deviceQueues[0].queue;
+
+        if (batchCount)
+        {
+            runBatched(device, context, queue, bench, profiler, trace);
 
-        std::string name = getDeviceName(device);
-        std::cout << "\nUsing OpenCL device: " << name << "\n";
+            bench.report();
+            if (profile)
+                profiler.report();
+            trace.write(profiler);
+            return EXIT_SUCCESS;
+        }
 
-        std::vector<cl::Device> chosen_device;
-        chosen_device.push_back(device);
-        cl::Context context(chosen_device);
-        cl::CommandQueue queue(context, device);
+        // Matrices that do not fit in device memory are streamed through it
+        bool fits = sizeof(float) * std::max(sizeA, std::max(sizeB, sizeC)) <=
+                        device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() &&
+                    sizeof(float) * (sizeA + sizeB + sizeC) <=
+                        device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+
+        // Host matrices, in pinned memory unless --pageable was given.  Each
+        // pinned matrix is a single device buffer, so matrices that are
+        // streamed (and may be larger than one allocation) stay pageable.
+        util::cl_pinned_allocator<float> alloc(context, queue,
+                                               !pageable && !outOfCore && fits);
+        util::pinned_vector<float> h_A(sizeA, 0.f, alloc); // Host memory for Matrix A
+        util::pinned_vector<float> h_B(sizeB, 0.f, alloc); // Host memory for Matrix B
+        util::pinned_vector<float> h_C(sizeC, 0.f, alloc); // Host memory for Matrix C
 
 //--------------------------------------------------------------------------------
-// Run sequential matmul
+// Run matmul on the host
 //--------------------------------------------------------------------------------
 
-        initmat(N, h_A, h_B, h_C);
+        // Tuned configurations depend on the matrix sizes
+        std::stringstream problem;
+        problem << "M=" << M << ",N=" << N << ",K=" << K;
+
+        set_host_threads(hostThreads);
+        set_verify_trials(randomInputs && !verifyTrials ? 3 : verifyTrials);
+        if (randomInputs)
+            randmat(M, N, K, h_A.data(), h_B.data(), h_C.data());
+        else
+            initmat(M, N, K, h_A.data(), h_B.data(), h_C.data());
 
-        printf("\n===== Sequential, matrix mult (dot prod), order %d on host CPU ======\n",ORDER);
-        for(int i = 0; i < COUNT; i++)
+        util::BenchmarkResult result;
+        if (!skipHost)
         {
-            zero_mat(N, h_C);
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
+            printf("\n===== Host matrix mult (blocked, %d threads), %dx%dx%d on host CPU ======\n",
+                   get_host_threads(),M,N,K);
+
+            result = bench.run("Host", [&]()
+            {
+                util::Trace::Region region(trace, "Host");
+                seq_mat_mul_sdot(M, N, K, h_A.data(), h_B.data(), h_C.data());
+            }, gflop, "GFLOP/s",
+            [&]()
+            {
+                zero_mat(M, N, h_C.data());
+            });
+
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
+        }
 
-            seq_mat_mul_sdot(N, h_A, h_B, h_C);
+//--------------------------------------------------------------------------------
+// Stream the matrices through the device if they do not fit in its memory
+//--------------------------------------------------------------------------------
 
-            run_time  = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
-            results(N, h_C, run_time);
+        if (outOfCore || !fits)
+        {
+            if (!fits)
+                printf("\nMatrices do not fit in device memory, streaming them\n");
+            runOutOfCore(device, context, queue, M, N, K, h_A, h_B, h_C,
+                         bench, profiler, trace);
+
+            bench.report();
+            if (profile)
+                profiler.report();
+            trace.write(profiler);
+            return EXIT_SUCCESS;
         }
 
 //--------------------------------------------------------------------------------
@@ -103,207 +237,454 @@ int main(int argc, char *argv[])
 //--------------------------------------------------------------------------------
 
         //  Reset A, B and C matrices (just to play it safe)
-        initmat(N, h_A, h_B, h_C);
+        if (randomInputs)
+            randmat(M, N, K, h_A.data(), h_B.data(), h_C.data());
+        else
+            initmat(M, N, K, h_A.data(), h_B.data(), h_C.data());
 
-        d_a = cl::Buffer(context, h_A.begin(), h_A.end(), true);
+        d_a = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * sizeA);
+        queue.enqueueWriteBuffer(d_a, CL_TRUE, 0, sizeof(float) * sizeA,
+                                 h_A.data(), NULL, profiler.event("write A"));
 
-        d_b = cl::Buffer(context, h_B.begin(), h_B.end(), true);
+        d_b = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * sizeB);
+        queue.enqueueWriteBuffer(d_b, CL_TRUE, 0, sizeof(float) * sizeB,
+                                 h_B.data(), NULL, profiler.event("write B"));
 
-        d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * size);
+        // Read as well as written by the beta epilogue
+        d_c = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * sizeC);
 
 //--------------------------------------------------------------------------------
 // OpenCL matrix multiplication ... Naive
 //--------------------------------------------------------------------------------
 
-        // Create the compute program from the source buffer
-        cl::Program program(context, util::loadProgram("C_elem.cl"), true);
-
-        // Create the compute kernel from the program
-        cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer> naive_mmul(program, "mmul");
-
-        printf("\n===== OpenCL, matrix mult, C(i,j) per work item, order %d ======\n",N);
-
-        // Do the multiplication COUNT times
-        for (int i = 0; i < COUNT; i++)
+        // The naive kernels are O(N^3) with little reuse, so they take hours
+        // at sizes that the blocked and tuned versions finish in seconds
+        cl::Program program;
+        util::TuningConfig defaults;
+        if (!skipNaive)
         {
-            zero_mat(N, h_C);
-
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
+            // Create the compute program from the source buffer
+            {
+                util::Trace::Region region(trace, "buildProgram");
+                program = util::buildProgram(context, util::loadProgram("C_elem.cl"));
+            }
 
-            // Execute the kernel over the entire range of C matrix elements ... computing
-            // a dot product for each element of the product matrix.  The local work
-            // group size is set to NULL ... so I'm telling the OpenCL runtime to
-            // figure out a local work group size for me.
-            cl::NDRange global(N, N);
-            naive_mmul(cl::EnqueueArgs(queue, global),
-                    N, d_a, d_b, d_c);
+            // Create the compute kernel from the program
+            cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> naive_mmul(program, "mmul");
 
-            queue.finish();
+            printf("\n===== OpenCL, matrix mult, C(i,j) per work item, %dx%dx%d ======\n",M,N,K);
 
-            run_time  = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
+            result = bench.run("C(i,j) per work item", [&]()
+            {
+                // Execute the kernel over the entire range of C matrix elements ... computing
+                // a dot product for each element of the product matrix.  The local work
+                // group size is set to NULL ... so I'm telling the OpenCL runtime to
+                // figure out a local work group size for me.
+                cl::NDRange global(M, N);
+                profiler.record("C(i,j) per work item",
+                    naive_mmul(cl::EnqueueArgs(queue, global),
+                        M, N, K, d_a, d_b, d_c));
 
-            cl::copy(queue, d_c, h_C.begin(), h_C.end());
+                queue.finish();
+            }, gflop, "GFLOP/s");
 
-            results(N, h_C, run_time);
+            zero_mat(M, N, h_C.data());
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
 
-        } // end for loop
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
 
 //--------------------------------------------------------------------------------
 // OpenCL matrix multiplication ... C row per work item
 //--------------------------------------------------------------------------------
 
-        // Create the compute program from the source buffer
-        program = cl::Program(context, util::loadProgram("C_row.cl"), true);
-
-        // Create the compute kernel from the program
-        cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer> crow_mmul(program, "mmul");
-
-        printf("\n===== OpenCL, matrix mult, C row per work item, order %d ======\n",N);
-
-        // Do the multiplication COUNT times
-        for (int i = 0; i < COUNT; i++)
-        {
-            zero_mat(N, h_C);
+            // Create the compute program from the source buffer
+            {
+                util::Trace::Region region(trace, "buildProgram");
+                program = util::buildProgram(context, util::loadProgram("C_row.cl"));
+            }
 
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
+            // Create the compute kernel from the program
+            cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> crow_mmul(program, "mmul");
 
-            cl::NDRange global(N);
-            crow_mmul(cl::EnqueueArgs(queue, global),
-                    N, d_a, d_b, d_c);
-
-            queue.finish();
+            printf("\n===== OpenCL, matrix mult, C row per work item, %dx%dx%d ======\n",M,N,K);
 
-            run_time  = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
+            result = bench.run("C row per work item", [&]()
+            {
+                cl::NDRange global(M);
+                profiler.record("C row per work item",
+                    crow_mmul(cl::EnqueueArgs(queue, global),
+                        M, N, K, d_a, d_b, d_c));
 
-            cl::copy(queue, d_c, h_C.begin(), h_C.end());
+                queue.finish();
+            }, gflop, "GFLOP/s");
 
-            results(N, h_C, run_time);
+            zero_mat(M, N, h_C.data());
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
 
-        } // end for loop
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
 
 //--------------------------------------------------------------------------------
 // OpenCL matrix multiplication ... C row per work item, A row in pivate memory
 //--------------------------------------------------------------------------------
 
-        // Create the compute program from the source buffer
-        program = cl::Program(context, util::loadProgram("C_row_priv.cl"), true);
-
-        // Create the compute kernel from the program
-        cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer> arowpriv_mmul(program, "mmul");
-
-        printf("\n===== OpenCL, matrix mult, C row, A row in priv mem, order %d ======\n",N);
-
-        // Do the multiplication COUNT times
-        for (int i = 0; i < COUNT; i++)
-        {
-            zero_mat(N, h_C);
-
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
-
-            cl::NDRange global(N);
-            cl::NDRange local(ORDER / 16);
-            arowpriv_mmul(cl::EnqueueArgs(queue, global, local),
-                    N, d_a, d_b, d_c);
-
-            queue.finish();
-
-            run_time  = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
-
-            cl::copy(queue, d_c, h_C.begin(), h_C.end());
-
-            results(N, h_C, run_time);
-
-        } // end for loop
+            // Create the compute program from the source buffer
+            {
+                util::Trace::Region region(trace, "buildProgram");
+                program = util::buildProgram(context, util::loadProgram("C_row_priv.cl"));
+            }
+
+            // Create the compute kernel from the program
+            cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> arowpriv_mmul(program, "mmul");
+
+            // Pick the work-group size
+            util::Tuner arowprivTuner(device, "C_row_priv", problem.str());
+            arowprivTuner.addParameter("LOCAL", {8, 16, 32, 64, 128, 256, 512, 1024},
+                                       util::Tuner::LOCAL_SIZE);
+            defaults["LOCAL"] = 64;
+            int arowprivLocal = arowprivTuner.select(tune, defaults,
+                [&](const util::TuningConfig& c)
+                {
+                    return arowpriv_mmul(cl::EnqueueArgs(queue, cl::NDRange(roundUp(M, c.at("LOCAL"))),
+                                                         cl::NDRange(c.at("LOCAL"))),
+                                         M, N, K, d_a, d_b, d_c);
+                }).at("LOCAL");
+
+            printf("\n===== OpenCL, matrix mult, C row, A row in priv mem, %dx%dx%d ======\n",M,N,K);
+
+            result = bench.run("C row, A row private", [&]()
+            {
+                cl::NDRange global(roundUp(M, arowprivLocal));
+                cl::NDRange local(arowprivLocal);
+                profiler.record("C row, A row private",
+                    arowpriv_mmul(cl::EnqueueArgs(queue, global, local),
+                        M, N, K, d_a, d_b, d_c));
+
+                queue.finish();
+            }, gflop, "GFLOP/s");
+
+            zero_mat(M, N, h_C.data());
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
+
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
 
 //--------------------------------------------------------------------------------
 // OpenCL matrix multiplication ... C row per work item, A row pivate, B col local
 //--------------------------------------------------------------------------------
 
-        // Create the compute program from the source buffer
-        program = cl::Program(context, util::loadProgram("C_row_priv_bloc.cl"), true);
+            // Create the compute program from the source buffer
+            {
+                util::Trace::Region region(trace, "buildProgram");
+                program = util::buildProgram(context, util::loadProgram("C_row_priv_bloc.cl"));
+            }
 
-        // Create the compute kernel from the program
-        cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg> browloc_mmul(program, "mmul");
+            // Create the compute kernel from the program
+            cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg> browloc_mmul(program, "mmul");
 
-        printf("\n===== OpenCL, mat mult, C row, priv A, B cols loc, order %d ======\n",N);
+            // Pick the work-group size
+            util::Tuner browlocTuner(device, "C_row_priv_bloc", problem.str());
+            browlocTuner.addParameter("LOCAL", {8, 16, 32, 64, 128, 256, 512, 1024},
+                                      util::Tuner::LOCAL_SIZE);
 
-        // Do the multiplication COUNT times
-        for (int i = 0; i < COUNT; i++)
-        {
-            zero_mat(N, h_C);
+            // Columns of B are copied to local memory a chunk at a time
+            size_t bwrkSize = sizeof(float) * std::min(K, 1024);
+            int browlocLocal = browlocTuner.select(tune, defaults,
+                [&](const util::TuningConfig& c)
+                {
+                    return browloc_mmul(cl::EnqueueArgs(queue, cl::NDRange(roundUp(M, c.at("LOCAL"))),
+                                                        cl::NDRange(c.at("LOCAL"))),
+                                        M, N, K, d_a, d_b, d_c,
+                                        cl::Local(bwrkSize));
+                }).at("LOCAL");
 
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
+            printf("\n===== OpenCL, mat mult, C row, priv A, B cols loc, %dx%dx%d ======\n",M,N,K);
 
-            cl::NDRange global(N);
-            cl::NDRange local(ORDER / 16);
+            result = bench.run("C row, A priv, B local", [&]()
+            {
+                cl::NDRange global(roundUp(M, browlocLocal));
+                cl::NDRange local(browlocLocal);
 
-            cl::LocalSpaceArg localmem = cl::Local(sizeof(float) * N);
+                cl::LocalSpaceArg localmem = cl::Local(bwrkSize);
 
-            browloc_mmul(cl::EnqueueArgs(queue, global, local),
-                    N, d_a, d_b, d_c, localmem);
+                profiler.record("C row, A priv, B local",
+                    browloc_mmul(cl::EnqueueArgs(queue, global, local),
+                        M, N, K, d_a, d_b, d_c, localmem));
 
-            queue.finish();
-
-            run_time  = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
+                queue.finish();
+            }, gflop, "GFLOP/s");
 
-            cl::copy(queue, d_c, h_C.begin(), h_C.end());
+            zero_mat(M, N, h_C.data());
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
 
-            results(N, h_C, run_time);
-
-        } // end for loop
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
+        }
 
 //--------------------------------------------------------------------------------
 // OpenCL matrix multiplication ... blocked
 //--------------------------------------------------------------------------------
 
+        // Pick the block size, which is both a work-group dimension and
+        // the BLKSZ macro in the kernel
+        std::string blockSource = util::loadProgram("C_block_form.cl");
+        util::Tuner blockTuner(device, "C_block_form", problem.str());
+        blockTuner.addParameter("BLKSZ", {4, 8, 16, 32});
+        defaults.clear();
+        defaults["BLKSZ"] = BLOCKSIZE;
+        util::TuningConfig blockConfig = blockTuner.select(tune, defaults,
+            [&](const util::TuningConfig& c)
+            {
+                unsigned bs = c.at("BLKSZ");
+                cl::Program candidate = util::buildProgram(context, blockSource,
+                                                           blockTuner.options(c));
+                cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl::LocalSpaceArg> kernel(candidate, "mmul");
+                return kernel(cl::EnqueueArgs(queue, cl::NDRange(roundUp(N,bs), roundUp(M,bs)), cl::NDRange(bs,bs)),
+                              M, N, K, d_a, d_b, d_c,
+                              cl::Local(sizeof(float) * bs*bs),
+                              cl::Local(sizeof(float) * bs*bs));
+            });
+
+        // Work-group computes a block of C.  This size is also set
+        // in a #define inside the kernel function.  Blocks on the edges
+        // of C may be partly outside the matrix
+        int blocksize = blockConfig.at("BLKSZ");
+
         // Create the compute program from the source buffer
-        program = cl::Program(context, util::loadProgram("C_block_form.cl"));
-        std::stringstream options;
-        options << "-DBLKSZ=" << BLOCKSIZE;
-        program.build(options.str().c_str());
+        {
+            util::Trace::Region region(trace, "buildProgram");
+            program = util::buildProgram(context, blockSource, blockTuner.options(blockConfig));
+        }
 
 
         // Create the compute kernel from the program
-        cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl::LocalSpaceArg> block_mmul(program, "mmul");
+        cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl::LocalSpaceArg> block_mmul(program, "mmul");
 
-        printf("\n===== Parallel matrix mult (blocked %dx%d), order %d on device ======\n",BLOCKSIZE,BLOCKSIZE,ORDER);
+        printf("\n===== Parallel matrix mult (blocked %dx%d), %dx%dx%d on device ======\n",blocksize,blocksize,M,N,K);
 
-        // Do the multiplication COUNT times
-        for (int i = 0; i < COUNT; i++)
+        result = bench.run("Blocked", [&]()
         {
-            zero_mat(N, h_C);
-
-            start_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0;
-
-            // Work-group computes a block of C.  This size is also set
-            // in a #define inside the kernel function.  Note this blocksize
-            // must evenly divide the matrix order
-            int blocksize = BLOCKSIZE;
 
             cl::LocalSpaceArg A_block = cl::Local(sizeof(float) * blocksize*blocksize);
             cl::LocalSpaceArg B_block = cl::Local(sizeof(float) * blocksize*blocksize);
 
-            block_mmul(
+            profiler.record("Blocked", block_mmul(
                 cl::EnqueueArgs(
                     queue,
-                    cl::NDRange(N,N),
+                    cl::NDRange(roundUp(N,blocksize), roundUp(M,blocksize)),
                     cl::NDRange(blocksize,blocksize)),
+                M,
                 N,
+                K,
                 d_a,
                 d_b,
                 d_c,
                 A_block,
-                B_block);
+                B_block));
 
             queue.finish();
+        }, gflop, "GFLOP/s");
 
-            run_time = static_cast<double>(timer.getTimeNanoseconds()) / 1000000000.0 - start_time;
+        zero_mat(M, N, h_C.data());
+        queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                h_C.data(), NULL, profiler.event("read C"));
 
-            cl::copy(queue, d_c, h_C.begin(), h_C.end());
+        results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
 
-            results(N, h_C, run_time);
+//--------------------------------------------------------------------------------
+// OpenCL matrix multiplication ... reusable plan (register tiled, vector loads)
+//--------------------------------------------------------------------------------
 
-        } // end for loop
+        // The plan picks the micro-tile (TM x TN per work-item), the tile
+        // depth TK and the work-group size WX x WY once, and builds them in
+        uint64_t planStart = util::hostTimeNanoseconds();
+        MatMulPlan plan(context, device, M, N, K, MatMulPlan::FLOAT, tune);
+        trace.add("buildProgram", planStart, util::hostTimeNanoseconds());
+
+        printf("\n===== Parallel matrix mult (%s), %dx%dx%d on device ======\n",
+               plan.description().c_str(), M, N, K);
+
+        result = bench.run(plan.name(), [&]()
+        {
+            profiler.record(plan.name(), plan.enqueue(queue, d_a, d_b, d_c));
+
+            queue.finish();
+        }, gflop, "GFLOP/s");
+
+        zero_mat(M, N, h_C.data());
+        queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                h_C.data(), NULL, profiler.event("read C"));
+
+        results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
+
+//--------------------------------------------------------------------------------
+// OpenCL matrix multiplication ... plan with a fused epilogue
+//--------------------------------------------------------------------------------
+
+        if (epilogue.enabled())
+        {
+            // Old values of C and the bias, and the result expected from them
+            util::pinned_vector<float> h_Cin(sizeC, 0.f, alloc);
+            util::pinned_vector<float> h_ref(sizeC, 0.f, alloc);
+            std::vector<float> h_bias(std::max(M, N));
+            for (size_t i = 0; i < sizeC; i++)
+                h_Cin[i] = (float)(i % 7) - 3.0f;
+            for (size_t i = 0; i < h_bias.size(); i++)
+                h_bias[i] = 0.25f * (i % 9) - 1.0f;
+            seq_mat_mul_sdot(M, N, K, h_A.data(), h_B.data(), h_ref.data());
+            apply_epilogue(M, N, epilogue, h_bias, h_Cin.data(), h_ref.data());
+
+            cl::Buffer d_bias(context, CL_MEM_READ_ONLY, sizeof(float) * h_bias.size());
+            queue.enqueueWriteBuffer(d_bias, CL_TRUE, 0, sizeof(float) * h_bias.size(),
+                                     h_bias.data(), NULL, profiler.event("write bias"));
+
+            // Uses the configuration stored by the plan above
+            uint64_t fusedStart = util::hostTimeNanoseconds();
+            MatMulPlan fusedPlan(context, device, M, N, K, MatMulPlan::FLOAT, false, epilogue);
+            trace.add("buildProgram", fusedStart, util::hostTimeNanoseconds());
+            fusedPlan.setBias(d_bias);
+
+            printf("\n===== Parallel matrix mult (%s), %dx%dx%d on device ======\n",
+                   fusedPlan.description().c_str(), M, N, K);
+
+            result = bench.run(fusedPlan.name(), [&]()
+            {
+                profiler.record(fusedPlan.name(), fusedPlan.enqueue(queue, d_a, d_b, d_c));
+
+                queue.finish();
+            }, gflop, "GFLOP/s",
+            [&]()
+            {
+                // The epilogue reads the old C, so restore it every time
+                queue.enqueueWriteBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                         h_Cin.data(), NULL, profiler.event("write C"));
+            });
+
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
+
+            float maxerr = max_rel_error(M, N, h_C.data(), h_ref.data());
+            printf(" %.4f seconds at %.3f GFLOP/s, max relative error %g\n",
+                   result.stats.median, gflop / result.stats.median, maxerr);
+            if ((maxerr != maxerr) || maxerr > TOL)
+                printf("\n Errors in fused epilogue: %g\n", maxerr);
+        }
+
+//--------------------------------------------------------------------------------
+// OpenCL matrix multiplication ... plan in each storage precision
+//--------------------------------------------------------------------------------
+
+        if (!precisions.empty())
+            runPrecisions(device, context, queue, M, N, K, bench, profiler, trace);
+
+//--------------------------------------------------------------------------------
+// OpenCL matrix multiplication ... int8 with int32 accumulation
+//--------------------------------------------------------------------------------
+
+        if (int8)
+            runInt8(device, context, queue, M, N, K, bench, profiler, trace);
+
+//--------------------------------------------------------------------------------
+// OpenCL matrix multiplication ... blocked, rows of C split between devices
+//--------------------------------------------------------------------------------
+
+        if (deviceQueues.size() > 1)
+        {
+            typedef cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+                                      cl::LocalSpaceArg, cl::LocalSpaceArg> BlockKernel;
+
+            // Each device gets whole blocks of rows of A and C, and all of B
+            unsigned numQueues = deviceQueues.size();
+            std::vector<size_t> rows = partitionWork(M, getDeviceWeights(chosen_devices), blocksize);
+            std::vector<cl::Buffer> d_a_rows(numQueues), d_b_all(numQueues), d_c_rows(numQueues);
+            std::vector<BlockKernel> multi_mmul;
+            for (unsigned d = 0; d < numQueues; d++)
+            {
+                size_t count = rows[d+1] - rows[d];
+                printf("Device %u: rows %u to %u\n", d, (unsigned)rows[d], (unsigned)rows[d+1]);
+
+                {
+                    util::Trace::Region region(trace, "buildProgram");
+                    program = util::buildProgram(deviceQueues[d].context, blockSource,
+                                                 blockTuner.options(blockConfig));
+                }
+                multi_mmul.push_back(BlockKernel(program, "mmul"));
+
+                if (!count)
+                    continue;
+
+                // Buffers are first touched by their own (sub-)device
+                cl::CommandQueue& q = deviceQueues[d].queue;
+                d_a_rows[d] = cl::Buffer(deviceQueues[d].context, CL_MEM_READ_ONLY, sizeof(float) * K * count);
+                firstTouch(deviceQueues[d], d_a_rows[d], sizeof(float) * K * count);
+                q.enqueueWriteBuffer(d_a_rows[d], CL_FALSE, 0, sizeof(float) * K * count,
+                                     h_A.data() + rows[d] * K, NULL, profiler.event("write A"));
+
+                d_b_all[d] = cl::Buffer(deviceQueues[d].context, CL_MEM_READ_ONLY, sizeof(float) * sizeB);
+                firstTouch(deviceQueues[d], d_b_all[d], sizeof(float) * sizeB);
+                q.enqueueWriteBuffer(d_b_all[d], CL_FALSE, 0, sizeof(float) * sizeB,
+                                     h_B.data(), NULL, profiler.event("write B"));
+
+                d_c_rows[d] = cl::Buffer(deviceQueues[d].context, CL_MEM_WRITE_ONLY, sizeof(float) * N * count);
+                firstTouch(deviceQueues[d], d_c_rows[d], sizeof(float) * N * count);
+            }
+            for (unsigned d = 0; d < numQueues; d++)
+                deviceQueues[d].queue.finish();
+
+            printf("\n===== Parallel matrix mult (blocked %dx%d), %dx%dx%d on %u devices ======\n",
+                   blocksize, blocksize, M, N, K, numQueues);
+
+            result = bench.run("Blocked, multi-device", [&]()
+            {
+                cl::LocalSpaceArg A_block = cl::Local(sizeof(float) * blocksize*blocksize);
+                cl::LocalSpaceArg B_block = cl::Local(sizeof(float) * blocksize*blocksize);
+
+                for (unsigned d = 0; d < numQueues; d++)
+                {
+                    size_t count = rows[d+1] - rows[d];
+                    if (!count)
+                        continue;
+                    profiler.record("Blocked, multi-device", multi_mmul[d](
+                        cl::EnqueueArgs(
+                            deviceQueues[d].queue,
+                            cl::NDRange(roundUp(N,blocksize), roundUp((int)count,blocksize)),
+                            cl::NDRange(blocksize,blocksize)),
+                        (int)count,
+                        N,
+                        K,
+                        d_a_rows[d],
+                        d_b_all[d],
+                        d_c_rows[d],
+                        A_block,
+                        B_block));
+                }
+
+                for (unsigned d = 0; d < numQueues; d++)
+                    deviceQueues[d].queue.finish();
+            }, gflop, "GFLOP/s");
+
+            zero_mat(M, N, h_C.data());
+            for (unsigned d = 0; d < numQueues; d++)
+            {
+                size_t count = rows[d+1] - rows[d];
+                if (!count)
+                    continue;
+                deviceQueues[d].queue.enqueueReadBuffer(d_c_rows[d], CL_FALSE, 0,
+                    sizeof(float) * N * count, h_C.data() + rows[d] * N,
+                    NULL, profiler.event("read C"));
+            }
+            for (unsigned d = 0; d < numQueues; d++)
+                deviceQueues[d].queue.finish();
+
+            results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
+        }
+
+        bench.report();
+        if (profile)
+            profiler.report();
+
+        trace.write(profiler);
     }
     catch (cl::BuildError error)
     {
@@ -327,3 +708,858 @@ int main(int argc, char *argv[])
 
     return EXIT_SUCCESS;
 }
+
+//--------------------------------------------------------------------------------
+// Batched matrix multiplication ... many small n x n products per launch
+//--------------------------------------------------------------------------------
+
+void runBatched(const cl::Device& device, const cl::Context& context,
+                cl::CommandQueue& queue, util::Benchmark& bench,
+                util::Profiler& profiler, util::Trace& trace)
+{
+    int n     = batchSize;
+    int batch = batchCount;
+    int nn    = n * n;
+
+    // Host matrices, in pinned memory unless --pageable was given.  The
+    // values are small integers so that the products are exact.
+    util::cl_pinned_allocator<float> alloc(context, queue, !pageable);
+    util::pinned_vector<float> h_A(nn * batch, 0.f, alloc);
+    util::pinned_vector<float> h_B(nn * batch, 0.f, alloc);
+    util::pinned_vector<float> h_C(nn * batch, 0.f, alloc);
+    for (int i = 0; i < nn * batch; i++)
+    {
+        h_A[i] = (float)(i % 7 - 3);
+        h_B[i] = (float)(i % 5 - 2);
+    }
+
+    // The pointer-array batch stores the matrices in a shuffled order
+    std::vector<cl_uint> order(batch);
+    for (int m = 0; m < batch; m++)
+        order[m] = m;
+    std::shuffle(order.begin(), order.end(), std::mt19937(batch));
+    std::vector<cl_uint> h_offsets(batch);
+    util::pinned_vector<float> h_Ashuf(nn * batch, 0.f, alloc);
+    util::pinned_vector<float> h_Bshuf(nn * batch, 0.f, alloc);
+    for (int m = 0; m < batch; m++)
+    {
+        h_offsets[m] = order[m] * nn;
+        std::copy(h_A.begin() + m*nn, h_A.begin() + (m+1)*nn, h_Ashuf.begin() + h_offsets[m]);
+        std::copy(h_B.begin() + m*nn, h_B.begin() + (m+1)*nn, h_Bshuf.begin() + h_offsets[m]);
+    }
+
+    cl::Buffer d_a(context, CL_MEM_READ_ONLY, sizeof(float) * nn * batch);
+    cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * nn * batch);
+    cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * nn * batch);
+    cl::Buffer d_ashuf(context, CL_MEM_READ_ONLY, sizeof(float) * nn * batch);
+    cl::Buffer d_bshuf(context, CL_MEM_READ_ONLY, sizeof(float) * nn * batch);
+    cl::Buffer d_offsets(context, CL_MEM_READ_ONLY, sizeof(cl_uint) * batch);
+    queue.enqueueWriteBuffer(d_a, CL_FALSE, 0, sizeof(float) * nn * batch,
+                             h_A.data(), NULL, profiler.event("write A"));
+    queue.enqueueWriteBuffer(d_b, CL_FALSE, 0, sizeof(float) * nn * batch,
+                             h_B.data(), NULL, profiler.event("write B"));
+    queue.enqueueWriteBuffer(d_ashuf, CL_FALSE, 0, sizeof(float) * nn * batch,
+                             h_Ashuf.data(), NULL, profiler.event("write A"));
+    queue.enqueueWriteBuffer(d_bshuf, CL_FALSE, 0, sizeof(float) * nn * batch,
+                             h_Bshuf.data(), NULL, profiler.event("write B"));
+    queue.enqueueWriteBuffer(d_offsets, CL_TRUE, 0, sizeof(cl_uint) * batch,
+                             h_offsets.data(), NULL, profiler.event("write offsets"));
+
+    typedef cl::KernelFunctor<int, int, cl_uint, cl_uint, cl_uint,
+                              cl::Buffer, cl::Buffer, cl::Buffer> StridedKernel;
+    typedef cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+                              cl::Buffer, cl::Buffer, cl::Buffer> IndexedKernel;
+
+    // Pick the block size and the number of matrices per work-group
+    std::string batchedSource = util::loadProgram("C_batched.cl");
+    std::stringstream problem;
+    problem << "n=" << n << ",batch=" << batch;
+    util::Tuner batchedTuner(device, "mmul_batched", problem.str());
+    batchedTuner.addParameter("TS", {4, 8, 16});
+    batchedTuner.addParameter("MPG", {1, 2, 4, 8, 16});
+    size_t maxWorkGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    cl_ulong localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    batchedTuner.addConstraint([&](const util::TuningConfig& c)
+    {
+        unsigned groupSize = c.at("TS") * c.at("TS") * c.at("MPG");
+        return groupSize <= maxWorkGroup &&
+               2 * groupSize * sizeof(float) <= localMemSize;
+    });
+    auto batchedRange = [&](const util::TuningConfig& c, int count)
+    {
+        unsigned ts = c.at("TS"), mpg = c.at("MPG");
+        return cl::EnqueueArgs(queue,
+                               cl::NDRange(roundUp(n, ts), roundUp(n, ts), roundUp(count, mpg)),
+                               cl::NDRange(ts, ts, mpg));
+    };
+    util::TuningConfig defaults;
+    defaults["TS"]  = n >= 16 ? 16 : 8;
+    defaults["MPG"] = 256 / (defaults["TS"] * defaults["TS"]);
+    util::TuningConfig batchedConfig = batchedTuner.select(tune, defaults,
+        [&](const util::TuningConfig& c)
+        {
+            cl::Program candidate = util::buildProgram(context, batchedSource,
+                                                       batchedTuner.options(c));
+            StridedKernel kernel(candidate, "mmul_strided");
+            return kernel(batchedRange(c, batch), n, batch, nn, nn, nn, d_a, d_b, d_c);
+        });
+
+    cl::Program program;
+    {
+        util::Trace::Region region(trace, "buildProgram");
+        program = util::buildProgram(context, batchedSource, batchedTuner.options(batchedConfig));
+    }
+    StridedKernel strided_mmul(program, "mmul_strided");
+    IndexedKernel indexed_mmul(program, "mmul_indexed");
+
+    printf("\n===== Batched matrix mult (%ux%u blocks, %u matrices per work-group), %d x %dx%d on device ======\n",
+           batchedConfig.at("TS"), batchedConfig.at("TS"), batchedConfig.at("MPG"), batch, n, n);
+    printf(" %8s %16s %16s\n", "batch", "strided", "pointer-array");
+
+    // Aggregate throughput for increasing batch sizes, up to the full batch
+    for (int count = 1; ; count = std::min(count * 2, batch))
+    {
+        double gflop = 2.0 * n * n * n * count * 1e-9;
+        std::stringstream name;
+        name << "Batched strided, " << count;
+        util::BenchmarkResult strided = bench.run(name.str(), [&]()
+        {
+            profiler.record("Batched strided",
+                strided_mmul(batchedRange(batchedConfig, count),
+                             n, count, nn, nn, nn, d_a, d_b, d_c));
+            queue.finish();
+        }, gflop, "GFLOP/s");
+
+        name.str("");
+        name << "Batched pointer-array, " << count;
+        util::BenchmarkResult indexed = bench.run(name.str(), [&]()
+        {
+            profiler.record("Batched pointer-array",
+                indexed_mmul(batchedRange(batchedConfig, count),
+                             n, count, d_offsets, d_offsets, d_offsets,
+                             d_ashuf, d_bshuf, d_c));
+            queue.finish();
+        }, gflop, "GFLOP/s");
+
+        printf(" %8d %10.3f GFLOP/s %10.3f GFLOP/s\n", count,
+               gflop / strided.stats.median, gflop / indexed.stats.median);
+        if (count == batch)
+            break;
+    }
+
+    // Check both forms of the full batch against the host
+    int errors = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::fill(h_C.begin(), h_C.end(), 0.f);
+        if (pass == 0)
+            strided_mmul(batchedRange(batchedConfig, batch),
+                         n, batch, nn, nn, nn, d_a, d_b, d_c);
+        else
+            indexed_mmul(batchedRange(batchedConfig, batch),
+                         n, batch, d_offsets, d_offsets, d_offsets,
+                         d_ashuf, d_bshuf, d_c);
+        queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * nn * batch,
+                                h_C.data(), NULL, profiler.event("read C"));
+
+        for (int m = 0; m < batch; m++)
+        {
+            const float *A = h_A.data() + m*nn;
+            const float *B = h_B.data() + m*nn;
+            const float *C = h_C.data() + (pass ? h_offsets[m] : m*nn);
+            for (int i = 0; i < n; i++)
+                for (int j = 0; j < n; j++)
+                {
+                    float tmp = 0.0f;
+                    for (int k = 0; k < n; k++)
+                        tmp += A[i*n+k] * B[k*n+j];
+                    if (C[i*n+j] != tmp)
+                        errors++;
+                }
+        }
+    }
+    if (errors)
+        printf("\n Errors in batched multiplication: %d\n", errors);
+}
+
+//--------------------------------------------------------------------------------
+// Out-of-core matrix multiplication ... panels streamed through a device budget
+//--------------------------------------------------------------------------------
+
+// C is computed a P x P tile at a time from a P x K panel of A and a K x P
+// panel of B.  One buffer of at most the budget is split into two sets of
+// A, B and C sub-buffers: while the compute queue multiplies the panels in
+// one set, the transfer queue uploads the next panels into the other and
+// reads back the previous tile.  Each queue waits on events from the
+// other, so both are flushed after every command.
+void runOutOfCore(const cl::Device& device, const cl::Context& context,
+                  cl::CommandQueue& queue, int M, int N, int K,
+                  util::pinned_vector<float>& h_A, util::pinned_vector<float>& h_B,
+                  util::pinned_vector<float>& h_C, util::Benchmark& bench,
+                  util::Profiler& profiler, util::Trace& trace)
+{
+    cl::CommandQueue transferQueue = profiler.createQueue(context, device);
+
+    // Sub-buffers must start on the device's base address alignment
+    size_t align = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+    cl_ulong budget = budgetMB ? (cl_ulong)budgetMB << 20
+                               : std::min(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(),
+                                          device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 2);
+    budget = std::min(budget, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+
+    size_t maxWorkGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    int blocksize = maxWorkGroup >= 256 ? 16 : 8;
+
+    // Largest multiple of the block size with 2*(P*K + K*P + P*P) floats,
+    // plus alignment padding, inside the budget
+    double floats = (double)(budget - 6 * align) / (2 * sizeof(float));
+    int P = (int)(std::sqrt((double)K * K + floats) - K);
+    P = std::min(P, roundUp(std::max(M, N), blocksize));
+    P = (P / blocksize) * blocksize;
+    if (P < blocksize)
+    {
+        std::cout << "Device budget of " << (budget >> 20)
+                  << " MB is too small for K = " << K << "\n";
+        return;
+    }
+
+    size_t panelA = (sizeof(float) * P * K + align - 1) / align * align;
+    size_t panelB = panelA;
+    size_t tileC  = (sizeof(float) * P * P + align - 1) / align * align;
+    cl::Buffer d_budget(context, CL_MEM_READ_WRITE, 2 * (panelA + panelB + tileC));
+    cl::Buffer d_a[2], d_b[2], d_c[2];
+    for (int s = 0; s < 2; s++)
+    {
+        cl_buffer_region region;
+        region.origin = s * (panelA + panelB + tileC);
+        region.size   = panelA;
+        d_a[s] = d_budget.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+        region.origin += panelA;
+        region.size    = panelB;
+        d_b[s] = d_budget.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+        region.origin += panelB;
+        region.size    = tileC;
+        d_c[s] = d_budget.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+    }
+
+    std::stringstream options;
+    options << "-DBLKSZ=" << blocksize;
+    cl::Program program;
+    {
+        util::Trace::Region region(trace, "buildProgram");
+        program = util::buildProgram(context, util::loadProgram("C_block_form.cl"), options.str());
+    }
+    cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+                      cl::LocalSpaceArg, cl::LocalSpaceArg> block_mmul(program, "mmul");
+
+    int rowPanels = (M + P - 1) / P;
+    int colPanels = (N + P - 1) / P;
+    printf("\n===== Out-of-core matrix mult (blocked %dx%d), %dx%dx%d through %u MB in %dx%d panels ======\n",
+           blocksize, blocksize, M, N, K, (unsigned)(budget >> 20), P, P);
+
+    util::BenchmarkResult result = bench.run("Out-of-core blocked", [&]()
+    {
+        cl::LocalSpaceArg A_block = cl::Local(sizeof(float) * blocksize*blocksize);
+        cl::LocalSpaceArg B_block = cl::Local(sizeof(float) * blocksize*blocksize);
+
+        // Events of the last command to use each set of sub-buffers
+        cl::Event uploadA[2], uploadB[2], computed[2], readC[2];
+        int steps = rowPanels * colPanels;
+
+        // Uploads the panels of step t, once the compute that last read
+        // its sub-buffers has finished
+        auto upload = [&](int t)
+        {
+            int s  = t % 2;
+            int i0 = (t / colPanels) * P, j0 = (t % colPanels) * P;
+            int rows = std::min(P, M - i0), cols = std::min(P, N - j0);
+            std::vector<cl::Event> wait;
+            if (computed[s]())
+                wait.push_back(computed[s]);
+
+            // A panel is contiguous rows of A
+            transferQueue.enqueueWriteBuffer(d_a[s], CL_FALSE, 0,
+                sizeof(float) * rows * K, h_A.data() + (size_t)i0 * K,
+                &wait, &uploadA[s]);
+            profiler.record("write A panel", uploadA[s]);
+
+            // B panel is a column slice of B, packed to cols wide
+            cl::array<size_t, 3> origin = {{0, 0, 0}};
+            cl::array<size_t, 3> hostOrigin = {{sizeof(float) * j0, 0, 0}};
+            cl::array<size_t, 3> region = {{sizeof(float) * cols, (size_t)K, 1}};
+            transferQueue.enqueueWriteBufferRect(d_b[s], CL_FALSE,
+                origin, hostOrigin, region,
+                sizeof(float) * cols, 0, sizeof(float) * N, 0,
+                h_B.data(), &wait, &uploadB[s]);
+            profiler.record("write B panel", uploadB[s]);
+
+            // The compute queue waits on these events, so they must be
+            // submitted to the device
+            transferQueue.flush();
+        };
+
+        upload(0);
+        for (int t = 0; t < steps; t++)
+        {
+            int s  = t % 2;
+            int i0 = (t / colPanels) * P, j0 = (t % colPanels) * P;
+            int rows = std::min(P, M - i0), cols = std::min(P, N - j0);
+
+            if (t + 1 < steps)
+                upload(t + 1);
+
+            // Wait for this step's panels, and for the tile in this set
+            // of sub-buffers to have been read back
+            std::vector<cl::Event> wait;
+            wait.push_back(uploadA[s]);
+            wait.push_back(uploadB[s]);
+            if (readC[s]())
+                wait.push_back(readC[s]);
+            computed[s] = block_mmul(
+                cl::EnqueueArgs(queue, wait,
+                                cl::NDRange(roundUp(cols, blocksize), roundUp(rows, blocksize)),
+                                cl::NDRange(blocksize, blocksize)),
+                rows, cols, K, d_a[s], d_b[s], d_c[s], A_block, B_block);
+            profiler.record("Out-of-core blocked", computed[s]);
+            queue.flush();
+
+            wait.assign(1, computed[s]);
+            cl::array<size_t, 3> origin = {{0, 0, 0}};
+            cl::array<size_t, 3> hostOrigin = {{sizeof(float) * j0, (size_t)i0, 0}};
+            cl::array<size_t, 3> region = {{sizeof(float) * cols, (size_t)rows, 1}};
+            transferQueue.enqueueReadBufferRect(d_c[s], CL_FALSE,
+                origin, hostOrigin, region,
+                sizeof(float) * cols, 0, sizeof(float) * N, 0,
+                h_C.data(), &wait, &readC[s]);
+            profiler.record("read C tile", readC[s]);
+            transferQueue.flush();
+        }
+
+        queue.finish();
+        transferQueue.finish();
+    }, 2.0 * M * N * K * 1e-9, "GFLOP/s",
+    [&]()
+    {
+        zero_mat(M, N, h_C.data());
+    });
+
+    results(M, N, K, h_A.data(), h_B.data(), h_C.data(), result.stats.median);
+}
+
+//--------------------------------------------------------------------------------
+// Matrix multiplication in half, float and double storage
+//--------------------------------------------------------------------------------
+
+// Converts a float matrix to the plan's storage type, as raw bytes
+static std::vector<char> toStorage(const std::vector<float>& x, MatMulPlan::DataType type)
+{
+    std::vector<char> bytes(x.size() * MatMulPlan::elementSize(type));
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        if (type == MatMulPlan::HALF)
+            ((cl_half*)bytes.data())[i] = float_to_half(x[i]);
+        else if (type == MatMulPlan::DOUBLE)
+            ((double*)bytes.data())[i] = x[i];
+        else
+            ((float*)bytes.data())[i] = x[i];
+    }
+    return bytes;
+}
+
+// Converts a matrix in the plan's storage type back to double
+static std::vector<double> fromStorage(const std::vector<char>& bytes, MatMulPlan::DataType type)
+{
+    std::vector<double> x(bytes.size() / MatMulPlan::elementSize(type));
+    for (size_t i = 0; i < x.size(); i++)
+    {
+        if (type == MatMulPlan::HALF)
+            x[i] = half_to_float(((const cl_half*)bytes.data())[i]);
+        else if (type == MatMulPlan::DOUBLE)
+            x[i] = ((const double*)bytes.data())[i];
+        else
+            x[i] = ((const float*)bytes.data())[i];
+    }
+    return x;
+}
+
+// Every precision multiplies the same float matrices, with values in
+// [-1, 1] so that rounding shows up (the constant AVAL and BVAL products
+// are exact even in half).  The error is measured against the double
+// product of those float values, so for half it includes rounding the
+// inputs to half as well as the accumulation and the rounded result.
+void runPrecisions(const cl::Device& device, const cl::Context& context,
+                   cl::CommandQueue& queue, int M, int N, int K,
+                   util::Benchmark& bench, util::Profiler& profiler, util::Trace& trace)
+{
+    size_t sizeA = (size_t)M * K, sizeB = (size_t)K * N, sizeC = (size_t)M * N;
+    double gflop = 2.0 * M * N * K * 1e-9;
+
+    std::vector<float> h_A(sizeA), h_B(sizeB);
+    std::mt19937 gen(M + N + K);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (size_t i = 0; i < sizeA; i++)
+        h_A[i] = dist(gen);
+    for (size_t i = 0; i < sizeB; i++)
+        h_B[i] = dist(gen);
+
+    std::vector<double> r_A(h_A.begin(), h_A.end());
+    std::vector<double> r_B(h_B.begin(), h_B.end());
+    std::vector<double> r_C(sizeC);
+    seq_mat_mul_double(M, N, K, r_A, r_B, r_C);
+
+    const char *names[] = {"float", "half", "double"};
+    std::vector<std::pair<const char*, std::pair<double, double> > > summary;
+
+    for (size_t p = 0; p < precisions.size(); p++)
+    {
+        MatMulPlan::DataType type = precisions[p];
+        if (!MatMulPlan::supported(device, type))
+        {
+            printf("\n%s is not supported by this device (no cl_khr_fp64), skipped\n", names[type]);
+            continue;
+        }
+
+        size_t size = MatMulPlan::elementSize(type);
+        std::vector<char> s_A = toStorage(h_A, type);
+        std::vector<char> s_B = toStorage(h_B, type);
+        std::vector<char> s_C(sizeC * size);
+
+        cl::Buffer d_a(context, CL_MEM_READ_ONLY, size * sizeA);
+        cl::Buffer d_b(context, CL_MEM_READ_ONLY, size * sizeB);
+        cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, size * sizeC);
+        queue.enqueueWriteBuffer(d_a, CL_FALSE, 0, size * sizeA,
+                                 s_A.data(), NULL, profiler.event("write A"));
+        queue.enqueueWriteBuffer(d_b, CL_TRUE, 0, size * sizeB,
+                                 s_B.data(), NULL, profiler.event("write B"));
+
+        uint64_t planStart = util::hostTimeNanoseconds();
+        MatMulPlan plan(context, device, M, N, K, type, tune);
+        trace.add("buildProgram", planStart, util::hostTimeNanoseconds());
+
+        printf("\n===== Parallel matrix mult (%s), %dx%dx%d on device ======\n",
+               plan.description().c_str(), M, N, K);
+
+        util::BenchmarkResult result = bench.run(plan.name(), [&]()
+        {
+            profiler.record(plan.name(), plan.enqueue(queue, d_a, d_b, d_c));
+
+            queue.finish();
+        }, gflop, "GFLOP/s");
+
+        queue.enqueueReadBuffer(d_c, CL_TRUE, 0, size * sizeC,
+                                s_C.data(), NULL, profiler.event("read C"));
+
+        std::vector<double> C = fromStorage(s_C, type);
+        double maxerr = max_rel_error(M, N, C, r_C);
+        printf(" %.4f seconds at %.3f GFLOP/s, max relative error %g\n",
+               result.stats.median, gflop / result.stats.median, maxerr);
+        summary.push_back(std::make_pair(names[type],
+            std::make_pair(gflop / result.stats.median, maxerr)));
+    }
+
+    printf("\n %8s %16s %20s\n", "storage", "GFLOP/s", "max relative error");
+    for (size_t p = 0; p < summary.size(); p++)
+        printf(" %8s %16.3f %20g\n", summary[p].first,
+               summary[p].second.first, summary[p].second.second);
+}
+
+//--------------------------------------------------------------------------------
+// Quantized matrix multiplication ... int8 inputs, int32 or requantized output
+//--------------------------------------------------------------------------------
+
+// The product is run three times: with the int32 accumulator as the
+// result, and requantized to int8 with one scale and zero point and with
+// one per row.  All three are integer (or correctly rounded) so they must
+// match the host exactly.
+void runInt8(const cl::Device& device, const cl::Context& context,
+             cl::CommandQueue& queue, int M, int N, int K,
+             util::Benchmark& bench, util::Profiler& profiler, util::Trace& trace)
+{
+    size_t sizeC = (size_t)M * N;
+    int K4 = (K + 3) / 4;
+    double gop = 2.0 * M * N * K * 1e-9;
+
+    std::vector<cl_char> h_A((size_t)M * K), h_B((size_t)K * N);
+    std::mt19937 gen(M + N + K);
+    std::uniform_int_distribution<int> dist(-128, 127);
+    for (size_t i = 0; i < h_A.size(); i++)
+        h_A[i] = (cl_char)dist(gen);
+    for (size_t i = 0; i < h_B.size(); i++)
+        h_B[i] = (cl_char)dist(gen);
+
+    std::vector<cl_int> r_C(sizeC);
+    seq_mat_mul_int8(M, N, K, h_A, h_B, r_C);
+
+    // Scales that map the largest product (of the matrix, or of the row)
+    // to 127, and small zero points
+    std::vector<float>  rowScale(M), tensorScale(1);
+    std::vector<cl_int> rowZero(M), tensorZero(1, 1);
+    cl_int tensorMax = 1;
+    for (int i = 0; i < M; i++)
+    {
+        cl_int rowMax = 1;
+        for (int j = 0; j < N; j++)
+            rowMax = std::max(rowMax, std::abs(r_C[(size_t)i*N+j]));
+        rowScale[i] = 127.0f / rowMax;
+        rowZero[i]  = i % 5 - 2;
+        tensorMax   = std::max(tensorMax, rowMax);
+    }
+    tensorScale[0] = 127.0f / tensorMax;
+
+    // A by rows and B transposed, each row padded to K4 char4s
+    std::vector<cl_char> p_A((size_t)M * K4 * 4, 0), p_Bt((size_t)N * K4 * 4, 0);
+    for (int i = 0; i < M; i++)
+        for (int k = 0; k < K; k++)
+            p_A[(size_t)i*K4*4 + k] = h_A[(size_t)i*K + k];
+    for (int k = 0; k < K; k++)
+        for (int j = 0; j < N; j++)
+            p_Bt[(size_t)j*K4*4 + k] = h_B[(size_t)k*N + j];
+
+    cl::Buffer d_a(context, CL_MEM_READ_ONLY, p_A.size());
+    cl::Buffer d_bt(context, CL_MEM_READ_ONLY, p_Bt.size());
+    cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * sizeC);
+    cl::Buffer d_rowScale(context, CL_MEM_READ_ONLY, sizeof(float) * M);
+    cl::Buffer d_rowZero(context, CL_MEM_READ_ONLY, sizeof(cl_int) * M);
+    cl::Buffer d_tensorScale(context, CL_MEM_READ_ONLY, sizeof(float));
+    cl::Buffer d_tensorZero(context, CL_MEM_READ_ONLY, sizeof(cl_int));
+    queue.enqueueWriteBuffer(d_a, CL_FALSE, 0, p_A.size(),
+                             p_A.data(), NULL, profiler.event("write A"));
+    queue.enqueueWriteBuffer(d_bt, CL_FALSE, 0, p_Bt.size(),
+                             p_Bt.data(), NULL, profiler.event("write B"));
+    queue.enqueueWriteBuffer(d_rowScale, CL_FALSE, 0, sizeof(float) * M,
+                             rowScale.data(), NULL, profiler.event("write scale"));
+    queue.enqueueWriteBuffer(d_rowZero, CL_FALSE, 0, sizeof(cl_int) * M,
+                             rowZero.data(), NULL, profiler.event("write zero point"));
+    queue.enqueueWriteBuffer(d_tensorScale, CL_FALSE, 0, sizeof(float),
+                             tensorScale.data(), NULL, profiler.event("write scale"));
+    queue.enqueueWriteBuffer(d_tensorZero, CL_TRUE, 0, sizeof(cl_int),
+                             tensorZero.data(), NULL, profiler.event("write zero point"));
+
+    // Packed char4 dot products, if the device has them.  The extension
+    // only guarantees dot(char4, char4) when the 4x8-bit input capability
+    // is reported, not for devices with just the packed forms.
+    std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+    bool dot8 = false;
+    if (util::hasExtension(extensions, "cl_khr_integer_dot_product"))
+    {
+        cl_bitfield capabilities = 0;
+        if (clGetDeviceInfo(device(), CL_DEVICE_INTEGER_DOT_PRODUCT_CAPABILITIES_KHR,
+                            sizeof(capabilities), &capabilities, NULL) == CL_SUCCESS)
+            dot8 = (capabilities & CL_DEVICE_INTEGER_DOT_PRODUCT_INPUT_4x8BIT_KHR) != 0;
+    }
+    std::string dotOption = dot8 ? " -DDOT8" : "";
+
+    // Pick the tile size, timing the int32 output
+    std::string source = util::loadProgram("C_int8.cl");
+    std::stringstream problem;
+    problem << "M=" << M << ",N=" << N << ",K=" << K;
+    util::Tuner tuner(device, "C_int8", problem.str());
+    tuner.addParameter("TS", {4, 8, 16, 32});
+    size_t maxWorkGroup = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    tuner.addConstraint([&](const util::TuningConfig& c)
+    {
+        return c.at("TS") * c.at("TS") <= maxWorkGroup;
+    });
+    auto range = [&](const util::TuningConfig& c)
+    {
+        unsigned ts = c.at("TS");
+        return std::make_pair(cl::NDRange(roundUp(N, ts), roundUp(M, ts)), cl::NDRange(ts, ts));
+    };
+    util::TuningConfig defaults;
+    defaults["TS"] = maxWorkGroup >= 256 ? 16 : 8;
+    util::TuningConfig config = tuner.select(tune, defaults, [&](const util::TuningConfig& c)
+    {
+        cl::Program candidate = util::buildProgram(context, source, tuner.options(c) + dotOption);
+        cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> kernel(candidate, "mmul_int8");
+        return kernel(cl::EnqueueArgs(queue, range(c).first, range(c).second),
+                      M, N, K4, d_a, d_bt, d_c);
+    });
+
+    const char *names[] = {"Int8, int32 output", "Int8, per-tensor requantization",
+                           "Int8, per-row requantization"};
+    for (int requant = 0; requant < 3; requant++)
+    {
+        std::stringstream options;
+        options << tuner.options(config) << " -DREQUANT=" << requant << dotOption;
+        cl::Program program;
+        {
+            util::Trace::Region region(trace, "buildProgram");
+            program = util::buildProgram(context, source, options.str());
+        }
+        cl::Kernel kernel(program, "mmul_int8");
+        kernel.setArg(0, M);
+        kernel.setArg(1, N);
+        kernel.setArg(2, K4);
+        kernel.setArg(3, d_a);
+        kernel.setArg(4, d_bt);
+        kernel.setArg(5, d_c);
+        if (requant)
+        {
+            kernel.setArg(6, requant == 1 ? d_tensorScale : d_rowScale);
+            kernel.setArg(7, requant == 1 ? d_tensorZero : d_rowZero);
+        }
+
+        printf("\n===== %s (%ux%u tiles%s), %dx%dx%d on device ======\n",
+               names[requant], config.at("TS"), config.at("TS"),
+               dot8 ? ", integer dot product" : "", M, N, K);
+
+        util::BenchmarkResult result = bench.run(names[requant], [&]()
+        {
+            cl::Event event;
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, range(config).first,
+                                       range(config).second, NULL, &event);
+            profiler.record(names[requant], event);
+
+            queue.finish();
+        }, gop, "GOP/s");
+
+        // Check against the host, exactly
+        int errors = 0;
+        if (requant)
+        {
+            std::vector<cl_char> h_Q(sizeC), r_Q(sizeC);
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeC,
+                                    h_Q.data(), NULL, profiler.event("read C"));
+            if (requant == 1)
+                requantize(M, N, false, tensorScale, tensorZero, r_C, r_Q);
+            else
+                requantize(M, N, true, rowScale, rowZero, r_C, r_Q);
+            for (size_t i = 0; i < sizeC; i++)
+                errors += h_Q[i] != r_Q[i];
+        }
+        else
+        {
+            std::vector<cl_int> h_C(sizeC);
+            queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(cl_int) * sizeC,
+                                    h_C.data(), NULL, profiler.event("read C"));
+            for (size_t i = 0; i < sizeC; i++)
+                errors += h_C[i] != r_C[i];
+        }
+
+        printf(" %.4f seconds at %.3f GOP/s\n", result.stats.median, gop / result.stats.median);
+        if (errors)
+            printf("\n Errors in int8 multiplication: %d\n", errors);
+    }
+}
+
+void parseArguments(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--list"))
+        {
+            // Get list of devices
+            std::vector<cl::Device> devices;
+            unsigned numDevices = getDeviceList(devices);
+
+            // Print device names
+            if (numDevices == 0)
+            {
+                std::cout << "No devices found.\n";
+            }
+            else
+            {
+                std::cout << "\nDevices:\n";
+                for (unsigned int i = 0; i < numDevices; i++)
+                {
+                    std::cout << i << ": " << getDeviceName(devices[i]) << "\n";
+                }
+                std::cout << "\n";
+            }
+            exit(0);
+        }
+        else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
+        {
+            continue;
+        }
+        else if (!strcmp(argv[i], "--M") || !strcmp(argv[i], "--N") ||
+                 !strcmp(argv[i], "--K"))
+        {
+            cl_uint *dim = argv[i][2] == 'M' ? &Mdim : argv[i][2] == 'N' ? &Ndim : &Kdim;
+            if (++i >= argc || !parseUInt(argv[i], dim) || *dim == 0)
+            {
+                std::cout << "Invalid matrix size\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--batch"))
+        {
+            if (++i >= argc || !parseUInt(argv[i], &batchCount) || batchCount == 0)
+            {
+                std::cout << "Invalid batch count\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--size"))
+        {
+            if (++i >= argc || !parseUInt(argv[i], &batchSize) || batchSize == 0)
+            {
+                std::cout << "Invalid matrix size\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--out-of-core"))
+        {
+            outOfCore = true;
+        }
+        else if (!strcmp(argv[i], "--budget"))
+        {
+            if (++i >= argc || !parseUInt(argv[i], &budgetMB) || budgetMB == 0)
+            {
+                std::cout << "Invalid device budget\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--alpha") || !strcmp(argv[i], "--beta"))
+        {
+            float *value = argv[i][2] == 'a' ? &epilogue.alpha : &epilogue.beta;
+            char *next;
+            if (++i >= argc || (*value = strtof(argv[i], &next), *next))
+            {
+                std::cout << "Invalid epilogue scale\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--bias"))
+        {
+            if (++i < argc && !strcmp(argv[i], "row"))
+                epilogue.bias = Epilogue::ROW_BIAS;
+            else if (i < argc && !strcmp(argv[i], "col"))
+                epilogue.bias = Epilogue::COLUMN_BIAS;
+            else
+            {
+                std::cout << "Invalid bias (row or col)\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--activation"))
+        {
+            if (++i < argc && !strcmp(argv[i], "relu"))
+                epilogue.activation = Epilogue::RELU;
+            else if (i < argc && !strcmp(argv[i], "gelu"))
+                epilogue.activation = Epilogue::GELU;
+            else
+            {
+                std::cout << "Invalid activation (relu or gelu)\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--precision"))
+        {
+            if (++i < argc && !strcmp(argv[i], "float"))
+                precisions.push_back(MatMulPlan::FLOAT);
+            else if (i < argc && !strcmp(argv[i], "half"))
+                precisions.push_back(MatMulPlan::HALF);
+            else if (i < argc && !strcmp(argv[i], "double"))
+                precisions.push_back(MatMulPlan::DOUBLE);
+            else if (i < argc && !strcmp(argv[i], "all"))
+            {
+                precisions.push_back(MatMulPlan::HALF);
+                precisions.push_back(MatMulPlan::FLOAT);
+                precisions.push_back(MatMulPlan::DOUBLE);
+            }
+            else
+            {
+                std::cout << "Invalid precision (half, float, double or all)\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--int8"))
+        {
+            int8 = true;
+        }
+        else if (!strcmp(argv[i], "--random"))
+        {
+            randomInputs = true;
+        }
+        else if (!strcmp(argv[i], "--verify"))
+        {
+            if (++i >= argc || !parseUInt(argv[i], &verifyTrials) || verifyTrials == 0)
+            {
+                std::cout << "Invalid number of verification trials\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--skip-host"))
+        {
+            skipHost = true;
+        }
+        else if (!strcmp(argv[i], "--skip-naive"))
+        {
+            skipNaive = true;
+        }
+        else if (!strcmp(argv[i], "--host-threads"))
+        {
+            if (++i >= argc || !parseUInt(argv[i], &hostThreads))
+            {
+                std::cout << "Invalid number of host threads\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--pageable"))
+        {
+            pageable = true;
+        }
+        else if (!strcmp(argv[i], "--tune"))
+        {
+            tune = true;
+        }
+        else if (!strcmp(argv[i], "--profile"))
+        {
+            profile = true;
+        }
+        else if (!strcmp(argv[i], "--trace"))
+        {
+            if (++i >= argc)
+            {
+                std::cout << "Missing argument to --trace\n";
+                exit(1);
+            }
+            traceFile = argv[i];
+        }
+        else if (util::parseBenchmarkArgument(argc, argv, i, benchOptions))
+        {
+            continue;
+        }
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+        {
+            std::cout << "\n";
+            std::cout << "Usage: ./matmul [OPTIONS]\n\n";
+            std::cout << "Options:\n";
+            std::cout << "  -h  --help               Print the message\n";
+            std::cout << "      --list               List available devices\n";
+            printDeviceUsage();
+            std::cout << "      --M          M       Rows of A and C (default " << ORDER << ")\n";
+            std::cout << "      --N          N       Columns of B and C (default " << ORDER << ")\n";
+            std::cout << "      --K          K       Columns of A and rows of B (default " << ORDER << ")\n";
+            std::cout << "      --batch      B       Multiply B independent n x n matrices per launch\n";
+            std::cout << "      --size       n       Order of the batched matrices (default 32)\n";
+            std::cout << "      --out-of-core        Stream panels of the matrices through the device\n";
+            std::cout << "      --budget     MB      Device memory for --out-of-core (default: from device)\n";
+            std::cout << "      --alpha      A       Fused epilogue: C = alpha*A*B + ... (default 1)\n";
+            std::cout << "      --beta       B       Fused epilogue: ... + beta*C (default 0)\n";
+            std::cout << "      --bias       row|col Fused epilogue: add a bias per row or column\n";
+            std::cout << "      --activation relu|gelu  Fused epilogue: apply an activation\n";
+            std::cout << "      --precision  P       Compare storage precisions: half, float, double or all\n";
+            std::cout << "      --int8               Also run an int8 product with int32 accumulation\n";
+            std::cout << "      --random             Use random matrices, checked with Freivalds' algorithm\n";
+            std::cout << "      --verify     T       Check results with T random vectors (default 3 with --random)\n";
+            std::cout << "      --skip-host          Do not time the product on the host (the epilogue,\n";
+            std::cout << "                           --precision and --int8 checks still compute one)\n";
+            std::cout << "      --skip-naive         Do not run the naive (unblocked) device kernels\n";
+            std::cout << "      --host-threads N     Threads for the host product (default: all)\n";
+            std::cout << "      --pageable           Use pageable instead of pinned host memory\n";
+            std::cout << "      --tune               Search for the best work-group sizes\n";
+            std::cout << "      --profile            Report per-command event timings\n";
+            std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE\n";
+            util::printBenchmarkUsage();
+            std::cout << "\n";
+            exit(0);
+        }
+        else
+        {
+            std::cout << "Unrecognized argument '" << argv[i] << "' (try '--help')\n";
+            exit(1);
+        }
+    }
+}
@@ -28,8 +28,10 @@
 #include <CL/cl2.hpp>
 
 #include "util.hpp"
+#include "pinned_allocator.hpp"
 
 #include "matrix_lib.hpp"
+#include "matmul_plan.hpp"
 
 //------------------------------------------------------------------------------
 //  functions from ../Common
@@ -44,7 +46,6 @@ extern double wtime();   // returns time since some fixed past point (wtime.c)
 #define BVAL     5.0f    // B elements are constant and equal to BVAL
 #define TOL      (0.001) // tolerance used in floating point comparisons
 #define DIM      2       // Max dim for NDRange
-#define COUNT    1       // number of times to do each multiplication
 #define SUCCESS  1
 #define FAILURE  0
 
@@ -0,0 +1,240 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Reusable matrix multiplication plan
+//
+//  PURPOSE: Builds the chosen kernel once per problem and enqueues it
+//           without further compilation or allocation (see matmul_plan.hpp)
+//
+//------------------------------------------------------------------------------
+
+#include "matmul.hpp"
+
+#include <sstream>
+
+#include <autotune.hpp>
+
+static int roundUpTo(int value, int multiple)
+{
+    return ((value + multiple - 1) / multiple) * multiple;
+}
+
+MatMulPlan::MatMulPlan(const cl::Context& context, const cl::Device& device,
+                       int M, int N, int K, DataType type, bool retune,
+                       const Epilogue& epilogue)
+  : context_(context), device_(device), M_(M), N_(N), K_(K), type_(type),
+    epilogue_(epilogue)
+{
+    // The default register tiled configuration needs (32+32+2)*16 elements
+    // of local memory and a 64 work-item group
+    cl_ulong localMemSize = device_.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    size_t   maxWorkGroup = device_.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    if (localMemSize >= (32 + 32 + 2) * 16 * realSize() && maxWorkGroup >= 64)
+        buildTiled(retune);
+    else
+        buildBlocked();
+
+    kernel_.setArg(0, (cl_int)M_);
+    kernel_.setArg(1, (cl_int)N_);
+    kernel_.setArg(2, (cl_int)K_);
+    if (epilogue_.enabled())
+    {
+        kernel_.setArg(epilogueArg_,     epilogue_.alpha);
+        kernel_.setArg(epilogueArg_ + 1, epilogue_.beta);
+        kernel_.setArg(epilogueArg_ + 2, cl::Buffer());
+    }
+}
+
+bool MatMulPlan::supported(const cl::Device& device, DataType type)
+{
+    // vload_half and vstore_half are core, so half storage works everywhere
+    if (type != DOUBLE)
+        return true;
+    std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+    return util::hasExtension(extensions, "cl_khr_fp64");
+}
+
+size_t MatMulPlan::elementSize(DataType type)
+{
+    switch (type)
+    {
+        case HALF:   return sizeof(cl_half);
+        case DOUBLE: return sizeof(cl_double);
+        default:     return sizeof(cl_float);
+    }
+}
+
+// Size of the type the kernels compute in (and keep in local memory)
+size_t MatMulPlan::realSize() const
+{
+    return type_ == DOUBLE ? sizeof(cl_double) : sizeof(cl_float);
+}
+
+// Build option that selects the types in C_block_form.cl and C_tiled.cl
+std::string MatMulPlan::typeOptions() const
+{
+    switch (type_)
+    {
+        case HALF:   return " -DPRECISION=16";
+        case DOUBLE: return " -DPRECISION=64";
+        default:     return "";
+    }
+}
+
+// Build options that select the epilogue in C_block_form.cl and C_tiled.cl
+std::string MatMulPlan::epilogueOptions() const
+{
+    if (!epilogue_.enabled())
+        return "";
+
+    std::stringstream options;
+    options << " -DEPILOGUE";
+    if (epilogue_.beta != 0.0f)
+        options << " -DEPILOGUE_BETA";
+    if (epilogue_.bias != Epilogue::NO_BIAS)
+        options << " -DEPILOGUE_BIAS=" << (epilogue_.bias == Epilogue::ROW_BIAS ? 1 : 2);
+    if (epilogue_.activation != Epilogue::NO_ACTIVATION)
+        options << " -DEPILOGUE_ACT=" << (epilogue_.activation == Epilogue::RELU ? 1 : 2);
+    return options.str();
+}
+
+void MatMulPlan::setBias(const cl::Buffer& bias)
+{
+    if (epilogue_.enabled())
+        kernel_.setArg(epilogueArg_ + 2, bias);
+}
+
+void MatMulPlan::buildTiled(bool retune)
+{
+    // Same search space and database key as the "Register tiled" stage
+    std::string source = util::loadProgram("C_tiled.cl");
+    std::stringstream problem;
+    problem << "M=" << M_ << ",N=" << N_ << ",K=" << K_;
+    if (type_ == HALF)
+        problem << ",half";
+    else if (type_ == DOUBLE)
+        problem << ",double";
+    util::Tuner tuner(device_, "C_tiled", problem.str());
+    tuner.addParameter("TM", {2, 4, 8});
+    tuner.addParameter("TN", {2, 4, 8});
+    tuner.addParameter("TK", {8, 16, 32});
+    tuner.addParameter("WX", {8, 16}, util::Tuner::LOCAL_SIZE);
+    tuner.addParameter("WY", {8, 16}, util::Tuner::LOCAL_SIZE);
+    cl_ulong localMemSize = device_.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    tuner.addConstraint([&](const util::TuningConfig& c)
+    {
+        unsigned bm = c.at("WY") * c.at("TM");
+        unsigned bn = c.at("WX") * c.at("TN");
+        return (bm + bn + 2) * c.at("TK") * realSize() <= localMemSize;
+    });
+    auto options = [&](const util::TuningConfig& c)
+    {
+        std::stringstream str;
+        str << tuner.options(c) << " -DWX=" << c.at("WX") << " -DWY=" << c.at("WY")
+            << typeOptions();
+        return str.str();
+    };
+    auto global = [&](const util::TuningConfig& c)
+    {
+        return cl::NDRange(roundUpTo(N_, c.at("WX") * c.at("TN")) / c.at("TN"),
+                           roundUpTo(M_, c.at("WY") * c.at("TM")) / c.at("TM"));
+    };
+
+    util::TuningConfig defaults;
+    defaults["TM"] = 4;
+    defaults["TN"] = 4;
+    defaults["TK"] = 16;
+    defaults["WX"] = 8;
+    defaults["WY"] = 8;
+
+    util::TuningConfig config;
+    if (retune)
+    {
+        // Scratch matrices and a profiling queue, only for the search
+        cl::CommandQueue queue(context_, device_, CL_QUEUE_PROFILING_ENABLE);
+        size_t size = elementSize(type_);
+        cl::Buffer A(context_, CL_MEM_READ_ONLY,  size * (size_t)M_ * K_);
+        cl::Buffer B(context_, CL_MEM_READ_ONLY,  size * (size_t)K_ * N_);
+        cl::Buffer C(context_, CL_MEM_WRITE_ONLY, size * (size_t)M_ * N_);
+        config = tuner.select(true, defaults, [&](const util::TuningConfig& c)
+        {
+            cl::Program candidate = util::buildProgram(context_, source, options(c));
+            cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer> kernel(candidate, "mmul");
+            return kernel(cl::EnqueueArgs(queue, global(c), cl::NDRange(c.at("WX"), c.at("WY"))),
+                          M_, N_, K_, A, B, C);
+        });
+    }
+    else
+    {
+        config = tuner.select(false, defaults, NULL);
+    }
+
+    variant_ = REGISTER_TILED;
+    program_ = util::buildProgram(context_, source, options(config) + epilogueOptions());
+    kernel_  = cl::Kernel(program_, "mmul");
+    epilogueArg_ = 6;
+    global_  = global(config);
+    local_   = cl::NDRange(config.at("WX"), config.at("WY"));
+
+    std::stringstream description;
+    description << config.at("TM") << "x" << config.at("TN") << " tile per work item, "
+                << config.at("WX") << "x" << config.at("WY") << " work-group";
+    description_ = description.str();
+}
+
+void MatMulPlan::buildBlocked()
+{
+    int blocksize = device_.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() >= 256 ? 16 : 8;
+    std::stringstream options;
+    options << "-DBLKSZ=" << blocksize << typeOptions();
+
+    variant_ = BLOCKED;
+    program_ = util::buildProgram(context_, util::loadProgram("C_block_form.cl"),
+                                  options.str() + epilogueOptions());
+    kernel_  = cl::Kernel(program_, "mmul");
+    epilogueArg_ = 8;
+    global_  = cl::NDRange(roundUpTo(N_, blocksize), roundUpTo(M_, blocksize));
+    local_   = cl::NDRange(blocksize, blocksize);
+
+    // The local memory blocks are set once, with the sizes
+    kernel_.setArg(6, cl::Local(realSize() * blocksize * blocksize));
+    kernel_.setArg(7, cl::Local(realSize() * blocksize * blocksize));
+
+    std::stringstream description;
+    description << "blocked " << blocksize << "x" << blocksize;
+    description_ = description.str();
+}
+
+cl::Event MatMulPlan::enqueue(const cl::CommandQueue& queue,
+                              const cl::Buffer& A, const cl::Buffer& B, const cl::Buffer& C,
+                              const std::vector<cl::Event>* events)
+{
+    kernel_.setArg(3, A);
+    kernel_.setArg(4, B);
+    kernel_.setArg(5, C);
+
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernel_, cl::NullRange, global_, local_, events, &event);
+    return event;
+}
+
+std::string MatMulPlan::name() const
+{
+    std::string name = variant_ == REGISTER_TILED ? "Register tiled" : "Blocked";
+    if (type_ == HALF)
+        name += ", half";
+    else if (type_ == DOUBLE)
+        name += ", double";
+    return epilogue_.enabled() ? name + ", fused epilogue" : name;
+}
+
+std::string MatMulPlan::description() const
+{
+    std::string prefix;
+    if (type_ == HALF)
+        prefix = "half storage, ";
+    else if (type_ == DOUBLE)
+        prefix = "double, ";
+    if (epilogue_.enabled())
+        prefix += "fused epilogue, ";
+    return prefix + description_;
+}
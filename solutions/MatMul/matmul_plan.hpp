@@ -0,0 +1,109 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Reusable matrix multiplication plan (class definition)
+//
+//  PURPOSE: A MatMulPlan is created once per (device, M, N, K, data type).
+//           It picks the kernel and its configuration, builds the program
+//           and sets every argument except the matrices, so that each call
+//           to enqueue() is just three setArg calls and a launch.
+//
+//  USAGE:   MatMulPlan plan(context, device, M, N, K);
+//           cl::Event done = plan.enqueue(queue, d_a, d_b, d_c, &waitList);
+//
+//           An Epilogue (see matrix_lib.hpp) is compiled into the kernel
+//           and applied to C before it is stored; a bias vector is passed
+//           once with setBias().
+//
+//           The register tiled kernel is used with the configuration found
+//           by --tune (or the defaults), falling back to the blocked kernel
+//           on devices without enough local memory.  A plan's kernel is
+//           shared by all of its enqueue() calls, so one plan must not be
+//           enqueued from several threads at once.
+//
+//------------------------------------------------------------------------------
+
+#ifndef __MATMUL_PLAN_HDR
+#define __MATMUL_PLAN_HDR
+
+#include <string>
+#include <vector>
+
+class MatMulPlan
+{
+public:
+    //  Storage type of the matrices.  HALF is stored as cl_half and
+    //  computed in float; DOUBLE needs cl_khr_fp64 (see supported()).
+    enum DataType
+    {
+        FLOAT,
+        HALF,
+        DOUBLE
+    };
+
+    enum Variant
+    {
+        BLOCKED,
+        REGISTER_TILED
+    };
+
+    //--------------------------------------------------------------------------
+    //
+    //  Chooses and builds the kernel.  If retune is set, the register tiled
+    //  configurations are timed on a private queue (using scratch matrices
+    //  that are freed afterwards) and the best is stored.  The search times
+    //  the plain product, and the epilogue is added to the final build.
+    //
+    //--------------------------------------------------------------------------
+    MatMulPlan(const cl::Context& context, const cl::Device& device,
+               int M, int N, int K, DataType type = FLOAT, bool retune = false,
+               const Epilogue& epilogue = Epilogue());
+
+    //  Whether the device can run a plan of the given type
+    static bool supported(const cl::Device& device, DataType type);
+
+    //  Bytes per matrix element for the given type
+    static size_t elementSize(DataType type);
+
+    //  Sets the bias vector (M elements for a row bias, N for a column bias)
+    void setBias(const cl::Buffer& bias);
+
+    //--------------------------------------------------------------------------
+    //
+    //  Enqueues C = A * B (then the epilogue) once the events (if any) are
+    //  complete, and returns without waiting.  A is M x K, B is K x N and C
+    //  is M x N.
+    //
+    //--------------------------------------------------------------------------
+    cl::Event enqueue(const cl::CommandQueue& queue,
+                      const cl::Buffer& A, const cl::Buffer& B, const cl::Buffer& C,
+                      const std::vector<cl::Event>* events = NULL);
+
+    Variant variant() const { return variant_; }
+
+    //  Short name of the kernel, and a description of its configuration
+    std::string name() const;
+    std::string description() const;
+
+private:
+    void buildTiled(bool retune);
+    void buildBlocked();
+    std::string typeOptions() const;
+    std::string epilogueOptions() const;
+    size_t realSize() const;
+
+    cl::Context  context_;
+    cl::Device   device_;
+    int          M_, N_, K_;
+    DataType     type_;
+    Epilogue     epilogue_;
+    cl_uint      epilogueArg_;   // index of the alpha argument
+
+    Variant      variant_;
+    std::string  description_;
+    cl::Program  program_;
+    cl::Kernel   kernel_;
+    cl::NDRange  global_;
+    cl::NDRange  local_;
+};
+
+#endif
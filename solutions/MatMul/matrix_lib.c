@@ -5,8 +5,8 @@
 //  PURPOSE: This is a simple set of functions to manipulate
 //           matrices used with the multiplcation driver.
 //
-//  USAGE:   The matrices are square and the order is
-//           set as a defined constant, ORDER.
+//  USAGE:   A is M x K, B is K x N and C is M x N, all stored
+//           in row-major order.
 //
 //  HISTORY: Written by Tim Mattson, August 2010
 //           Modified by Simon McIntosh-Smith, September 2011
@@ -23,17 +23,17 @@
 //
 //------------------------------------------------------------------------------
 
-void seq_mat_mul_sdot(int N, float *A, float *B, float *C)
+void seq_mat_mul_sdot(int M, int N, int K, float *A, float *B, float *C)
 {
     int i, j, k;
     float tmp;
 
-    for (i = 0; i < N; i++) {
+    for (i = 0; i < M; i++) {
         for (j = 0; j < N; j++) {
             tmp = 0.0f;
-            for (k = 0; k < N; k++) {
+            for (k = 0; k < K; k++) {
                 /* C(i,j) = sum(over k) A(i,k) * B(k,j) */
-                tmp += A[i*N+k] * B[k*N+j];
+                tmp += A[i*K+k] * B[k*N+j];
             }
             C[i*N+j] = tmp;
         }
@@ -45,21 +45,21 @@ void seq_mat_mul_sdot(int N, float *A, float *B, float *C)
 //  Function to initialize the input matrices A and B
 //
 //------------------------------------------------------------------------------
-void initmat(int N, float *A, float *B, float *C)
+void initmat(int M, int N, int K, float *A, float *B, float *C)
 {
     int i, j;
 
     /* Initialize matrices */
 
-	for (i = 0; i < N; i++)
-		for (j = 0; j < N; j++)
-			A[i*N+j] = AVAL;
+	for (i = 0; i < M; i++)
+		for (j = 0; j < K; j++)
+			A[i*K+j] = AVAL;
 
-	for (i = 0; i < N; i++)
+	for (i = 0; i < K; i++)
 		for (j = 0; j < N; j++)
 			B[i*N+j] = BVAL;
 
-	for (i = 0; i < N; i++)
+	for (i = 0; i < M; i++)
 		for (j = 0; j < N; j++)
 			C[i*N+j] = 0.0f;
 }
@@ -69,27 +69,27 @@ void initmat(int N, float *A, float *B, float *C)
 //  Function to set a matrix to zero
 //
 //------------------------------------------------------------------------------
-void zero_mat (int N, float *C)
+void zero_mat (int M, int N, float *C)
 {
     int i, j;
 
-	for (i = 0; i < N; i++)
+	for (i = 0; i < M; i++)
 		for (j = 0; j < N; j++)
 			C[i*N+j] = 0.0f;
 }
 
 //------------------------------------------------------------------------------
 //
-//  Function to fill Btrans(N,N) with transpose of B(N,N)
+//  Function to fill Btrans(N,K) with transpose of B(K,N)
 //
 //------------------------------------------------------------------------------
-void trans(int N, float *B, float *Btrans)
+void trans(int K, int N, float *B, float *Btrans)
 {
     int i, j;
 
-	for (i = 0; i < N; i++)
+	for (i = 0; i < K; i++)
 		for (j = 0; j < N; j++)
-		    Btrans[j*N+i] = B[i*N+j];
+		    Btrans[j*K+i] = B[i*N+j];
 }
 
 //------------------------------------------------------------------------------
@@ -97,14 +97,14 @@ void trans(int N, float *B, float *Btrans)
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, float *C)
+float error(int M, int N, int K, float *C)
 {
    int i,j;
    float cval, errsq, err;
-   cval = (float) N * AVAL * BVAL;
+   cval = (float) K * AVAL * BVAL;
    errsq = 0.0f;
 
-    for (i = 0; i < N; i++) {
+    for (i = 0; i < M; i++) {
         for (j = 0; j < N; j++) {
             err = C[i*N+j] - cval;
             errsq += err * err;
@@ -118,14 +118,14 @@ float error(int N, float *C)
 //  Function to analyze and output results
 //
 //------------------------------------------------------------------------------
-void results(int N, float *C, double run_time)
+void results(int M, int N, int K, float *C, double run_time)
 {
     float gflops;
     float errsq;
 
-    gflops = 2.0 * N * N * N/(1000000000.0f * run_time);
+    gflops = 2.0 * M * N * K/(1000000000.0f * run_time);
     printf(" %.4f seconds at %.3f GFLOP/s \n",  run_time,gflops);
-    errsq = error(N, C);
+    errsq = error(M, N, K, C);
     if (isnan(errsq) || errsq > TOL) {
         printf("\n Errors in multiplication: %f\n",errsq);
     }
@@ -5,8 +5,8 @@
 //  PURPOSE: This is a simple set of functions to manipulate
 //           matrices used with the multiplcation driver.
 //
-//  USAGE:   The matrices are square and the order is
-//           set as a defined constant, ORDER.
+//  USAGE:   A is M x K, B is K x N and C is M x N, all stored
+//           in row-major order.
 //
 //  HISTORY: Written by Tim Mattson, August 2010
 //           Modified by Simon McIntosh-Smith, September 2011
@@ -18,51 +18,285 @@
 
 #include "matmul.hpp"
 
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+
 //------------------------------------------------------------------------------
 //
-//  Function to compute the matrix product (sequential algorithm, dot prod)
+//  Host matrix product: blocked for the caches, with packed panels of A and
+//  B and a small register-tiled inner kernel, split across threads by rows
+//  of C
 //
 //------------------------------------------------------------------------------
 
-void seq_mat_mul_sdot(int N, std::vector<float>& A, std::vector<float>& B, std::vector<float>& C)
+// Rows of A and columns of B in the inner kernel.  The accumulators are
+// MR x NR floats, which the compiler keeps in vector registers.
+#define HOST_MR 4
+#define HOST_NR 8
+
+// Cache blocks: a KC x NC panel of B stays in L2/L3, an MC x KC block of
+// A in L1/L2
+#define HOST_MC 64
+#define HOST_KC 256
+#define HOST_NC 1024
+
+static int host_threads = 0; // 0 means one per hardware thread
+static int verify_trials = 0; // 0 checks against the constant product
+
+void set_host_threads(int threads)
 {
-    int i, j, k;
-    float tmp;
+    host_threads = threads;
+}
 
-    for (i = 0; i < N; i++) {
-        for (j = 0; j < N; j++) {
-            tmp = 0.0f;
-            for (k = 0; k < N; k++) {
-                /* C(i,j) = sum(over k) A(i,k) * B(k,j) */
-                tmp += A[i*N+k] * B[k*N+j];
+int get_host_threads()
+{
+    if (host_threads > 0)
+        return host_threads;
+    int threads = std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
+
+// Copies B(k0:k0+kc, j0:j0+nc) into column panels HOST_NR wide, each stored
+// row by row, padding the last panel with zeros
+static void pack_b(int N, int K, const float *B, int k0, int kc, int j0, int nc, float *Bp)
+{
+    for (int jp = 0; jp < nc; jp += HOST_NR) {
+        for (int k = 0; k < kc; k++) {
+            const float *row = B + (size_t)(k0+k)*N + j0 + jp;
+            for (int j = 0; j < HOST_NR; j++)
+                *Bp++ = (jp + j < nc) ? row[j] : 0.0f;
+        }
+    }
+}
+
+// Copies A(i0:i0+mc, k0:k0+kc) into row panels HOST_MR high, each stored
+// column by column, padding the last panel with zeros
+static void pack_a(int K, const float *A, int i0, int mc, int k0, int kc, float *Ap)
+{
+    for (int ip = 0; ip < mc; ip += HOST_MR) {
+        for (int k = 0; k < kc; k++) {
+            for (int i = 0; i < HOST_MR; i++)
+                *Ap++ = (ip + i < mc) ? A[(size_t)(i0+ip+i)*K + k0 + k] : 0.0f;
+        }
+    }
+}
+
+// C(0:mr, 0:nr) (+)= Ap * Bp for one panel of each
+static void micro_kernel(int kc, const float *Ap, const float *Bp,
+                         float *C, int N, int mr, int nr, bool accumulate)
+{
+    float acc[HOST_MR][HOST_NR] = {{0.0f}};
+
+    for (int k = 0; k < kc; k++) {
+        for (int i = 0; i < HOST_MR; i++) {
+            float a = Ap[k*HOST_MR + i];
+            for (int j = 0; j < HOST_NR; j++)
+                acc[i][j] += a * Bp[k*HOST_NR + j];
+        }
+    }
+
+    for (int i = 0; i < mr; i++) {
+        for (int j = 0; j < nr; j++) {
+            if (accumulate)
+                C[(size_t)i*N + j] += acc[i][j];
+            else
+                C[(size_t)i*N + j]  = acc[i][j];
+        }
+    }
+}
+
+// Computes rows row0:row1 of C
+static void mat_mul_rows(int N, int K, const float *A, const float *B, float *C,
+                         int row0, int row1)
+{
+    std::vector<float> Ap(HOST_MC * HOST_KC);
+    std::vector<float> Bp(HOST_KC * ((HOST_NC + HOST_NR - 1) / HOST_NR) * HOST_NR);
+
+    for (int j0 = 0; j0 < N; j0 += HOST_NC) {
+        int nc = std::min(HOST_NC, N - j0);
+        for (int k0 = 0; k0 < K; k0 += HOST_KC) {
+            int kc = std::min(HOST_KC, K - k0);
+            pack_b(N, K, B, k0, kc, j0, nc, Bp.data());
+
+            for (int i0 = row0; i0 < row1; i0 += HOST_MC) {
+                int mc = std::min(HOST_MC, row1 - i0);
+                pack_a(K, A, i0, mc, k0, kc, Ap.data());
+
+                for (int jp = 0; jp < nc; jp += HOST_NR) {
+                    for (int ip = 0; ip < mc; ip += HOST_MR) {
+                        micro_kernel(kc, Ap.data() + ip*kc, Bp.data() + jp*kc,
+                                     C + (size_t)(i0+ip)*N + j0 + jp, N,
+                                     std::min(HOST_MR, mc - ip),
+                                     std::min(HOST_NR, nc - jp),
+                                     k0 > 0);
+                    }
+                }
             }
-            C[i*N+j] = tmp;
         }
     }
 }
 
+void seq_mat_mul_sdot(int M, int N, int K, float *A, float *B, float *C)
+{
+    if (K == 0) {
+        zero_mat(M, N, C);
+        return;
+    }
+
+    // Each thread gets whole micro-kernel rows of C
+    int threads = std::min(get_host_threads(), (M + HOST_MR - 1) / HOST_MR);
+    int chunk   = ((M + threads - 1) / threads + HOST_MR - 1) / HOST_MR * HOST_MR;
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        int row0 = std::min(M, t * chunk);
+        int row1 = std::min(M, row0 + chunk);
+        if (row0 < row1)
+            workers.push_back(std::thread(mat_mul_rows, N, K, A, B, C, row0, row1));
+    }
+    mat_mul_rows(N, K, A, B, C, 0, std::min(M, chunk));
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
 //------------------------------------------------------------------------------
 //
 //  Function to initialize the input matrices A and B
 //
 //------------------------------------------------------------------------------
-void initmat(int N, std::vector<float>& A, std::vector<float>& B, std::vector<float>& C)
+void initmat(int M, int N, int K, float *A, float *B, float *C)
 {
     int i, j;
 
     /* Initialize matrices */
 
-    for (i = 0; i < N; i++)
-        for (j = 0; j < N; j++)
-            A[i*N+j] = AVAL;
+    for (i = 0; i < M; i++)
+        for (j = 0; j < K; j++)
+            A[(size_t)i*K+j] = AVAL;
 
-    for (i = 0; i < N; i++)
+    for (i = 0; i < K; i++)
         for (j = 0; j < N; j++)
-            B[i*N+j] = BVAL;
+            B[(size_t)i*N+j] = BVAL;
 
-    for (i = 0; i < N; i++)
+    for (i = 0; i < M; i++)
         for (j = 0; j < N; j++)
-            C[i*N+j] = 0.0f;
+            C[(size_t)i*N+j] = 0.0f;
+}
+
+//------------------------------------------------------------------------------
+//
+//  Functions to fill the input matrices with random values
+//
+//------------------------------------------------------------------------------
+
+// Splits rows 0:rows across the host threads
+static void for_rows(int rows, const std::function<void(int, int)>& body)
+{
+    int threads = std::max(1, std::min(get_host_threads(), rows));
+    int chunk   = (rows + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        int row0 = std::min(rows, t * chunk);
+        int row1 = std::min(rows, row0 + chunk);
+        if (row0 < row1)
+            workers.push_back(std::thread(body, row0, row1));
+    }
+    body(0, std::min(rows, chunk));
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+// Value i of random stream seed, uniform in [-1, 1).  Each value is a hash
+// of its index (splitmix64), so the matrices do not depend on the number
+// of threads that fill them.
+static float rand_value(uint64_t seed, uint64_t i)
+{
+    uint64_t z = (seed << 48) + (i + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (float)(z >> 40) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+void randmat(int M, int N, int K, float *A, float *B, float *C)
+{
+    float *a = A, *b = B, *c = C;
+    for_rows(M, [=](int row0, int row1) {
+        for (size_t i = (size_t)row0*K; i < (size_t)row1*K; i++)
+            a[i] = rand_value(1, i);
+        for (size_t i = (size_t)row0*N; i < (size_t)row1*N; i++)
+            c[i] = 0.0f;
+    });
+    for_rows(K, [=](int row0, int row1) {
+        for (size_t i = (size_t)row0*N; i < (size_t)row1*N; i++)
+            b[i] = rand_value(2, i);
+    });
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to check a product with Freivalds' algorithm
+//
+//------------------------------------------------------------------------------
+float freivalds(int M, int N, int K, float *A, float *B, float *C,
+                int trials)
+{
+    const float *a = A, *b = B, *c = C;
+    std::vector<double> x(N), y(K), err(M);
+    float maxerr = 0.0f;
+
+    for (int t = 0; t < trials; t++) {
+        for (int j = 0; j < N; j++)
+            x[j] = rand_value(3 + t, j);
+
+        // y = B x
+        for_rows(K, [&](int row0, int row1) {
+            for (int k = row0; k < row1; k++) {
+                const float *row = b + (size_t)k*N;
+                double sum = 0.0;
+                for (int j = 0; j < N; j++)
+                    sum += row[j] * x[j];
+                y[k] = sum;
+            }
+        });
+
+        // Residual of C x against A (B x), relative to the size of the
+        // terms of C x, so roughly the relative error of the row of C.  A
+        // row of zeros gives an infinite error.
+        for_rows(M, [&](int row0, int row1) {
+            for (int i = row0; i < row1; i++) {
+                const float *arow = a + (size_t)i*K;
+                const float *crow = c + (size_t)i*N;
+                double ax = 0.0, cx = 0.0, scale = 0.0;
+                for (int k = 0; k < K; k++)
+                    ax += arow[k] * y[k];
+                for (int j = 0; j < N; j++) {
+                    cx    += crow[j] * x[j];
+                    scale += (crow[j] * x[j]) * (crow[j] * x[j]);
+                }
+                err[i] = std::fabs(cx - ax) / std::max(std::sqrt(scale), DBL_MIN);
+            }
+        });
+
+        for (int i = 0; i < M; i++) {
+            if (err[i] != err[i])
+                return (float)err[i];
+            maxerr = std::max(maxerr, (float)err[i]);
+        }
+    }
+    return maxerr;
+}
+
+void set_verify_trials(int trials)
+{
+    verify_trials = trials;
 }
 
 //------------------------------------------------------------------------------
@@ -70,27 +304,27 @@ void initmat(int N, std::vector<float>& A, std::vector<float>& B, std::vector<fl
 //  Function to set a matrix to zero
 //
 //------------------------------------------------------------------------------
-void zero_mat (int N, std::vector<float>& C)
+void zero_mat (int M, int N, float *C)
 {
     int i, j;
 
-    for (i = 0; i < N; i++)
+    for (i = 0; i < M; i++)
         for (j = 0; j < N; j++)
-            C[i*N+j] = 0.0f;
+            C[(size_t)i*N+j] = 0.0f;
 }
 
 //------------------------------------------------------------------------------
 //
-//  Function to fill Btrans(N,N) with transpose of B(N,N)
+//  Function to fill Btrans(N,K) with transpose of B(K,N)
 //
 //------------------------------------------------------------------------------
-void trans(int N, std::vector<float>& B, std::vector<float>& Btrans)
+void trans(int K, int N, float *B, float *Btrans)
 {
     int i, j;
 
-    for (i = 0; i < N; i++)
+    for (i = 0; i < K; i++)
         for (j = 0; j < N; j++)
-            Btrans[j*N+i] = B[i*N+j];
+            Btrans[(size_t)j*K+i] = B[(size_t)i*N+j];
 }
 
 //------------------------------------------------------------------------------
@@ -98,36 +332,283 @@ void trans(int N, std::vector<float>& B, std::vector<float>& Btrans)
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, std::vector<float>& C)
+float error(int M, int N, int K, float *C)
 {
    int i,j;
    float cval, errsq, err;
-   cval = (float) N * AVAL * BVAL;
+   cval = (float) K * AVAL * BVAL;
    errsq = 0.0f;
 
-    for (i = 0; i < N; i++) {
+    for (i = 0; i < M; i++) {
         for (j = 0; j < N; j++) {
-            err = C[i*N+j] - cval;
+            err = C[(size_t)i*N+j] - cval;
             errsq += err * err;
         }
     }
     return errsq;
 }
 
+//------------------------------------------------------------------------------
+//
+//  Function to apply an epilogue on the host, with the same operations in
+//  the same order as the kernels
+//
+//------------------------------------------------------------------------------
+void apply_epilogue(int M, int N, const Epilogue& epilogue, std::vector<float>& bias,
+                    float *Cin, float *C)
+{
+    int i, j;
+    float x;
+
+    for (i = 0; i < M; i++) {
+        for (j = 0; j < N; j++) {
+            x = epilogue.alpha * C[(size_t)i*N+j];
+            if (epilogue.beta != 0.0f)
+                x += epilogue.beta * Cin[(size_t)i*N+j];
+            if (epilogue.bias == Epilogue::ROW_BIAS)
+                x += bias[i];
+            else if (epilogue.bias == Epilogue::COLUMN_BIAS)
+                x += bias[j];
+            if (epilogue.activation == Epilogue::RELU)
+                x = std::max(x, 0.0f);
+            else if (epilogue.activation == Epilogue::GELU)
+                x = 0.5f * x * (1.0f + std::tanh(0.7978845608f * (x + 0.044715f * x*x*x)));
+            C[(size_t)i*N+j] = x;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the largest relative error of C against a reference
+//
+//------------------------------------------------------------------------------
+float max_rel_error(int M, int N, float *C, float *Cref)
+{
+    int i, j;
+    float err, maxerr = 0.0f;
+
+    for (i = 0; i < M; i++) {
+        for (j = 0; j < N; j++) {
+            // Relative to 1 near zero, where GELU and ReLU outputs cluster
+            err = std::fabs(C[(size_t)i*N+j] - Cref[(size_t)i*N+j]) /
+                  std::max(std::fabs(Cref[(size_t)i*N+j]), 1.0f);
+            if (err != err)
+                return err;
+            maxerr = std::max(maxerr, err);
+        }
+    }
+    return maxerr;
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the matrix product in double precision: a plain
+//  i-k-j loop, split across the host threads by rows of C
+//
+//------------------------------------------------------------------------------
+// Computes rows row0:row1 of C = A * B in double precision
+static void mat_mul_double_rows(int N, int K, const double *A, const double *B,
+                                double *C, int row0, int row1)
+{
+    for (int i = row0; i < row1; i++) {
+        double *c = C + (size_t)i*N;
+        for (int j = 0; j < N; j++)
+            c[j] = 0.0;
+        for (int k = 0; k < K; k++) {
+            double a = A[(size_t)i*K+k];
+            const double *b = B + (size_t)k*N;
+            for (int j = 0; j < N; j++)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+void seq_mat_mul_double(int M, int N, int K, std::vector<double>& A, std::vector<double>& B, std::vector<double>& C)
+{
+    int threads = std::max(1, std::min(get_host_threads(), M));
+    int chunk   = (M + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        int row0 = std::min(M, t * chunk);
+        int row1 = std::min(M, row0 + chunk);
+        if (row0 < row1)
+            workers.push_back(std::thread(mat_mul_double_rows, N, K, A.data(), B.data(),
+                                          C.data(), row0, row1));
+    }
+    mat_mul_double_rows(N, K, A.data(), B.data(), C.data(), 0, std::min(M, chunk));
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+//------------------------------------------------------------------------------
+//
+//  Functions to convert between float and half, bit by bit
+//
+//------------------------------------------------------------------------------
+cl_half float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+
+    // Infinity and NaN (kept quiet)
+    if (absx >= 0x7f800000)
+        return (cl_half)(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0));
+
+    // Too large for a half, even after rounding
+    if (absx >= 0x47800000)
+        return (cl_half)(sign | 0x7c00);
+
+    // Below the smallest normal half: denormal, or zero below 2^-25
+    if (absx < 0x38800000) {
+        if (absx < 0x33000000)
+            return (cl_half)sign;
+        uint32_t mant  = (absx & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - (absx >> 23);
+        uint32_t h     = mant >> shift;
+        uint32_t rem   = mant & ((1u << shift) - 1);
+        uint32_t tie   = 1u << (shift - 1);
+        if (rem > tie || (rem == tie && (h & 1)))
+            h++;
+        return (cl_half)(sign | h);
+    }
+
+    // Rebias the exponent and round the mantissa; a carry out of the
+    // mantissa bumps the exponent, and out of the largest half gives infinity
+    uint32_t h   = (absx - 0x38000000) >> 13;
+    uint32_t rem = absx & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++;
+    return (cl_half)(sign | h);
+}
+
+float half_to_float(cl_half h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+
+    if (exp == 0) {
+        float f = std::ldexp((float)mant, -24);
+        return sign ? -f : f;
+    }
+    else if (exp == 31)
+        x = sign | 0x7f800000 | (mant << 13);
+    else
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the largest relative error against a double
+//  precision reference
+//
+//------------------------------------------------------------------------------
+double max_rel_error(int M, int N, std::vector<double>& C, std::vector<double>& Cref)
+{
+    double err, maxerr = 0.0;
+
+    for (size_t i = 0; i < (size_t)M*N; i++) {
+        err = std::fabs(C[i] - Cref[i]) / std::max(std::fabs(Cref[i]), 1.0);
+        if (err != err)
+            return err;
+        maxerr = std::max(maxerr, err);
+    }
+    return maxerr;
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the product of int8 matrices with int32
+//  accumulation, split across the host threads by rows of C
+//
+//------------------------------------------------------------------------------
+// Computes rows row0:row1 of C = A * B
+static void mat_mul_int8_rows(int N, int K, const cl_char *A, const cl_char *B,
+                              cl_int *C, int row0, int row1)
+{
+    for (int i = row0; i < row1; i++) {
+        cl_int *c = C + (size_t)i*N;
+        for (int j = 0; j < N; j++)
+            c[j] = 0;
+        for (int k = 0; k < K; k++) {
+            cl_int a = A[(size_t)i*K+k];
+            const cl_char *b = B + (size_t)k*N;
+            for (int j = 0; j < N; j++)
+                c[j] += a * b[j];
+        }
+    }
+}
+
+void seq_mat_mul_int8(int M, int N, int K, std::vector<cl_char>& A, std::vector<cl_char>& B, std::vector<cl_int>& C)
+{
+    int threads = std::max(1, std::min(get_host_threads(), M));
+    int chunk   = (M + threads - 1) / threads;
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        int row0 = std::min(M, t * chunk);
+        int row1 = std::min(M, row0 + chunk);
+        if (row0 < row1)
+            workers.push_back(std::thread(mat_mul_int8_rows, N, K, A.data(), B.data(),
+                                          C.data(), row0, row1));
+    }
+    mat_mul_int8_rows(N, K, A.data(), B.data(), C.data(), 0, std::min(M, chunk));
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
+
+//------------------------------------------------------------------------------
+//
+//  Function to requantize an int32 product to int8
+//
+//------------------------------------------------------------------------------
+void requantize(int M, int N, bool perRow, std::vector<float>& scale, std::vector<cl_int>& zero,
+                std::vector<cl_int>& C, std::vector<cl_char>& Q)
+{
+    for (int i = 0; i < M; i++) {
+        int r = perRow ? i : 0;
+        for (int j = 0; j < N; j++) {
+            // Same rounding as the device: int to float and the product to
+            // nearest, then halfway cases to even
+            float x = (float)C[(size_t)i*N+j] * scale[r];
+            double q = std::nearbyint((double)x) + zero[r];
+            Q[(size_t)i*N+j] = (cl_char)std::min(127.0, std::max(-128.0, q));
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 //
 //  Function to analyze and output results
 //
 //------------------------------------------------------------------------------
-void results(int N, std::vector<float>& C, double run_time)
+void results(int M, int N, int K, float *A, float *B, float *C,
+             double run_time)
 {
 
     double gflops;
     float errsq;
     
-    gflops = 2.0 * N * N * N/(1000000000.0f * run_time);
+    gflops = 2.0 * M * N * K/(1000000000.0f * run_time);
     printf(" %.4f seconds at %.3f GFLOP/s \n",  run_time,gflops);
-    errsq = error(N, C);
+    if (verify_trials > 0) {
+        errsq = freivalds(M, N, K, A, B, C, verify_trials);
+        if ((errsq!=errsq) || errsq > TOL)
+            printf("\n Errors in multiplication: residual %g\n",errsq);
+        return;
+    }
+    errsq = error(M, N, K, C);
     if ((errsq!=errsq) || errsq > TOL)
            printf("\n Errors in multiplication: %f\n",errsq);
 }
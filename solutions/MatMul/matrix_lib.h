@@ -18,35 +18,35 @@
 //  Function to compute the matrix product (sequential algorithm, dot producdt)
 //
 //------------------------------------------------------------------------------
-void seq_mat_mul_sdot(int N, float *A, float *B, float *C);
+void seq_mat_mul_sdot(int M, int N, int K, float *A, float *B, float *C);
 
 //------------------------------------------------------------------------------
 //
 //  Function to initialize the input matrices A and B
 //
 //------------------------------------------------------------------------------
-void initmat(int N, float *A, float *B, float *C);
+void initmat(int M, int N, int K, float *A, float *B, float *C);
 
 //------------------------------------------------------------------------------
 //
 //  Function to set a matrix to zero 
 //
 //------------------------------------------------------------------------------
-void zero_mat (int N, float *C);
+void zero_mat (int M, int N, float *C);
 
 //------------------------------------------------------------------------------
 //
-//  Function to fill Btrans(Mdim,Pdim)  with transpose of B(Pdim,Mdim)
+//  Function to fill Btrans(N,K) with transpose of B(K,N)
 //
 //------------------------------------------------------------------------------
-void trans(int N, float *B, float *Btrans);
+void trans(int K, int N, float *B, float *Btrans);
 
 //------------------------------------------------------------------------------
 //
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, float *C);
+float error(int M, int N, int K, float *C);
 
 
 //------------------------------------------------------------------------------
@@ -54,6 +54,6 @@ float error(int N, float *C);
 //  Function to analyze and output results 
 //
 //------------------------------------------------------------------------------
-void results(int N, float *C, double run_time);
+void results(int M, int N, int K, float *C, double run_time);
     
 #endif
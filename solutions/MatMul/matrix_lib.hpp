@@ -16,45 +16,164 @@
 
 //------------------------------------------------------------------------------
 //
-//  Function to compute the matrix product (sequential algorithm, dot producdt)
+//  Function to compute the matrix product on the host (cache blocked,
+//  vectorized and multithreaded)
 //
 //------------------------------------------------------------------------------
-void seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C);
+void seq_mat_mul_sdot(int M, int N, int K, float *A, float *B, float *C);
+
+//------------------------------------------------------------------------------
+//
+//  Functions to set and get the number of host threads (0 for one per
+//  hardware thread)
+//
+//------------------------------------------------------------------------------
+void set_host_threads(int threads);
+int get_host_threads();
 
 //------------------------------------------------------------------------------
 //
 //  Function to initialize the input matrices A and B
 //
 //------------------------------------------------------------------------------
-void initmat(int N, std::vector<float>& A, std::vector<float>& B, std::vector<float>& C);
+void initmat(int M, int N, int K, float *A, float *B, float *C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to fill A and B with random values in [-1, 1) (the same for
+//  every run) and set C to zero
+//
+//------------------------------------------------------------------------------
+void randmat(int M, int N, int K, float *A, float *B, float *C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to check C = A * B in O(trials * (MK + KN + MN)) with Freivalds'
+//  algorithm: for random vectors x, compare C x with A (B x).  Returns the
+//  largest residual, relative to the size of the terms of that row of C x.
+//
+//------------------------------------------------------------------------------
+float freivalds(int M, int N, int K, float *A, float *B, float *C,
+                int trials);
+
+//------------------------------------------------------------------------------
+//
+//  Function to set how results() checks a product: with trials > 0 by
+//  freivalds(), which works for any inputs, and with 0 against the
+//  constant AVAL and BVAL product
+//
+//------------------------------------------------------------------------------
+void set_verify_trials(int trials);
 
 //------------------------------------------------------------------------------
 //
 //  Function to set a matrix to zero 
 //
 //------------------------------------------------------------------------------
-void zero_mat (int N, std::vector<float> &C);
+void zero_mat (int M, int N, float *C);
 
 //------------------------------------------------------------------------------
 //
-//  Function to fill Btrans(Mdim,Pdim)  with transpose of B(Pdim,Mdim)
+//  Function to fill Btrans(N,K) with transpose of B(K,N)
 //
 //------------------------------------------------------------------------------
-void trans(int N, std::vector<float>& B, std::vector<float>& Btrans);
+void trans(int K, int N, float *B, float *Btrans);
 
 //------------------------------------------------------------------------------
 //
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, std::vector<float>& C);
+float error(int M, int N, int K, float *C);
+
+
+//------------------------------------------------------------------------------
+//
+//  Operations fused after the product:  C = act(alpha*A*B + beta*C + bias)
+//
+//------------------------------------------------------------------------------
+struct Epilogue
+{
+    enum Bias { NO_BIAS, ROW_BIAS, COLUMN_BIAS };
+    enum Activation { NO_ACTIVATION, RELU, GELU };
+
+    float      alpha;
+    float      beta;
+    Bias       bias;
+    Activation activation;
+
+    Epilogue() : alpha(1.0f), beta(0.0f), bias(NO_BIAS), activation(NO_ACTIVATION) {}
 
+    bool enabled() const
+    {
+        return alpha != 1.0f || beta != 0.0f || bias != NO_BIAS || activation != NO_ACTIVATION;
+    }
+};
+
+//------------------------------------------------------------------------------
+//
+//  Function to apply an epilogue on the host: C holds A*B on entry and the
+//  result on exit, Cin is the value of C before the product
+//
+//------------------------------------------------------------------------------
+void apply_epilogue(int M, int N, const Epilogue& epilogue, std::vector<float>& bias,
+                    float *Cin, float *C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the largest relative error of C against a reference
+//
+//------------------------------------------------------------------------------
+float max_rel_error(int M, int N, float *C, float *Cref);
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the matrix product in double precision, as the
+//  reference for the other precisions
+//
+//------------------------------------------------------------------------------
+void seq_mat_mul_double(int M, int N, int K, std::vector<double>& A, std::vector<double>& B, std::vector<double>& C);
+
+//------------------------------------------------------------------------------
+//
+//  Functions to convert between float and half (round to nearest even)
+//
+//------------------------------------------------------------------------------
+cl_half float_to_half(float f);
+float half_to_float(cl_half h);
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the largest relative error against a double
+//  precision reference
+//
+//------------------------------------------------------------------------------
+double max_rel_error(int M, int N, std::vector<double>& C, std::vector<double>& Cref);
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the product of int8 matrices with int32
+//  accumulation:  C(M,N) = A(M,K) * B(K,N)
+//
+//------------------------------------------------------------------------------
+void seq_mat_mul_int8(int M, int N, int K, std::vector<cl_char>& A, std::vector<cl_char>& B, std::vector<cl_int>& C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to requantize an int32 product to int8:
+//  Q = clamp(rint(C * scale) + zero, -128, 127), with scale[i] and zero[i]
+//  for row i if perRow is set and scale[0] and zero[0] for every row if not
+//
+//------------------------------------------------------------------------------
+void requantize(int M, int N, bool perRow, std::vector<float>& scale, std::vector<cl_int>& zero,
+                std::vector<cl_int>& C, std::vector<cl_char>& Q);
 
 //------------------------------------------------------------------------------
 //
 //  Function to analyze and output results 
 //
 //------------------------------------------------------------------------------
-void results(int N, std::vector<float>& C, double run_time);
+void results(int M, int N, int K, float *A, float *B, float *C,
+             double run_time);
     
 #endif
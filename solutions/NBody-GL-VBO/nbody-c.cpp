@@ -211,16 +211,13 @@ int main(int argc, char *argv[])
   checkError(err, "creating command queue");
 
   char *source = loadProgram("kernel.cl");
-  program = clCreateProgramWithSource(context, 1, (const char **)&source,
-                                      NULL, &err);
-  checkError(err, "creating program");
 
   char options[256];
   sprintf(options,
           "-cl-fast-relaxed-math -cl-single-precision-constant "
           "-Dsoftening=%ff -Ddelta=%ff -DWGSIZE=%d %s",
           softening, delta, wgsize, useLocal ? "-DUSE_LOCAL" : "");
-  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  program = buildProgram(context, device, source, options, &err);
   if (err == CL_BUILD_PROGRAM_FAILURE)
   {
     size_t sz;
@@ -604,13 +601,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, &i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        printf("Invalid device index\n");
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--numbodies") || !strcmp(argv[i], "-n"))
     {
@@ -683,7 +676,7 @@ void parseArguments(int argc, char *argv[])
       printf("Options:\n");
       printf("  -h  --help               Print the message\n");
       printf("      --list               List available devices\n");
-      printf("      --device     INDEX   Select device at INDEX\n");
+      printDeviceUsage();
       printf("  -n  --numbodies  N       Run simulation with N bodies\n");
       printf("  -d  --delta      DELTA   Time difference between iterations\n");
       printf("  -s  --softening  SOFT    Force softening factor\n");
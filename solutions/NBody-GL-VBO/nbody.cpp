@@ -49,6 +49,8 @@
 #include "util.hpp"
 #include "err_code.h"
 #include "device_picker.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
 
 #define GLM_FORCE_RADIANS
 #include "glm/glm.hpp"
@@ -79,6 +81,7 @@ bool     useLocal      =     false;
 unsigned init2D        =      0;
 cl_uint  windowWidth   =    640;
 cl_uint  windowHeight  =    480;
+std::string traceFile;
 
 // SDL/GL objects
 SDL_Window    *window;
@@ -98,6 +101,8 @@ int main(int argc, char *argv[])
 
     parseArguments(argc, argv);
 
+    util::Trace trace(traceFile);
+
     initGraphics();
 
     // Initialize host data
@@ -191,9 +196,8 @@ int main(int argc, char *argv[])
 
 
     cl::Context context(device, useGLInterop ? properties : NULL);
-    cl::CommandQueue queue(context);
-
-    cl::Program program(context, util::loadProgram("kernel.cl"));
+    util::Profiler profiler(trace.enabled());
+    cl::CommandQueue queue = profiler.createQueue(context, device);
 
     std::stringstream options;
     options.setf(std::ios::fixed, std::ios::floatfield);
@@ -204,7 +208,12 @@ int main(int argc, char *argv[])
     options << " -DWGSIZE=" << wgsize;
     if (useLocal)
       options << " -DUSE_LOCAL";
-    program.build(options.str().c_str());
+    cl::Program program;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      program = util::buildProgram(context, util::loadProgram("kernel.cl"),
+                                   options.str());
+    }
 
     cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
       nbodyKernel(program, "nbody");
@@ -268,30 +277,40 @@ int main(int argc, char *argv[])
       // ***********************
       glFlush();
       if (useGLInterop)
-        queue.enqueueAcquireGLObjects(&clglObjects);
+        queue.enqueueAcquireGLObjects(&clglObjects, NULL,
+                                      profiler.event("acquire"));
 
-      nbodyKernel(cl::EnqueueArgs(queue, global, local),
-                  d_positions[INDEX_IN], d_positions[INDEX_OUT], d_velocities,
-                  numBodies);
+      profiler.record("nbody",
+        nbodyKernel(cl::EnqueueArgs(queue, global, local),
+                    d_positions[INDEX_IN], d_positions[INDEX_OUT], d_velocities,
+                    numBodies));
 
       // **************************
       // Release buffers back to GL
       // **************************
       if (useGLInterop)
-        queue.enqueueReleaseGLObjects(&clglObjects);
-      queue.finish();
+        queue.enqueueReleaseGLObjects(&clglObjects, NULL,
+                                      profiler.event("release"));
+      {
+        util::Trace::Region region(trace, "finish");
+        queue.finish();
+      }
 
       // Manually copy data into GL vertex buffer if we don't have GL interop
       if (!useGLInterop)
       {
+        util::Trace::Region region(trace, "copy to GL");
         void *data = queue.enqueueMapBuffer(d_positions[INDEX_OUT],
                                             CL_TRUE, CL_MAP_READ,
-                                            0, numBodies*sizeof(cl_float4));
+                                            0, numBodies*sizeof(cl_float4),
+                                            NULL, profiler.event("map"));
         glBufferSubData(GL_ARRAY_BUFFER, 0, numBodies*sizeof(cl_float4), data);
-        queue.enqueueUnmapMemObject(d_positions[INDEX_OUT], data);
+        queue.enqueueUnmapMemObject(d_positions[INDEX_OUT], data, NULL,
+                                    profiler.event("unmap"));
       }
 
       // Render body positions
+      uint64_t renderStart = util::hostTimeNanoseconds();
       glUseProgram(gl.program);
 
       glEnable(GL_BLEND);
@@ -307,6 +326,7 @@ int main(int argc, char *argv[])
 
       // Update window
       SDL_GL_SwapWindow(window);
+      trace.add("render", renderStart, util::hostTimeNanoseconds());
 
       // Check for user input
       if (handleSDLEvents())
@@ -327,6 +347,8 @@ int main(int argc, char *argv[])
     std::cout << "Average FPS was " << (i / ((endTime-startTime)*1e-6))
               << std::endl << std::endl;
 
+    trace.write(profiler);
+
     releaseGraphics();
   }
   catch (cl::BuildError error)
@@ -555,13 +577,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--numbodies") || !strcmp(argv[i], "-n"))
     {
@@ -607,6 +625,15 @@ void parseArguments(int argc, char *argv[])
     {
       useLocal = true;
     }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
       std::cout << std::endl;
@@ -614,13 +641,14 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "  -n  --numbodies  N       Run simulation with N bodies" << std::endl;
       std::cout << "  -d  --delta      DELTA   Time difference between iterations" << std::endl;
       std::cout << "  -s  --softening  SOFT    Force softening factor" << std::endl;
       std::cout << "  -i  --iterations ITRS    Run simulation for ITRS iterations" << std::endl;
       std::cout << "      --local              Enable use of local memory" << std::endl;
       std::cout << "      --wgsize     WGSIZE  Set work-group size to WGSIZE" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
       std::cout << std::endl;
       exit(0);
     }
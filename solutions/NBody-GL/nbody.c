@@ -46,6 +46,12 @@
   #define M_PI 3.14159265358979323846
 #endif
 
+#if defined(__APPLE__)
+  #define GL_SHARING_EXTENSION "cl_APPLE_gl_sharing"
+#else
+  #define GL_SHARING_EXTENSION "cl_khr_gl_sharing"
+#endif
+
 int      handleSDLEvents();
 void     initGraphics();
 void     parseArguments(int argc, char *argv[]);
@@ -83,6 +89,8 @@ int main(int argc, char *argv[])
   cl_kernel        nbodyKernel, fillKernel, drawKernel;
   double           start, end;
 
+  // Only devices that can share objects with OpenGL can run this
+  requiredExtensions[numRequiredExtensions++] = GL_SHARING_EXTENSION;
   parseArguments(argc, argv);
 
   initGraphics();
@@ -180,16 +188,13 @@ int main(int argc, char *argv[])
   checkError(err, "creating command queue");
 
   char *source = loadProgram("kernel.cl");
-  program = clCreateProgramWithSource(context, 1, (const char **)&source,
-                                      NULL, &err);
-  checkError(err, "creating program");
 
   char options[256];
   sprintf(options,
           "-cl-fast-relaxed-math -cl-single-precision-constant "
           "-Dsoftening=%ff -Ddelta=%ff -DWGSIZE=%d %s",
           softening, delta, wgsize, useLocal ? "-DUSE_LOCAL" : "");
-  err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  program = buildProgram(context, device, source, options, &err);
   if (err == CL_BUILD_PROGRAM_FAILURE)
   {
     size_t sz;
@@ -464,13 +469,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, &i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        printf("Invalid device index\n");
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--numbodies") || !strcmp(argv[i], "-n"))
     {
@@ -543,7 +544,7 @@ void parseArguments(int argc, char *argv[])
       printf("Options:\n");
       printf("  -h  --help               Print the message\n");
       printf("      --list               List available devices\n");
-      printf("      --device     INDEX   Select device at INDEX\n");
+      printDeviceUsage();
       printf("  -n  --numbodies  N       Run simulation with N bodies\n");
       printf("  -d  --delta      DELTA   Time difference between iterations\n");
       printf("  -s  --softening  SOFT    Force softening factor\n");
@@ -44,11 +44,19 @@
 #include "util.hpp"
 #include "err_code.h"
 #include "device_picker.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
 
 #ifndef M_PI
   #define M_PI 3.14159265358979323846f
 #endif
 
+#if defined(__APPLE__)
+  #define GL_SHARING_EXTENSION "cl_APPLE_gl_sharing"
+#else
+  #define GL_SHARING_EXTENSION "cl_khr_gl_sharing"
+#endif
+
 #if !defined(CL_VERSION_1_2)
   #define ImageGL Image2DGL
 #endif
@@ -74,6 +82,7 @@ bool     useLocal      =     false;
 unsigned init2D        =      0;
 cl_uint  windowWidth   =    640;
 cl_uint  windowHeight  =    480;
+std::string traceFile;
 
 // SDL/GL objects
 SDL_Window    *window;
@@ -87,8 +96,12 @@ int main(int argc, char *argv[])
     util::Timer timer;
     uint64_t startTime, endTime;
 
+    // Only devices that can share objects with OpenGL can run this
+    deviceSelection.extensions.push_back(GL_SHARING_EXTENSION);
     parseArguments(argc, argv);
 
+    util::Trace trace(traceFile);
+
     initGraphics();
 
     // Initialize host data
@@ -172,9 +185,8 @@ int main(int argc, char *argv[])
 #endif
 
     cl::Context context(device, properties);
-    cl::CommandQueue queue(context);
-
-    cl::Program program(context, util::loadProgram("kernel.cl"));
+    util::Profiler profiler(trace.enabled());
+    cl::CommandQueue queue = profiler.createQueue(context, device);
 
     std::stringstream options;
     options.setf(std::ios::fixed, std::ios::floatfield);
@@ -185,7 +197,12 @@ int main(int argc, char *argv[])
     options << " -DWGSIZE=" << wgsize;
     if (useLocal)
       options << " -DUSE_LOCAL";
-    program.build(options.str().c_str());
+    cl::Program program;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      program = util::buildProgram(context, util::loadProgram("kernel.cl"),
+                                   options.str());
+    }
 
     cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
       nbodyKernel(program, "nbody");
@@ -232,30 +249,39 @@ int main(int argc, char *argv[])
     size_t i;
     for (i = 0; ; i++)
     {
-      nbodyKernel(cl::EnqueueArgs(queue, global, local),
-                  d_positionsIn, d_positionsOut, d_velocities,
-                  numBodies);
+      profiler.record("nbody",
+        nbodyKernel(cl::EnqueueArgs(queue, global, local),
+                    d_positionsIn, d_positionsOut, d_velocities,
+                    numBodies));
 
       // ***********************
       // Acquire texture from GL
       // ***********************
       glFlush();
-      queue.enqueueAcquireGLObjects(&clglObjects);
+      queue.enqueueAcquireGLObjects(&clglObjects, NULL,
+                                    profiler.event("acquire"));
 
       // Fill texture with a blank color
-      fillKernel(cl::EnqueueArgs(queue, textureSize), d_texture);
+      profiler.record("fillTexture",
+        fillKernel(cl::EnqueueArgs(queue, textureSize), d_texture));
 
       // Draw bodies
-      drawKernel(cl::EnqueueArgs(queue, global, local),
-                 d_positionsOut, d_texture, windowWidth, windowHeight);
+      profiler.record("drawPositions",
+        drawKernel(cl::EnqueueArgs(queue, global, local),
+                   d_positionsOut, d_texture, windowWidth, windowHeight));
 
       // **************************
       // Release texture back to GL
       // **************************
-      queue.enqueueReleaseGLObjects(&clglObjects);
-      queue.finish();
+      queue.enqueueReleaseGLObjects(&clglObjects, NULL,
+                                    profiler.event("release"));
+      {
+        util::Trace::Region region(trace, "finish");
+        queue.finish();
+      }
 
       // Render the texture as a quad filling the window
+      uint64_t renderStart = util::hostTimeNanoseconds();
       glEnable(GL_TEXTURE_2D);
       glBindTexture(GL_TEXTURE_2D, textureGL);
       glBegin(GL_QUADS);
@@ -268,6 +294,7 @@ int main(int argc, char *argv[])
 
       // Update window
       SDL_GL_SwapWindow(window);
+      trace.add("render", renderStart, util::hostTimeNanoseconds());
 
       // Check for user input
       if (handleSDLEvents())
@@ -288,6 +315,8 @@ int main(int argc, char *argv[])
     std::cout << "Average FPS was " << (i / ((endTime-startTime)*1e-6))
               << std::endl << std::endl;
 
+    trace.write(profiler);
+
     releaseGraphics();
   }
   catch (cl::BuildError error)
@@ -415,13 +444,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--numbodies") || !strcmp(argv[i], "-n"))
     {
@@ -467,6 +492,15 @@ void parseArguments(int argc, char *argv[])
     {
       useLocal = true;
     }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
       std::cout << std::endl;
@@ -474,13 +508,14 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "  -n  --numbodies  N       Run simulation with N bodies" << std::endl;
       std::cout << "  -d  --delta      DELTA   Time difference between iterations" << std::endl;
       std::cout << "  -s  --softening  SOFT    Force softening factor" << std::endl;
       std::cout << "  -i  --iterations ITRS    Run simulation for ITRS iterations" << std::endl;
       std::cout << "      --local              Enable use of local memory" << std::endl;
       std::cout << "      --wgsize     WGSIZE  Set work-group size to WGSIZE" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
       std::cout << std::endl;
       exit(0);
     }
@@ -0,0 +1,301 @@
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+//
+// Barnes-Hut kernels, built after kernel.cl (whose computeForce() they use).
+// Each timestep runs:
+//
+//   bounds       bounding box of the bodies (two passes of a reduction)
+//   morton       30-bit Morton code of each body within the box
+//   bitonic_step sort of the codes, padded to a power of two
+//   build_tree   tree of the sorted codes
+//   summarize    mass, centre of mass and bounding box of every node
+//   bh_force     tree walk and the same update as the nbody kernel
+//
+// The tree is the binary radix tree of the sorted Morton codes (Karras,
+// "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d
+// Trees", 2012): every three levels of splits are one level of the
+// octree, and a node with fewer levels below it covers the octants that
+// actually hold bodies.  Internal nodes are 0 .. n-2 (0 is the root) and
+// leaves n-1 .. 2n-2, leaf n-1+t holding the body at position t of the
+// sorted order.
+//
+// Build-time constants: BH_WGSIZE (power of two) and those of kernel.cl
+//
+
+#define BH_STACK_SIZE 64
+
+__attribute__((reqd_work_group_size(BH_WGSIZE, 1, 1)))
+kernel void bounds(global const float4 * restrict lo,
+                   global const float4 * restrict hi,
+                   const        uint              n,
+                   global       float4 * restrict outLo,
+                   global       float4 * restrict outHi)
+{
+  local float4 scratchLo[BH_WGSIZE];
+  local float4 scratchHi[BH_WGSIZE];
+  uint lid = get_local_id(0);
+
+  float4 l = (float4)(FLT_MAX);
+  float4 h = (float4)(-FLT_MAX);
+  for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+  {
+    l = fmin(l, lo[i]);
+    h = fmax(h, hi[i]);
+  }
+  scratchLo[lid] = l;
+  scratchHi[lid] = h;
+
+  for (uint s = BH_WGSIZE/2; s > 0; s /= 2)
+  {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < s)
+    {
+      scratchLo[lid] = fmin(scratchLo[lid], scratchLo[lid + s]);
+      scratchHi[lid] = fmax(scratchHi[lid], scratchHi[lid + s]);
+    }
+  }
+
+  if (lid == 0)
+  {
+    outLo[get_group_id(0)] = scratchLo[0];
+    outHi[get_group_id(0)] = scratchHi[0];
+  }
+}
+
+// Spreads the low 10 bits of v out to every third bit
+uint expandBits(uint v)
+{
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+kernel void morton(global const float4 * restrict positions,
+                   global const float4 * restrict boxLo,
+                   global const float4 * restrict boxHi,
+                   const        uint              n,
+                   const        uint              numPadded,
+                   global       uint   * restrict keys,
+                   global       uint   * restrict values)
+{
+  uint i = get_global_id(0);
+  if (i >= numPadded)
+    return;
+
+  // Padding sorts after every body
+  values[i] = i;
+  if (i >= n)
+  {
+    keys[i] = 0xFFFFFFFF;
+    return;
+  }
+
+  // 1024 cells along each side of the (cubic) box
+  float4 lo     = boxLo[0];
+  float4 extent = boxHi[0] - lo;
+  float  side   = fmax(fmax(extent.x, extent.y), extent.z);
+  float  scale  = side > 0.f ? 1023.f / side : 0.f;
+  float4 p      = (positions[i] - lo) * scale;
+  uint x = min((uint)p.x, 1023u);
+  uint y = min((uint)p.y, 1023u);
+  uint z = min((uint)p.z, 1023u);
+  keys[i] = (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// One compare-exchange pass of a bitonic sort: stage k, distance j
+kernel void bitonic_step(global uint * restrict keys,
+                         global uint * restrict values,
+                         const  uint            j,
+                         const  uint            k)
+{
+  uint i   = get_global_id(0);
+  uint ixj = i ^ j;
+  if (ixj <= i)
+    return;
+
+  uint ki = keys[i];
+  uint kx = keys[ixj];
+  bool ascending = (i & k) == 0;
+  if ((ki > kx) == ascending)
+  {
+    uint vi = values[i];
+    keys[i]     = kx;
+    keys[ixj]   = ki;
+    values[i]   = values[ixj];
+    values[ixj] = vi;
+  }
+}
+
+// Length of the common prefix of sorted codes i and j, with the positions
+// breaking ties between equal codes; -1 if j is outside the array
+int commonPrefix(global const uint *keys, int n, int i, int j)
+{
+  if (j < 0 || j >= n)
+    return -1;
+  uint a = keys[i];
+  uint b = keys[j];
+  if (a == b)
+    return 32 + clz((uint)i ^ (uint)j);
+  return clz(a ^ b);
+}
+
+kernel void build_tree(global const uint * restrict keys,
+                       const        int             n,
+                       global       int2 * restrict children,
+                       global       int  * restrict parents)
+{
+  int i = get_global_id(0);
+  if (i == 0)
+    parents[0] = -1;
+  if (i >= n-1)
+    return;
+
+  // Direction of the range of codes under this node
+  int d    = commonPrefix(keys, n, i, i+1) > commonPrefix(keys, n, i, i-1) ? 1 : -1;
+  int dmin = commonPrefix(keys, n, i, i-d);
+
+  // Other end of the range: find an upper bound, then binary search
+  int lmax = 2;
+  while (commonPrefix(keys, n, i, i + lmax*d) > dmin)
+    lmax *= 2;
+  int l = 0;
+  for (int t = lmax/2; t >= 1; t /= 2)
+  {
+    if (commonPrefix(keys, n, i, i + (l+t)*d) > dmin)
+      l += t;
+  }
+  int j     = i + l*d;
+  int dnode = commonPrefix(keys, n, i, j);
+
+  // Split: the last code that shares more than dnode bits with code i
+  int s = 0;
+  int t = l;
+  do
+  {
+    t = (t + 1) / 2;
+    if (commonPrefix(keys, n, i, i + (s+t)*d) > dnode)
+      s += t;
+  } while (t > 1);
+  int split = i + s*d + min(d, 0);
+
+  int left  = min(i, j) == split   ? (n-1) + split   : split;
+  int right = max(i, j) == split+1 ? (n-1) + split+1 : split+1;
+  children[i]    = (int2)(left, right);
+  parents[left]  = i;
+  parents[right] = i;
+}
+
+// Each leaf walks up the tree.  The first of two children to reach a node
+// stops, and the second (which then knows both are done) summarizes it.
+kernel void summarize(global const    float4 * restrict positions,
+                      global const    uint   * restrict values,
+                      const           int               n,
+                      global const    int2   * restrict children,
+                      global const    int    * restrict parents,
+                      global volatile int    *          counters,
+                      global volatile float4 *          com,
+                      global volatile float4 *          lo,
+                      global volatile float4 *          hi)
+{
+  int t = get_global_id(0);
+  if (t >= n)
+    return;
+
+  int    node = (n-1) + t;
+  float4 p    = positions[values[t]];
+  com[node] = p;
+  lo[node]  = p;
+  hi[node]  = p;
+
+  for (int parent = parents[node]; parent >= 0; parent = parents[node])
+  {
+    // Make this node visible before the sibling can see the count
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    if (atomic_inc(&counters[parent]) == 0)
+      return;
+
+    int2   c = children[parent];
+    float4 a = com[c.x];
+    float4 b = com[c.y];
+    float  m = a.w + b.w;
+    float4 centre = m > 0.f ? (a*a.w + b*b.w) / m : 0.5f * (a + b);
+    centre.w = m;
+
+    com[parent] = centre;
+    lo[parent]  = fmin(lo[c.x], lo[c.y]);
+    hi[parent]  = fmax(hi[c.x], hi[c.y]);
+    node = parent;
+  }
+}
+
+// A node far enough away (its size over the distance to its centre of mass
+// below theta) acts as one body at its centre of mass; otherwise its
+// children are visited.  Work-items take bodies in Morton order, so
+// neighbouring work-items walk similar parts of the tree.
+kernel void bh_force(global const float4 * restrict positionsIn,
+                     global       float4 * restrict positionsOut,
+                     global       float4 * restrict velocities,
+                     global const uint   * restrict values,
+                     const        int               n,
+                     global const int2   * restrict children,
+                     global const float4 * restrict com,
+                     global const float4 * restrict lo,
+                     global const float4 * restrict hi,
+                     const        float             theta2)
+{
+  int t = get_global_id(0);
+  if (t >= n)
+    return;
+
+  uint   i    = values[t];
+  float4 ipos = positionsIn[i];
+
+  // Compute force
+  float4 force = 0.f;
+  int stack[BH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0)
+  {
+    int    node = stack[--top];
+    float4 c    = com[node];
+    if (node >= n-1)
+    {
+      force += computeForce(ipos, c);
+      continue;
+    }
+
+    float4 extent = hi[node] - lo[node];
+    float  size   = fmax(fmax(extent.x, extent.y), extent.z);
+    float4 d      = c - ipos;
+    float  distSq = d.x*d.x + d.y*d.y + d.z*d.z;
+    if (size*size < theta2*distSq || top + 2 > BH_STACK_SIZE)
+    {
+      force += computeForce(ipos, c);
+    }
+    else
+    {
+      int2 ch = children[node];
+      stack[top++] = ch.x;
+      stack[top++] = ch.y;
+    }
+  }
+
+  // Update velocity
+  float4 velocity = velocities[i];
+  velocity       += force * delta;
+  velocities[i]   = velocity;
+
+  // Update position
+  positionsOut[i] = ipos + velocity * delta;
+}
@@ -0,0 +1,194 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       barnes_hut.hpp
+ *
+ * Purpose:    Barnes-Hut timesteps on the device: the tree of the bodies is
+ *             rebuilt every step (see barnes_hut.cl), so the force on each
+ *             body costs O(log N) instead of O(N)
+ *
+ * Note:       Must be included AFTER the OpenCL C++ header
+ *
+ * Usage:      BarnesHut bh(context, options, numBodies, theta);
+ *             bh.step(queue, profiler, d_positionsIn, d_positionsOut,
+ *                     d_velocities);
+ *
+ *             options are the build options of kernel.cl, which is built
+ *             together with barnes_hut.cl.  step() reads positionsIn and
+ *             updates velocities and positionsOut exactly like the nbody
+ *             kernel, and returns without waiting.
+ *
+ */
+
+/*
+ *
+ * This code is released under the "attribution CC BY" creative commons license.
+ * In other words, you can use it in any way you see fit, including commercially,
+ * but please retain an attribution for the original authors:
+ * the High Performance Computing Group at the University of Bristol.
+ * Contributors include Simon McIntosh-Smith, James Price, Tom Deakin and Mike O'Connor.
+ *
+ */
+
+#ifndef __BARNES_HUT_HDR
+#define __BARNES_HUT_HDR
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include "util.hpp"
+#include "profiler.hpp"
+
+class BarnesHut
+{
+public:
+  // Work-group size of the tree kernels, and the number of partial
+  // bounding boxes reduced by the first pass
+  enum { groupSize = 64, boundsGroups = 256 };
+
+  BarnesHut(const cl::Context& context, const std::string& options,
+            unsigned numBodies, float theta)
+    : n_(numBodies), theta2_(theta*theta)
+  {
+    // The sort needs a power of two number of keys, and whole work-groups
+    numPadded_ = groupSize;
+    while (numPadded_ < n_)
+      numPadded_ *= 2;
+
+    std::stringstream bhOptions;
+    bhOptions << options << " -DBH_WGSIZE=" << groupSize;
+    cl::Program program = util::buildProgram(context,
+      util::loadProgram("kernel.cl") + util::loadProgram("barnes_hut.cl"),
+      bhOptions.str());
+    bounds_      = cl::Kernel(program, "bounds");
+    morton_      = cl::Kernel(program, "morton");
+    bitonicStep_ = cl::Kernel(program, "bitonic_step");
+    buildTree_   = cl::Kernel(program, "build_tree");
+    summarize_   = cl::Kernel(program, "summarize");
+    force_       = cl::Kernel(program, "bh_force");
+
+    size_t nodes = 2*n_ - 1;
+    partLo_   = cl::Buffer(context, CL_MEM_READ_WRITE, boundsGroups*4*sizeof(float));
+    partHi_   = cl::Buffer(context, CL_MEM_READ_WRITE, boundsGroups*4*sizeof(float));
+    boxLo_    = cl::Buffer(context, CL_MEM_READ_WRITE, 4*sizeof(float));
+    boxHi_    = cl::Buffer(context, CL_MEM_READ_WRITE, 4*sizeof(float));
+    keys_     = cl::Buffer(context, CL_MEM_READ_WRITE, numPadded_*sizeof(cl_uint));
+    values_   = cl::Buffer(context, CL_MEM_READ_WRITE, numPadded_*sizeof(cl_uint));
+    children_ = cl::Buffer(context, CL_MEM_READ_WRITE, std::max(n_-1, 1u)*2*sizeof(cl_int));
+    parents_  = cl::Buffer(context, CL_MEM_READ_WRITE, nodes*sizeof(cl_int));
+    counters_ = cl::Buffer(context, CL_MEM_READ_WRITE, std::max(n_-1, 1u)*sizeof(cl_int));
+    com_      = cl::Buffer(context, CL_MEM_READ_WRITE, nodes*4*sizeof(float));
+    lo_       = cl::Buffer(context, CL_MEM_READ_WRITE, nodes*4*sizeof(float));
+    hi_       = cl::Buffer(context, CL_MEM_READ_WRITE, nodes*4*sizeof(float));
+
+    // Everything but the body buffers is set once
+    morton_.setArg(1, boxLo_);
+    morton_.setArg(2, boxHi_);
+    morton_.setArg(3, n_);
+    morton_.setArg(4, numPadded_);
+    morton_.setArg(5, keys_);
+    morton_.setArg(6, values_);
+
+    bitonicStep_.setArg(0, keys_);
+    bitonicStep_.setArg(1, values_);
+
+    buildTree_.setArg(0, keys_);
+    buildTree_.setArg(1, (cl_int)n_);
+    buildTree_.setArg(2, children_);
+    buildTree_.setArg(3, parents_);
+
+    summarize_.setArg(1, values_);
+    summarize_.setArg(2, (cl_int)n_);
+    summarize_.setArg(3, children_);
+    summarize_.setArg(4, parents_);
+    summarize_.setArg(5, counters_);
+    summarize_.setArg(6, com_);
+    summarize_.setArg(7, lo_);
+    summarize_.setArg(8, hi_);
+
+    force_.setArg(3, values_);
+    force_.setArg(4, (cl_int)n_);
+    force_.setArg(5, children_);
+    force_.setArg(6, com_);
+    force_.setArg(7, lo_);
+    force_.setArg(8, hi_);
+    force_.setArg(9, theta2_);
+  }
+
+  void step(cl::CommandQueue& queue, util::Profiler& profiler,
+            const cl::Buffer& positionsIn, const cl::Buffer& positionsOut,
+            const cl::Buffer& velocities)
+  {
+    cl::NDRange local(groupSize);
+    cl::NDRange bodies(roundUp(n_));
+
+    // Bounding box: partial boxes from grid-strided groups, then one group
+    // reduces those
+    unsigned groups = std::min((unsigned)boundsGroups, roundUp(n_) / groupSize);
+    bounds_.setArg(0, positionsIn);
+    bounds_.setArg(1, positionsIn);
+    bounds_.setArg(2, n_);
+    bounds_.setArg(3, partLo_);
+    bounds_.setArg(4, partHi_);
+    queue.enqueueNDRangeKernel(bounds_, cl::NullRange,
+                               cl::NDRange(groups*groupSize), local,
+                               NULL, profiler.event("bh bounds"));
+    bounds_.setArg(0, partLo_);
+    bounds_.setArg(1, partHi_);
+    bounds_.setArg(2, groups);
+    bounds_.setArg(3, boxLo_);
+    bounds_.setArg(4, boxHi_);
+    queue.enqueueNDRangeKernel(bounds_, cl::NullRange, local, local,
+                               NULL, profiler.event("bh bounds"));
+
+    morton_.setArg(0, positionsIn);
+    queue.enqueueNDRangeKernel(morton_, cl::NullRange, cl::NDRange(numPadded_),
+                               local, NULL, profiler.event("bh morton"));
+
+    for (cl_uint k = 2; k <= numPadded_; k *= 2)
+    {
+      for (cl_uint j = k/2; j > 0; j /= 2)
+      {
+        bitonicStep_.setArg(2, j);
+        bitonicStep_.setArg(3, k);
+        queue.enqueueNDRangeKernel(bitonicStep_, cl::NullRange,
+                                   cl::NDRange(numPadded_), local,
+                                   NULL, profiler.event("bh sort"));
+      }
+    }
+
+    queue.enqueueNDRangeKernel(buildTree_, cl::NullRange,
+                               cl::NDRange(roundUp(std::max(n_-1, 1u))), local,
+                               NULL, profiler.event("bh build"));
+
+    queue.enqueueFillBuffer(counters_, (cl_int)0, 0,
+                            std::max(n_-1, 1u)*sizeof(cl_int),
+                            NULL, profiler.event("bh build"));
+    summarize_.setArg(0, positionsIn);
+    queue.enqueueNDRangeKernel(summarize_, cl::NullRange, bodies, local,
+                               NULL, profiler.event("bh summarize"));
+
+    force_.setArg(0, positionsIn);
+    force_.setArg(1, positionsOut);
+    force_.setArg(2, velocities);
+    queue.enqueueNDRangeKernel(force_, cl::NullRange, bodies, local,
+                               NULL, profiler.event("bh force"));
+  }
+
+private:
+  static unsigned roundUp(unsigned value)
+  {
+    return (value + groupSize - 1) / groupSize * groupSize;
+  }
+
+  cl_uint    n_;
+  cl_uint    numPadded_;
+  cl_float   theta2_;
+
+  cl::Kernel bounds_, morton_, bitonicStep_, buildTree_, summarize_, force_;
+  cl::Buffer partLo_, partHi_, boxLo_, boxHi_;
+  cl::Buffer keys_, values_, children_, parents_, counters_;
+  cl::Buffer com_, lo_, hi_;
+};
+
+#endif
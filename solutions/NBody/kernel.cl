@@ -18,22 +18,38 @@ float4 computeForce(float4 ipos, float4 jpos)
   return coeff * d;
 }
 
+// Bodies per work-item (IPT), and how far the loop over each tile of
+// bodies is unrolled (UNROLL, which must divide WGSIZE)
+#ifndef IPT
+#define IPT 1
+#endif
+#ifndef UNROLL
+#define UNROLL 1
+#endif
+
+// Work-item lid of a group updates bodies lid, lid+WGSIZE, ... of the
+// group's WGSIZE*IPT, so each position loaded is used IPT times
 __attribute__((reqd_work_group_size(WGSIZE, 1, 1)))
 kernel void nbody(global const float4 * restrict positionsIn,
                   global       float4 * restrict positionsOut,
                   global       float4 * restrict velocities,
                   const        uint              numBodies)
 {
-  uint i       = get_global_id(0);
   uint lid     = get_local_id(0);
-  float4 ipos  = positionsIn[i];
+  uint first   = (get_global_id(0) - lid) * IPT + lid;
+
+  float4 ipos[IPT];
+  for (uint b = 0; b < IPT; b++)
+    ipos[b] = positionsIn[first + b*WGSIZE];
 
 #ifdef USE_LOCAL
   local float4 scratch[WGSIZE];
 #endif
 
   // Compute force
-  float4 force = 0.f;
+  float4 force[IPT];
+  for (uint b = 0; b < IPT; b++)
+    force[b] = 0.f;
   for (uint j = 0; j < numBodies; j+=WGSIZE)
   {
 #ifdef USE_LOCAL
@@ -42,21 +58,214 @@ kernel void nbody(global const float4 * restrict positionsIn,
     barrier(CLK_LOCAL_MEM_FENCE);
 #endif
 
-    for (uint k = 0; k < WGSIZE; k++)
+    for (uint k = 0; k < WGSIZE; k+=UNROLL)
+    {
+      for (uint u = 0; u < UNROLL; u++)
+      {
+#ifdef USE_LOCAL
+        float4 jpos = scratch[k + u];
+#else
+        float4 jpos = positionsIn[j + k + u];
+#endif
+        for (uint b = 0; b < IPT; b++)
+          force[b] += computeForce(ipos[b], jpos);
+      }
+    }
+  }
+
+  for (uint b = 0; b < IPT; b++)
+  {
+    uint i = first + b*WGSIZE;
+
+    // Update velocity
+    float4 velocity = velocities[i];
+    velocity       += force[b] * delta;
+    velocities[i]   = velocity;
+
+    // Update position
+    positionsOut[i] = ipos[b] + velocity * delta;
+  }
+}
+
+// Halves of a timestep for the integrators that interleave them (see
+// buildSchedule() in nbody.cpp), each for the fraction c of delta: kick
+// adds the acceleration to the velocities, and drift moves the positions
+// (in place) by the velocities
+__attribute__((reqd_work_group_size(WGSIZE, 1, 1)))
+kernel void kick(global const float4 * restrict positions,
+                 global       float4 * restrict velocities,
+                 const        uint              numBodies,
+                 const        float             c)
+{
+  uint i   = get_global_id(0);
+  uint lid = get_local_id(0);
+
+  float4 ipos = positions[i];
+
+#ifdef USE_LOCAL
+  local float4 scratch[WGSIZE];
+#endif
+
+  // Compute force
+  float4 force = 0.f;
+  for (uint j = 0; j < numBodies; j+=WGSIZE)
+  {
+#ifdef USE_LOCAL
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scratch[lid] = positions[j + lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+    for (uint k = 0; k < WGSIZE; k+=UNROLL)
+    {
+      for (uint u = 0; u < UNROLL; u++)
+      {
+#ifdef USE_LOCAL
+        force += computeForce(ipos, scratch[k + u]);
+#else
+        force += computeForce(ipos, positions[j + k + u]);
+#endif
+      }
+    }
+  }
+
+  velocities[i] += force * (c * delta);
+}
+
+kernel void drift(global       float4 * restrict positions,
+                  global const float4 * restrict velocities,
+                  const        float             c)
+{
+  uint   i = get_global_id(0);
+  float4 v = velocities[i];
+  v.w = 0.f;
+  positions[i] += v * (c * delta);
+}
+
+// Advances the bodies by several timesteps in one launch of a single
+// work-group, for systems too small for launch overheads to be hidden.
+// Positions alternate between positions0 and positions1 (so after an odd
+// number of steps they are in positions1), and the barrier between steps
+// makes the positions written by every work-item visible to the next.
+__attribute__((reqd_work_group_size(WGSIZE, 1, 1)))
+kernel void nbody_steps(global       float4 * positions0,
+                        global       float4 * positions1,
+                        global       float4 * restrict velocities,
+                        const        uint              numBodies,
+                        const        uint              steps)
+{
+  uint lid = get_local_id(0);
+
+  for (uint s = 0; s < steps; s++)
+  {
+    global const float4 *positionsIn  = (s % 2) ? positions1 : positions0;
+    global       float4 *positionsOut = (s % 2) ? positions0 : positions1;
+
+    for (uint i = lid; i < numBodies; i += WGSIZE)
+    {
+      float4 ipos = positionsIn[i];
+
+      // Compute force
+      float4 force = 0.f;
+      for (uint j = 0; j < numBodies; j++)
+        force += computeForce(ipos, positionsIn[j]);
+
+      // Update velocity
+      float4 velocity = velocities[i];
+      velocity       += force * delta;
+      velocities[i]   = velocity;
+
+      // Update position
+      positionsOut[i] = ipos + velocity * delta;
+    }
+
+    barrier(CLK_GLOBAL_MEM_FENCE);
+  }
+}
+
+// Structure-of-arrays version: positions are planes of numBodies x, y, z
+// and mass values, and velocities planes of x, y and z, so neighbouring
+// work-items read neighbouring floats and a CPU implementation can
+// vectorize across them.  One body per work-item.
+__attribute__((reqd_work_group_size(WGSIZE, 1, 1)))
+kernel void nbody_soa(global const float * restrict positionsIn,
+                      global       float * restrict positionsOut,
+                      global       float * restrict velocities,
+                      const        uint             numBodies)
+{
+  uint i   = get_global_id(0);
+  uint lid = get_local_id(0);
+
+  global const float *xIn = positionsIn;
+  global const float *yIn = positionsIn +   numBodies;
+  global const float *zIn = positionsIn + 2*numBodies;
+  global const float *mIn = positionsIn + 3*numBodies;
+
+  float ix = xIn[i];
+  float iy = yIn[i];
+  float iz = zIn[i];
+
+#ifdef USE_LOCAL
+  local float scratchX[WGSIZE];
+  local float scratchY[WGSIZE];
+  local float scratchZ[WGSIZE];
+  local float scratchM[WGSIZE];
+#endif
+
+  // Compute force
+  float fx = 0.f;
+  float fy = 0.f;
+  float fz = 0.f;
+  for (uint j = 0; j < numBodies; j+=WGSIZE)
+  {
+#ifdef USE_LOCAL
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scratchX[lid] = xIn[j + lid];
+    scratchY[lid] = yIn[j + lid];
+    scratchZ[lid] = zIn[j + lid];
+    scratchM[lid] = mIn[j + lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+    for (uint k = 0; k < WGSIZE; k+=UNROLL)
     {
+      for (uint u = 0; u < UNROLL; u++)
+      {
 #ifdef USE_LOCAL
-      force += computeForce(ipos, scratch[k]);
+        float jx = scratchX[k + u];
+        float jy = scratchY[k + u];
+        float jz = scratchZ[k + u];
+        float jm = scratchM[k + u];
 #else
-      force += computeForce(ipos, positionsIn[j + k]);
+        float jx = xIn[j + k + u];
+        float jy = yIn[j + k + u];
+        float jz = zIn[j + k + u];
+        float jm = mIn[j + k + u];
 #endif
+        float dx      = jx - ix;
+        float dy      = jy - iy;
+        float dz      = jz - iz;
+        float distSq  = dx*dx + dy*dy + dz*dz + softening*softening;
+        float invdist = native_rsqrt(distSq);
+        float coeff   = jm * (invdist*invdist*invdist);
+        fx           += coeff * dx;
+        fy           += coeff * dy;
+        fz           += coeff * dz;
+      }
     }
   }
 
   // Update velocity
-  float4 velocity = velocities[i];
-  velocity       += force * delta;
-  velocities[i]   = velocity;
+  float vx = velocities[i]               + fx * delta;
+  float vy = velocities[i +   numBodies] + fy * delta;
+  float vz = velocities[i + 2*numBodies] + fz * delta;
+  velocities[i]               = vx;
+  velocities[i +   numBodies] = vy;
+  velocities[i + 2*numBodies] = vz;
 
   // Update position
-  positionsOut[i] = ipos + velocity * delta;
+  positionsOut[i]               = ix + vx * delta;
+  positionsOut[i +   numBodies] = iy + vy * delta;
+  positionsOut[i + 2*numBodies] = iz + vz * delta;
+  positionsOut[i + 3*numBodies] = mIn[i];
 }
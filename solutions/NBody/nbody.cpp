@@ -12,9 +12,11 @@
  *
  */
 
+#include <algorithm>
 #include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -29,15 +31,41 @@
 #include "util.hpp"
 #include "err_code.h"
 #include "device_picker.hpp"
+#include "benchmark.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "autotune.hpp"
+#include "pinned_allocator.hpp"
+#include "barnes_hut.hpp"
 
 #ifndef M_PI
   #define M_PI 3.14159265358979323846f
 #endif
 
+// Integrators: semi-implicit Euler (the nbody kernel), kick-drift-kick
+// leapfrog, and Yoshida's fourth order composition of three leapfrogs
+enum Integrator { EULER, LEAPFROG, YOSHIDA4 };
+const char *integratorNames[] = { "euler", "leapfrog", "yoshida4" };
+
+// A kick of the velocities by the accelerations, or a drift of the
+// positions by the velocities, over the given fraction of delta
+struct StepOp
+{
+  bool  kick;
+  float fraction;
+};
+
 void     parseArguments(int argc, char *argv[]);
-void     runReference(const std::vector<float>& initialPositions,
-                      const std::vector<float>& initialVelocities,
-                            std::vector<float>& finalPositions);
+std::vector<StepOp> buildSchedule();
+void     runReference(const util::pinned_vector<float>& initialPositions,
+                      const util::pinned_vector<float>& initialVelocities,
+                            std::vector<float>& finalPositions,
+                            std::vector<float>& finalVelocities);
+double   totalEnergy(const float *positions, const float *velocities);
+void     toPlanes(const float *bodies, float *planes, unsigned components);
+void     fromPlanes(const float *planes, float *bodies, unsigned components);
+unsigned checkPositions(const float *positions,
+                        const std::vector<float>& reference);
 
 // Simulation parameters, with default values.
 cl_uint  deviceIndex   =      0;
@@ -48,7 +76,21 @@ cl_uint  iterations    =     32;
 float    sphereRadius  =    0.8f;
 float    tolerance     =      0.01f;
 unsigned wgsize        =     64;
+cl_uint  ipt           =      1;
+cl_uint  unroll        =      1;
 bool     useLocal      =     false;
+bool     profile       =     false;
+bool     tune          =     false;
+bool     wgsizeSet     =     false;
+bool     pageable      =     false;
+bool     barnesHut     =     false;
+float    theta         =      0.5f;
+bool     soaLayout     =     false;
+cl_uint  stepsPerLaunch =     1;
+cl_uint  fusedMaxBodies =  1024;
+Integrator integrator  =  EULER;
+std::string traceFile;
+util::BenchmarkOptions benchOptions;
 
 int main(int argc, char *argv[])
 {
@@ -57,164 +99,577 @@ int main(int argc, char *argv[])
     uint64_t startTime, endTime;
     util::Timer timer;
 
+    // Bodies are split between every selected device
+    deviceSelection.multiDevice = true;
     parseArguments(argc, argv);
 
-    // Initialize host data
-    std::vector<float> h_initialPositions(4*numBodies);
-    std::vector<float> h_initialVelocities(4*numBodies, 0);
-    std::vector<float> h_positions(4*numBodies);
-    for (unsigned i = 0; i < numBodies; i++)
-    {
-      // Generate a random point on the surface of a sphere
-      float longitude             = 2.f * M_PI * (rand() / (float)RAND_MAX);
-      float latitude              = acos((2.f * (rand() / (float)RAND_MAX)) - 1);
-      h_initialPositions[i*4 + 0] = sphereRadius * sin(latitude) * cos(longitude);
-      h_initialPositions[i*4 + 1] = sphereRadius * sin(latitude) * sin(longitude);
-      h_initialPositions[i*4 + 2] = sphereRadius * cos(latitude);
-      h_initialPositions[i*4 + 3] = 1;
-    }
+    util::Trace trace(traceFile);
 
     // Get list of devices
     std::vector<cl::Device> devices;
     getDeviceList(devices);
 
-    // Check device index in range
-    if (deviceIndex >= devices.size())
+    // Check device indices in range
+    std::vector<cl::Device> selected = getSelectedDevices(devices, deviceIndex);
+    if (selected.empty())
     {
       std::cout << "Invalid device index (try '--list')" << std::endl;
       return 1;
     }
 
-    cl::Device device = devices[deviceIndex];
+    std::cout << std::endl;
+    for (unsigned d = 0; d < selected.size(); d++)
+    {
+      std::cout << "Using OpenCL device: " << getDeviceName(selected[d])
+                << std::endl;
+    }
 
-    std::string name = getDeviceName(device);
-    std::cout << std::endl << "Using OpenCL device: " << name << std::endl;
+    if (barnesHut && integrator != EULER)
+    {
+      std::cout << "Barnes-Hut uses the Euler integrator" << std::endl;
+      integrator = EULER;
+    }
+    if (integrator != EULER && (soaLayout || stepsPerLaunch > 1))
+    {
+      std::cout << "The SoA layout and several steps per launch use the"
+                << " Euler integrator" << std::endl;
+      soaLayout      = false;
+      stepsPerLaunch = 1;
+    }
+    if (barnesHut && stepsPerLaunch > 1)
+    {
+      std::cout << "Barnes-Hut launches every step" << std::endl;
+      stepsPerLaunch = 1;
+    }
 
-    cl::Context context(device);
-    cl::CommandQueue queue(context);
+    // The tree is built on one device, and several steps per launch or
+    // kernels per step leave no point at which to exchange slices
+    // between devices
+    bool oneDevice = barnesHut || stepsPerLaunch > 1 || integrator != EULER;
+    if (oneDevice && selected.size() > 1)
+    {
+      std::cout << (barnesHut ? "Barnes-Hut" : stepsPerLaunch > 1 ?
+                    "Several steps per launch" : "This integrator")
+                << " runs on one device, using the first" << std::endl;
+      selected.resize(1);
+    }
+    if (barnesHut && soaLayout)
+    {
+      std::cout << "The SoA layout is only used by the all-pairs kernel"
+                << std::endl;
+      soaLayout = false;
+    }
+
+    util::Profiler profiler(profile || trace.enabled() || tune);
+    std::vector<DeviceQueue> queues = createDeviceQueues(selected,
+      profiler.enabled() ? CL_QUEUE_PROFILING_ENABLE : 0);
+    unsigned numDevices = queues.size();
 
-    cl::Program program(context, util::loadProgram("kernel.cl"));
+    // The first device is used for tuning
+    cl::Device       device  = queues[0].device;
+    cl::Context      context = queues[0].context;
+    cl::CommandQueue queue   = queues[0].queue;
 
     std::stringstream options;
     options.setf(std::ios::fixed, std::ios::floatfield);
     options << " -cl-fast-relaxed-math";
     options << " -Dsoftening=" << softening << "f";
     options << " -Ddelta=" << delta << "f";
-    options << " -DWGSIZE=" << wgsize;
     if (useLocal)
       options << " -DUSE_LOCAL";
-    program.build(options.str().c_str());
+    options << " -DIPT=" << ipt << " -DUNROLL=" << unroll;
+    std::string source = util::loadProgram("kernel.cl");
 
-    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
-      nbodyKernel(program, "nbody");
+    // Initialize host data, in pinned memory unless --pageable was given
+    util::cl_pinned_allocator<float> alloc(context, queue, !pageable);
+    util::pinned_vector<float> h_initialPositions(4*numBodies, 0, alloc);
+    util::pinned_vector<float> h_initialVelocities(4*numBodies, 0, alloc);
+    util::pinned_vector<float> h_positions(4*numBodies, 0, alloc);
+    for (unsigned i = 0; i < numBodies; i++)
+    {
+      // Generate a random point on the surface of a sphere
+      float longitude             = 2.f * M_PI * (rand() / (float)RAND_MAX);
+      float latitude              = acos((2.f * (rand() / (float)RAND_MAX)) - 1);
+      h_initialPositions[i*4 + 0] = sphereRadius * sin(latitude) * cos(longitude);
+      h_initialPositions[i*4 + 1] = sphereRadius * sin(latitude) * sin(longitude);
+      h_initialPositions[i*4 + 2] = sphereRadius * cos(latitude);
+      h_initialPositions[i*4 + 3] = 1;
+    }
+
+    // Initialize device buffers, each device holding every body
+    std::vector<cl::Buffer> d_positions0(numDevices);
+    std::vector<cl::Buffer> d_positions1(numDevices);
+    std::vector<cl::Buffer> d_velocities(numDevices);
+    for (unsigned d = 0; d < numDevices; d++)
+    {
+      d_positions0[d] = cl::Buffer(queues[d].context,
+                                   CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                   4*numBodies*sizeof(float));
+
+      d_positions1[d] = cl::Buffer(queues[d].context,
+                                   CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                   4*numBodies*sizeof(float));
+
+      d_velocities[d] = cl::Buffer(queues[d].context,
+                                   CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                   4*numBodies*sizeof(float));
+
+      // Keep each copy in memory local to its (sub-)device
+      firstTouch(queues[d], d_positions0[d], 4*numBodies*sizeof(float));
+      firstTouch(queues[d], d_positions1[d], 4*numBodies*sizeof(float));
+      firstTouch(queues[d], d_velocities[d], 4*numBodies*sizeof(float));
+    }
+
+    std::vector<cl::Buffer> d_positionsIn(numDevices);
+    std::vector<cl::Buffer> d_positionsOut(numDevices);
+
+    // Use the tuned work-group size unless one was given
+    if (tune || !wgsizeSet)
+    {
+      std::stringstream problem;
+      problem << "n=" << numBodies << (useLocal ? ",local" : "")
+              << ",ipt=" << ipt << ",unroll=" << unroll;
+      util::Tuner tuner(device, "nbody", problem.str());
+      tuner.addParameter("WGSIZE", {16, 32, 64, 128, 256, 512, 1024});
+      tuner.addConstraint([&](const util::TuningConfig& c)
+                          { return numBodies % (c.at("WGSIZE")*ipt) == 0 &&
+                                   c.at("WGSIZE") % unroll == 0; });
+
+      if (tune)
+      {
+        queue.enqueueWriteBuffer(d_positions0[0], CL_FALSE, 0,
+                                 h_initialPositions.size()*sizeof(float),
+                                 h_initialPositions.data());
+        queue.enqueueWriteBuffer(d_velocities[0], CL_FALSE, 0,
+                                 h_initialVelocities.size()*sizeof(float),
+                                 h_initialVelocities.data());
+      }
 
-    // Initialize device buffers
-    cl::Buffer d_positions0, d_positions1, d_velocities;
+      util::TuningConfig defaults;
+      defaults["WGSIZE"] = wgsize;
+      util::TuningConfig config = tuner.select(tune, defaults,
+        [&](const util::TuningConfig& c)
+        {
+          cl::Program candidate = util::buildProgram(context, source,
+                                    options.str() + tuner.options(c));
+          cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
+            kernel(candidate, "nbody");
+          return kernel(cl::EnqueueArgs(queue, cl::NDRange(numBodies/ipt),
+                                        cl::NDRange(c.at("WGSIZE"))),
+                        d_positions0[0], d_positions1[0], d_velocities[0],
+                        numBodies);
+        });
+      wgsize = config.at("WGSIZE");
+    }
+    std::cout << "Work-group size: " << wgsize << std::endl;
+    if (ipt > 1 || unroll > 1)
+    {
+      std::cout << "Bodies per work-item: " << ipt
+                << ", unrolled by " << unroll << std::endl;
+    }
+    if (numBodies % (wgsize*ipt) || wgsize % unroll)
+    {
+      std::cout << "The number of bodies must be a multiple of the work-group"
+                << " size times --ipt, and --unroll must divide the work-group"
+                << " size" << std::endl;
+      return 1;
+    }
 
-    d_positions0 = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                              4*numBodies*sizeof(float));
+    options << " -DWGSIZE=" << wgsize;
+    std::vector<cl::Program> programs;
+    std::vector<cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint> >
+      nbodyKernels;
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        programs.push_back(
+          util::buildProgram(queues[d].context, source, options.str()));
+        nbodyKernels.push_back(
+          cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
+            (programs[d], "nbody"));
+      }
+    }
 
-    d_positions1 = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                              4*numBodies*sizeof(float));
+    // Several steps per launch: small systems are advanced by one
+    // work-group running nbody_steps, and larger ones by batches of the
+    // nbody kernel flushed together.  Either way there is a kernel for
+    // each direction of the ring of two position buffers, its arguments
+    // bound once.
+    bool fused = stepsPerLaunch > 1 && numBodies <= fusedMaxBodies;
+    cl::Kernel stepKernels[2];
+    if (stepsPerLaunch > 1)
+    {
+      for (unsigned r = 0; r < 2; r++)
+      {
+        stepKernels[r] = cl::Kernel(programs[0], fused ? "nbody_steps" : "nbody");
+        stepKernels[r].setArg(0, r ? d_positions1[0] : d_positions0[0]);
+        stepKernels[r].setArg(1, r ? d_positions0[0] : d_positions1[0]);
+        stepKernels[r].setArg(2, d_velocities[0]);
+        stepKernels[r].setArg(3, numBodies);
+      }
+      std::cout << "Steps per launch: " << stepsPerLaunch
+                << (fused ? " (one work-group)" : " (batched launches)")
+                << std::endl;
+    }
 
-    d_velocities = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-                              4*numBodies*sizeof(float));
+    // Split the bodies between devices in whole work-groups
+    std::vector<size_t> offsets =
+      partitionWork(numBodies, getDeviceWeights(selected), wgsize*ipt);
+    if (numDevices > 1)
+    {
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        std::cout << "Device " << d << ": bodies " << offsets[d]
+                  << " to " << offsets[d+1] << std::endl;
+      }
+    }
 
-    cl::copy(queue, h_initialPositions.begin(), h_initialPositions.end(),
-             d_positions0);
-    cl::copy(queue, h_initialVelocities.begin(), h_initialVelocities.end(),
-             d_velocities);
+    // Barnes-Hut steps, with the same options as the all-pairs kernel
+    std::unique_ptr<BarnesHut> bh;
+    if (barnesHut)
+    {
+      util::Trace::Region region(trace, "buildProgram");
+      bh.reset(new BarnesHut(context, options.str(), numBodies, theta));
+      std::cout << "Barnes-Hut, theta = " << theta << std::endl;
+    }
 
-    cl::Buffer d_positionsIn  = d_positions0;
-    cl::Buffer d_positionsOut = d_positions1;
+    // Kicks and drifts of the other integrators, the kicks sharing the
+    // force computation of the nbody kernel
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_uint, cl_float>
+      kickKernel(programs[0], "kick");
+    cl::KernelFunctor<cl::Buffer, cl::Buffer, cl_float>
+      driftKernel(programs[0], "drift");
+    std::vector<StepOp> schedule = buildSchedule();
+    unsigned kicks = 0;
+    for (unsigned o = 0; o < schedule.size(); o++)
+      kicks += schedule[o].kick;
+    std::cout << "Integrator: " << integratorNames[integrator] << " ("
+              << (double)kicks/iterations << " force evaluations per step)"
+              << std::endl;
 
     std::cout << "OpenCL initialization complete." << std::endl << std::endl;
 
 
     // Run simulation
     std::cout << "Running simulation..." << std::endl;
-    startTime = timer.getTimeMicroseconds();
-    cl::NDRange global(numBodies);
     cl::NDRange local(wgsize);
-    for (unsigned i = 0; i < iterations; i++)
+    long interactions = (long)kicks * (long)numBodies * (long)numBodies;
+    util::Benchmark bench(benchOptions);
+    util::BenchmarkResult result = bench.run(barnesHut ? "barnes-hut" : "nbody", [&]()
     {
-      nbodyKernel(cl::EnqueueArgs(queue, global, local),
-                  d_positionsIn, d_positionsOut, d_velocities,
-                  numBodies);
+      util::Trace::Region region(trace, "simulation");
+      unsigned ring = 0;
+      for (unsigned i = 0; i < iterations && stepsPerLaunch > 1;
+           i += stepsPerLaunch)
+      {
+        cl_uint steps = std::min(stepsPerLaunch, iterations - i);
+        if (fused)
+        {
+          stepKernels[ring].setArg(4, steps);
+          queue.enqueueNDRangeKernel(stepKernels[ring], cl::NullRange,
+                                     local, local, NULL,
+                                     profiler.event("nbody steps"));
+          if (steps % 2)
+          {
+            ring ^= 1;
+            d_positionsIn.swap(d_positionsOut);
+          }
+          continue;
+        }
 
-      // Swap position buffers
-      cl::Buffer temp = d_positionsIn;
-      d_positionsIn   = d_positionsOut;
-      d_positionsOut  = temp;
-    }
+        for (cl_uint s = 0; s < steps; s++)
+        {
+          queue.enqueueNDRangeKernel(stepKernels[ring], cl::NullRange,
+                                     cl::NDRange(numBodies/ipt), local,
+                                     NULL, profiler.event("nbody"));
+          ring ^= 1;
+          d_positionsIn.swap(d_positionsOut);
+        }
+        queue.flush();
+      }
 
-    // Read final positions
-    cl::copy(queue, d_positionsIn, h_positions.begin(), h_positions.end());
+      // The other integrators update the first buffers in place
+      for (unsigned o = 0; o < schedule.size() && integrator != EULER; o++)
+      {
+        if (schedule[o].kick)
+        {
+          profiler.record("kick",
+            kickKernel(cl::EnqueueArgs(queue, cl::NDRange(numBodies), local),
+                       d_positionsIn[0], d_velocities[0], numBodies,
+                       schedule[o].fraction));
+        }
+        else
+        {
+          profiler.record("drift",
+            driftKernel(cl::EnqueueArgs(queue, cl::NDRange(numBodies), local),
+                        d_positionsIn[0], d_velocities[0],
+                        schedule[o].fraction));
+        }
+      }
 
-    endTime = timer.getTimeMicroseconds();
-    uint64_t microseconds = (endTime-startTime);
-    std::cout << std::setprecision(2) << std::fixed;
-    std::cout << "OpenCL took " << (microseconds*1e-3) << "ms"
-              << std::endl;
+      for (unsigned i = 0; i < iterations && stepsPerLaunch == 1 &&
+                           integrator == EULER; i++)
+      {
+        if (bh)
+        {
+          bh->step(queue, profiler, d_positionsIn[0], d_positionsOut[0],
+                   d_velocities[0]);
+        }
 
-    long interactions = (long)iterations * (long)numBodies * (long)numBodies;
-    double giPerSec = interactions/(double)(microseconds*1e-6) * 1e-9;
-    std::cout << giPerSec
-              << " billion interactions/second" << std::endl;
+        // Each device updates its own slice of the bodies
+        for (unsigned d = 0; d < numDevices && !bh; d++)
+        {
+          size_t count = offsets[d+1] - offsets[d];
+          if (!count)
+            continue;
+          profiler.record("nbody",
+            nbodyKernels[d](cl::EnqueueArgs(queues[d].queue,
+                                            cl::NDRange(offsets[d]/ipt),
+                                            cl::NDRange(count/ipt), local),
+                            d_positionsIn[d], d_positionsOut[d],
+                            d_velocities[d], numBodies));
+        }
 
-    std::cout << std::endl;
+        // Gather the new positions, and send every device the slices
+        // computed by the others
+        if (numDevices > 1)
+        {
+          for (unsigned d = 0; d < numDevices; d++)
+          {
+            queues[d].queue.enqueueReadBuffer(d_positionsOut[d], CL_FALSE,
+              offsets[d]*4*sizeof(float),
+              (offsets[d+1]-offsets[d])*4*sizeof(float),
+              h_positions.data() + offsets[d]*4, NULL,
+              profiler.event("read slice"));
+          }
+          for (unsigned d = 0; d < numDevices; d++)
+            queues[d].queue.finish();
 
+          if (i + 1 < iterations)
+          {
+            for (unsigned d = 0; d < numDevices; d++)
+            {
+              for (unsigned s = 0; s < numDevices; s++)
+              {
+                if (s == d || offsets[s+1] == offsets[s])
+                  continue;
+                queues[d].queue.enqueueWriteBuffer(d_positionsOut[d], CL_FALSE,
+                  offsets[s]*4*sizeof(float),
+                  (offsets[s+1]-offsets[s])*4*sizeof(float),
+                  h_positions.data() + offsets[s]*4, NULL,
+                  profiler.event("write slice"));
+              }
+            }
+            // h_positions is overwritten by the next gather
+            for (unsigned d = 0; d < numDevices; d++)
+              queues[d].queue.finish();
+          }
+        }
 
-    // Run reference code
-    std::cout << "Running reference..." << std::endl;
-    startTime = timer.getTimeMicroseconds();
-    std::vector<float> h_reference(4*numBodies);
-    runReference(h_initialPositions, h_initialVelocities, h_reference);
-    endTime = timer.getTimeMicroseconds();
-    std::cout << "Reference took " << ((endTime-startTime)*1e-3) << "ms"
-              << std::endl << std::endl;
+        // Swap position buffers
+        d_positionsIn.swap(d_positionsOut);
+      }
 
+      // Read final positions (already gathered when using several devices)
+      if (numDevices == 1)
+      {
+        queue.enqueueReadBuffer(d_positionsIn[0], CL_TRUE, 0,
+                                h_positions.size()*sizeof(float),
+                                h_positions.data(), NULL,
+                                profiler.event("read positions"));
+      }
+    }, barnesHut ? iterations*(double)numBodies*1e-6 : interactions*1e-9,
+       barnesHut ? "MBody-steps/s" : "GInteractions/s",
+    [&]()
+    {
+      // Reset to initial conditions
+      for (unsigned d = 0; d < numDevices; d++)
+      {
+        queues[d].queue.enqueueWriteBuffer(d_positions0[d], CL_FALSE, 0,
+                                 h_initialPositions.size()*sizeof(float),
+                                 h_initialPositions.data(), NULL,
+                                 profiler.event("write positions"));
+        queues[d].queue.enqueueWriteBuffer(d_velocities[d], CL_FALSE, 0,
+                                 h_initialVelocities.size()*sizeof(float),
+                                 h_initialVelocities.data(), NULL,
+                                 profiler.event("write velocities"));
+      }
+      for (unsigned d = 0; d < numDevices; d++)
+        queues[d].queue.finish();
+      d_positionsIn  = d_positions0;
+      d_positionsOut = d_positions1;
+    });
 
-    // Verify final positions
-    unsigned errors = 0;
-    for (unsigned i = 0; i < numBodies; i++)
+    std::cout << std::setprecision(2) << std::fixed;
+    std::cout << "OpenCL took " << (result.stats.median*1e3) << "ms"
+              << " (median of " << result.stats.count << ")" << std::endl;
+
+    if (barnesHut)
+    {
+      std::cout << result.throughput()
+                << " million body updates/second" << std::endl;
+    }
+    else
+    {
+      std::cout << result.throughput()
+                << " billion interactions/second" << std::endl;
+    }
+
+    // Final velocities, from the slice each device updated, for the
+    // energy drift (which costs O(N^2) on the host, too much for runs
+    // large enough to need Barnes-Hut)
+    std::vector<float> h_velocities(4*numBodies);
+    for (unsigned d = 0; d < numDevices && !barnesHut; d++)
     {
-      float ix = h_positions[i*4 + 0];
-      float iy = h_positions[i*4 + 1];
-      float iz = h_positions[i*4 + 2];
+      if (offsets[d+1] == offsets[d])
+        continue;
+      queues[d].queue.enqueueReadBuffer(d_velocities[d], CL_TRUE,
+        offsets[d]*4*sizeof(float), (offsets[d+1]-offsets[d])*4*sizeof(float),
+        h_velocities.data() + offsets[d]*4);
+    }
 
-      float rx = h_reference[i*4 + 0];
-      float ry = h_reference[i*4 + 1];
-      float rz = h_reference[i*4 + 2];
+    // Per-step kernel time, separated from enqueue and transfer overheads
+    if (profile && numDevices == 1 && !barnesHut && !fused &&
+        integrator == EULER)
+    {
+      // Only the events of the measured repetitions, not those of the
+      // warmup or tuning runs before them
+      std::vector<double> durations = profiler.durations("nbody");
+      size_t measured = std::min(durations.size(),
+                                 (size_t)iterations*benchOptions.repetitions);
+      durations.erase(durations.begin(), durations.end() - measured);
+      bench.record("nbody kernel", durations,
+                   (double)numBodies*numBodies*1e-9, "GInteractions/s");
+    }
 
-      float dx    = (rx-ix);
-      float dy    = (ry-iy);
-      float dz    = (rz-iz);
-      float dist  = sqrt(dx*dx + dy*dy + dz*dz);
+    // The same simulation with planes of x, y, z and mass instead of
+    // float4 bodies, on the first device
+    util::pinned_vector<float> h_positionsSoA(soaLayout ? 4*numBodies : 0,
+                                              0, alloc);
+    if (soaLayout)
+    {
+      cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl_uint>
+        soaKernel(programs[0], "nbody_soa");
+
+      util::pinned_vector<float> h_initialPlanes(4*numBodies, 0, alloc);
+      util::pinned_vector<float> h_initialVelocityPlanes(3*numBodies, 0, alloc);
+      util::pinned_vector<float> h_planes(4*numBodies, 0, alloc);
+      toPlanes(h_initialPositions.data(), h_initialPlanes.data(), 4);
+      toPlanes(h_initialVelocities.data(), h_initialVelocityPlanes.data(), 3);
 
-      if (dist > tolerance || (dist!=dist))
+      cl::Buffer d_planes0(context, CL_MEM_READ_WRITE, 4*numBodies*sizeof(float));
+      cl::Buffer d_planes1(context, CL_MEM_READ_WRITE, 4*numBodies*sizeof(float));
+      cl::Buffer d_velocityPlanes(context, CL_MEM_READ_WRITE,
+                                  3*numBodies*sizeof(float));
+      cl::Buffer d_planesIn, d_planesOut;
+
+      util::BenchmarkResult soaResult = bench.run("nbody soa", [&]()
       {
-        if (!errors)
+        util::Trace::Region region(trace, "simulation soa");
+        for (unsigned i = 0; i < iterations; i++)
         {
-          std::cout << "Verification failed:" << std::endl;
+          profiler.record("nbody soa",
+            soaKernel(cl::EnqueueArgs(queue, cl::NDRange(numBodies), local),
+                      d_planesIn, d_planesOut, d_velocityPlanes, numBodies));
+          std::swap(d_planesIn, d_planesOut);
         }
+        queue.enqueueReadBuffer(d_planesIn, CL_TRUE, 0,
+                                h_planes.size()*sizeof(float),
+                                h_planes.data(), NULL,
+                                profiler.event("read positions"));
+      }, interactions*1e-9, "GInteractions/s",
+      [&]()
+      {
+        queue.enqueueWriteBuffer(d_planes0, CL_FALSE, 0,
+                                 h_initialPlanes.size()*sizeof(float),
+                                 h_initialPlanes.data(), NULL,
+                                 profiler.event("write positions"));
+        queue.enqueueWriteBuffer(d_velocityPlanes, CL_FALSE, 0,
+                                 h_initialVelocityPlanes.size()*sizeof(float),
+                                 h_initialVelocityPlanes.data(), NULL,
+                                 profiler.event("write velocities"));
+        queue.finish();
+        d_planesIn  = d_planes0;
+        d_planesOut = d_planes1;
+      });
 
-        // Only show the first 8 errors
-        if (errors++ < 8)
-        {
-          std::cout << "-> Position error at " << i << ": " << dist << std::endl;
-        }
-      }
+      fromPlanes(h_planes.data(), h_positionsSoA.data(), 4);
+
+      std::cout << "SoA took " << (soaResult.stats.median*1e3) << "ms, "
+                << soaResult.throughput() << " billion interactions/second ("
+                << soaResult.throughput()/result.throughput() << "x AoS)"
+                << std::endl;
     }
-    if (errors)
+
+    bench.report();
+    if (profile)
+      profiler.report();
+
+    std::cout << std::endl;
+
+
+    // Run reference code: the all-pairs kernel for Barnes-Hut, which
+    // is too large to check on the host
+    std::cout << "Running reference..." << std::endl;
+    startTime = timer.getTimeMicroseconds();
+    std::vector<float> h_reference(4*numBodies);
+    std::vector<float> h_referenceVelocities(4*numBodies);
+    if (barnesHut)
     {
-      std::cout << "Total errors: " << errors << std::endl;
+      util::Trace::Region region(trace, "runReference");
+      queue.enqueueWriteBuffer(d_positions0[0], CL_FALSE, 0,
+                               h_initialPositions.size()*sizeof(float),
+                               h_initialPositions.data());
+      queue.enqueueWriteBuffer(d_velocities[0], CL_FALSE, 0,
+                               h_initialVelocities.size()*sizeof(float),
+                               h_initialVelocities.data());
+      cl::Buffer in = d_positions0[0], out = d_positions1[0];
+      for (unsigned i = 0; i < iterations; i++)
+      {
+        nbodyKernels[0](cl::EnqueueArgs(queue, cl::NDRange(numBodies/ipt), local),
+                        in, out, d_velocities[0], numBodies);
+        std::swap(in, out);
+      }
+      queue.enqueueReadBuffer(in, CL_TRUE, 0, h_reference.size()*sizeof(float),
+                              h_reference.data());
     }
     else
     {
-      std::cout << "Verification passed." << std::endl;
+      util::Trace::Region region(trace, "runReference");
+      runReference(h_initialPositions, h_initialVelocities,
+                   h_reference, h_referenceVelocities);
+    }
+    endTime = timer.getTimeMicroseconds();
+    std::cout << "Reference took " << ((endTime-startTime)*1e-3) << "ms"
+              << std::endl << std::endl;
+
+    // Relative change in the total energy over the run
+    if (!barnesHut)
+    {
+      double initial = totalEnergy(h_initialPositions.data(),
+                                   h_initialVelocities.data());
+      double device  = totalEnergy(h_positions.data(), h_velocities.data());
+      double host    = totalEnergy(h_reference.data(),
+                                   h_referenceVelocities.data());
+      std::cout << std::scientific
+                << "Energy drift (" << integratorNames[integrator] << "): "
+                << fabs((device-initial)/initial) << " (reference "
+                << fabs((host-initial)/initial) << ")"
+                << std::fixed << std::endl << std::endl;
+    }
+
+
+    // Verify final positions
+    checkPositions(h_positions.data(), h_reference);
+    if (soaLayout)
+    {
+      std::cout << "SoA layout: ";
+      checkPositions(h_positionsSoA.data(), h_reference);
     }
     std::cout << std::endl;
+
+    trace.write(profiler);
   }
   catch (cl::BuildError error)
   {
@@ -273,13 +728,9 @@ void parseArguments(int argc, char *argv[])
       }
       exit(0);
     }
-    else if (!strcmp(argv[i], "--device"))
+    else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
     {
-      if (++i >= argc || !parseUInt(argv[i], &deviceIndex))
-      {
-        std::cout << "Invalid device index" << std::endl;
-        exit(1);
-      }
+      continue;
     }
     else if (!strcmp(argv[i], "--numbodies") || !strcmp(argv[i], "-n"))
     {
@@ -320,11 +771,109 @@ void parseArguments(int argc, char *argv[])
         std::cout << "Invalid work-group size" << std::endl;
         exit(1);
       }
+      wgsizeSet = true;
+    }
+    else if (!strcmp(argv[i], "--algorithm"))
+    {
+      if (++i < argc && !strcmp(argv[i], "allpairs"))
+        barnesHut = false;
+      else if (i < argc && !strcmp(argv[i], "bh"))
+        barnesHut = true;
+      else
+      {
+        std::cout << "Invalid algorithm (allpairs or bh)" << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--theta"))
+    {
+      if (++i >= argc || !parseFloat(argv[i], &theta) || theta < 0)
+      {
+        std::cout << "Invalid opening angle" << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--layout"))
+    {
+      if (++i < argc && !strcmp(argv[i], "aos"))
+        soaLayout = false;
+      else if (i < argc && !strcmp(argv[i], "soa"))
+        soaLayout = true;
+      else
+      {
+        std::cout << "Invalid layout (aos or soa)" << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--steps-per-launch"))
+    {
+      if (++i >= argc || !parseUInt(argv[i], &stepsPerLaunch) ||
+          stepsPerLaunch == 0)
+      {
+        std::cout << "Invalid number of steps per launch" << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--integrator"))
+    {
+      if (++i < argc && !strcmp(argv[i], "euler"))
+        integrator = EULER;
+      else if (i < argc && !strcmp(argv[i], "leapfrog"))
+        integrator = LEAPFROG;
+      else if (i < argc && !strcmp(argv[i], "yoshida4"))
+        integrator = YOSHIDA4;
+      else
+      {
+        std::cout << "Invalid integrator (euler, leapfrog or yoshida4)"
+                  << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--ipt"))
+    {
+      if (++i >= argc || !parseUInt(argv[i], &ipt) || ipt == 0)
+      {
+        std::cout << "Invalid number of bodies per work-item" << std::endl;
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "--unroll"))
+    {
+      if (++i >= argc || !parseUInt(argv[i], &unroll) || unroll == 0)
+      {
+        std::cout << "Invalid unroll factor" << std::endl;
+        exit(1);
+      }
     }
     else if (!strcmp(argv[i], "--local"))
     {
       useLocal = true;
     }
+    else if (!strcmp(argv[i], "--pageable"))
+    {
+      pageable = true;
+    }
+    else if (!strcmp(argv[i], "--tune"))
+    {
+      tune = true;
+    }
+    else if (!strcmp(argv[i], "--profile"))
+    {
+      profile = true;
+    }
+    else if (!strcmp(argv[i], "--trace"))
+    {
+      if (++i >= argc)
+      {
+        std::cout << "Missing argument to --trace" << std::endl;
+        exit(1);
+      }
+      traceFile = argv[i];
+    }
+    else if (util::parseBenchmarkArgument(argc, argv, i, benchOptions))
+    {
+      continue;
+    }
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
     {
       std::cout << std::endl;
@@ -332,13 +881,25 @@ void parseArguments(int argc, char *argv[])
       std::cout << "Options:" << std::endl;
       std::cout << "  -h  --help               Print the message" << std::endl;
       std::cout << "      --list               List available devices" << std::endl;
-      std::cout << "      --device     INDEX   Select device at INDEX" << std::endl;
+      printDeviceUsage();
       std::cout << "  -n  --numbodies  N       Run simulation with N bodies" << std::endl;
       std::cout << "  -d  --delta      DELTA   Time difference between iterations" << std::endl;
       std::cout << "  -s  --softening  SOFT    Force softening factor" << std::endl;
       std::cout << "  -i  --iterations ITRS    Run simulation for ITRS iterations" << std::endl;
+      std::cout << "      --algorithm  ALG     allpairs (default) or bh (Barnes-Hut)" << std::endl;
+      std::cout << "      --theta      THETA   Barnes-Hut opening angle (default 0.5)" << std::endl;
+      std::cout << "      --integrator INT     euler (default), leapfrog or yoshida4" << std::endl;
+      std::cout << "      --layout     LAYOUT  aos (default) or soa (also run the SoA kernel)" << std::endl;
+      std::cout << "      --steps-per-launch S Advance S steps per launch or batch of launches" << std::endl;
       std::cout << "      --local              Enable use of local memory" << std::endl;
       std::cout << "      --wgsize     WGSIZE  Set work-group size to WGSIZE" << std::endl;
+      std::cout << "      --ipt        IPT     Update IPT bodies per work-item" << std::endl;
+      std::cout << "      --unroll     UNROLL  Unroll the inner loop UNROLL times" << std::endl;
+      std::cout << "      --pageable           Use pageable instead of pinned host memory" << std::endl;
+      std::cout << "      --tune               Search for the best work-group size" << std::endl;
+      std::cout << "      --profile            Report per-command event timings" << std::endl;
+      std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE" << std::endl;
+      util::printBenchmarkUsage();
       std::cout << std::endl;
       exit(0);
     }
@@ -351,25 +912,75 @@ void parseArguments(int argc, char *argv[])
   }
 }
 
-void runReference(const std::vector<float>& initialPositions,
-                  const std::vector<float>& initialVelocities,
-                        std::vector<float>& finalPositions)
+// The order of kicks and drifts over the whole run, with the last kick
+// of each step merged into the first of the next
+std::vector<StepOp> buildSchedule()
 {
-  std::vector<float> positions0 = initialPositions;
-  std::vector<float> positions1(4*numBodies);
-  std::vector<float> velocities = initialVelocities;
-
-  std::vector<float>& positionsIn = positions0;
-  std::vector<float>& positionsOut = positions1;
+  std::vector<StepOp> step;
+  if (integrator == EULER)
+  {
+    step = { {true, 1.f}, {false, 1.f} };
+  }
+  else if (integrator == LEAPFROG)
+  {
+    step = { {true, 0.5f}, {false, 1.f}, {true, 0.5f} };
+  }
+  else
+  {
+    // Leapfrogs of w1, w0 and w1 times delta
+    double w1 = 1.0 / (2.0 - cbrt(2.0));
+    double w0 = 1.0 - 2.0*w1;
+    step = { {true,  (float)(w1/2)},      {false, (float)w1},
+             {true,  (float)((w1+w0)/2)}, {false, (float)w0},
+             {true,  (float)((w0+w1)/2)}, {false, (float)w1},
+             {true,  (float)(w1/2)} };
+  }
 
+  std::vector<StepOp> schedule;
   for (unsigned itr = 0; itr < iterations; itr++)
   {
+    for (unsigned o = 0; o < step.size(); o++)
+    {
+      if (step[o].kick && !schedule.empty() && schedule.back().kick)
+        schedule.back().fraction += step[o].fraction;
+      else
+        schedule.push_back(step[o]);
+    }
+  }
+  return schedule;
+}
+
+void runReference(const util::pinned_vector<float>& initialPositions,
+                  const util::pinned_vector<float>& initialVelocities,
+                        std::vector<float>& finalPositions,
+                        std::vector<float>& finalVelocities)
+{
+  std::vector<float> positions(initialPositions.begin(), initialPositions.end());
+  std::vector<float> velocities(initialVelocities.begin(), initialVelocities.end());
+
+  // The schedule of the device, every kick computing the forces from the
+  // positions before it
+  std::vector<StepOp> schedule = buildSchedule();
+  for (unsigned o = 0; o < schedule.size(); o++)
+  {
+    float scale = schedule[o].fraction * delta;
+    if (!schedule[o].kick)
+    {
+      // Update positions
+      for (unsigned i = 0; i < numBodies; i++)
+      {
+        positions[i*4 + 0] += velocities[i*4 + 0] * scale;
+        positions[i*4 + 1] += velocities[i*4 + 1] * scale;
+        positions[i*4 + 2] += velocities[i*4 + 2] * scale;
+      }
+      continue;
+    }
+
     for (unsigned i = 0; i < numBodies; i++)
     {
-      float ix = positionsIn[i*4 + 0];
-      float iy = positionsIn[i*4 + 1];
-      float iz = positionsIn[i*4 + 2];
-      float iw = positionsIn[i*4 + 3];
+      float ix = positions[i*4 + 0];
+      float iy = positions[i*4 + 1];
+      float iz = positions[i*4 + 2];
 
       float fx = 0.f;
       float fy = 0.f;
@@ -377,10 +988,10 @@ void runReference(const std::vector<float>& initialPositions,
 
       for (unsigned j = 0; j < numBodies; j++)
       {
-        float jx    = positionsIn[j*4 + 0];
-        float jy    = positionsIn[j*4 + 1];
-        float jz    = positionsIn[j*4 + 2];
-        float jw    = positionsIn[j*4 + 3];
+        float jx    = positions[j*4 + 0];
+        float jy    = positions[j*4 + 1];
+        float jz    = positions[j*4 + 2];
+        float jw    = positions[j*4 + 3];
 
         // Compute distance between bodies
         float dx    = (jx-ix);
@@ -397,25 +1008,103 @@ void runReference(const std::vector<float>& initialPositions,
       }
 
       // Update velocity
-      float vx            = velocities[i*4 + 0] + fx * delta;
-      float vy            = velocities[i*4 + 1] + fy * delta;
-      float vz            = velocities[i*4 + 2] + fz * delta;
-      velocities[i*4 + 0] = vx;
-      velocities[i*4 + 1] = vy;
-      velocities[i*4 + 2] = vz;
-
-      // Update position
-      positionsOut[i*4 + 0] = ix + vx * delta;
-      positionsOut[i*4 + 1] = iy + vy * delta;
-      positionsOut[i*4 + 2] = iz + vz * delta;
-      positionsOut[i*4 + 3] = iw;
-    }
-
-    // Swap buffers
-    std::vector<float>& temp  = positionsIn;
-    positionsIn  = positionsOut;
-    positionsOut = temp;
+      velocities[i*4 + 0] += fx * scale;
+      velocities[i*4 + 1] += fy * scale;
+      velocities[i*4 + 2] += fz * scale;
+    }
   }
 
-  finalPositions = positionsIn;
+  finalPositions  = positions;
+  finalVelocities = velocities;
+}
+
+// Kinetic plus potential energy, with the potential of the softened
+// force: -m_i m_j / sqrt(r^2 + softening^2) for each pair
+double totalEnergy(const float *positions, const float *velocities)
+{
+  double energy = 0.0;
+  for (unsigned i = 0; i < numBodies; i++)
+  {
+    double m  = positions[i*4 + 3];
+    double vx = velocities[i*4 + 0];
+    double vy = velocities[i*4 + 1];
+    double vz = velocities[i*4 + 2];
+    energy += 0.5 * m * (vx*vx + vy*vy + vz*vz);
+
+    for (unsigned j = i + 1; j < numBodies; j++)
+    {
+      double dx = positions[j*4 + 0] - positions[i*4 + 0];
+      double dy = positions[j*4 + 1] - positions[i*4 + 1];
+      double dz = positions[j*4 + 2] - positions[i*4 + 2];
+      energy -= m * positions[j*4 + 3] /
+                sqrt(dx*dx + dy*dy + dz*dz + (double)softening*softening);
+    }
+  }
+  return energy;
+}
+
+void toPlanes(const float *bodies, float *planes, unsigned components)
+{
+  for (unsigned c = 0; c < components; c++)
+  {
+    for (unsigned i = 0; i < numBodies; i++)
+    {
+      planes[c*numBodies + i] = bodies[i*4 + c];
+    }
+  }
+}
+
+void fromPlanes(const float *planes, float *bodies, unsigned components)
+{
+  for (unsigned c = 0; c < components; c++)
+  {
+    for (unsigned i = 0; i < numBodies; i++)
+    {
+      bodies[i*4 + c] = planes[c*numBodies + i];
+    }
+  }
+}
+
+unsigned checkPositions(const float *positions,
+                        const std::vector<float>& reference)
+{
+  unsigned errors = 0;
+  for (unsigned i = 0; i < numBodies; i++)
+  {
+    float ix = positions[i*4 + 0];
+    float iy = positions[i*4 + 1];
+    float iz = positions[i*4 + 2];
+
+    float rx = reference[i*4 + 0];
+    float ry = reference[i*4 + 1];
+    float rz = reference[i*4 + 2];
+
+    float dx    = (rx-ix);
+    float dy    = (ry-iy);
+    float dz    = (rz-iz);
+    float dist  = sqrt(dx*dx + dy*dy + dz*dz);
+
+    if (dist > tolerance || (dist!=dist))
+    {
+      if (!errors)
+      {
+        std::cout << "Verification failed:" << std::endl;
+      }
+
+      // Only show the first 8 errors
+      if (errors++ < 8)
+      {
+        std::cout << "-> Position error at " << i << ": " << dist << std::endl;
+      }
+    }
+  }
+  if (errors)
+  {
+    std::cout << "Total errors: " << errors << std::endl;
+  }
+  else
+  {
+    std::cout << "Verification passed." << std::endl;
+  }
+  return errors;
 }
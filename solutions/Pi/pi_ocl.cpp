@@ -14,6 +14,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -27,10 +28,19 @@
 
 #include <device_picker.hpp>
 #include <util.hpp>
+#include <autotune.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
 
 #define INSTEPS (512*512*512)
 #define ITERS (262144)
 
+void parseArguments(int argc, char *argv[]);
+
+cl_uint deviceIndex = 0;
+bool    tune        = false;   // search for the best work group size
+std::string traceFile;
+
 int main(int argc, char *argv[])
 {
     int in_nsteps = INSTEPS;		// default number of steps (updated later to device prefereable)
@@ -45,8 +55,9 @@ int main(int argc, char *argv[])
 
     try
     {
-        cl_uint deviceIndex = 0;
-        parseArguments(argc, argv, &deviceIndex);
+        parseArguments(argc, argv);
+
+        util::Trace trace(traceFile);
 
         // Get list of devices
         std::vector<cl::Device> devices;
@@ -67,10 +78,15 @@ int main(int argc, char *argv[])
         std::vector<cl::Device> chosen_device;
         chosen_device.push_back(device);
         cl::Context context(chosen_device);
-        cl::CommandQueue queue(context, device);
+        util::Profiler profiler(tune || trace.enabled());
+        cl::CommandQueue queue = profiler.createQueue(context, device);
 
         // Create the program object
-        cl::Program program(context, util::loadProgram("pi_ocl.cl"), true);
+        cl::Program program;
+        {
+            util::Trace::Region region(trace, "buildProgram");
+            program = util::buildProgram(context, util::loadProgram("pi_ocl.cl"));
+        }
 
         cl::KernelFunctor<int, float, cl::LocalSpaceArg, cl::Buffer> pi(program, "pi");
 
@@ -81,6 +97,37 @@ int main(int argc, char *argv[])
         work_group_size = ko_pi.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
         //printf("wgroup_size = %lu\n", work_group_size);
 
+        // Use the tuned work group size if there is one
+        ::size_t max_work_group_size = work_group_size;
+        std::stringstream problem;
+        problem << "steps=" << in_nsteps << ",iters=" << niters;
+        util::Tuner tuner(device, "pi", problem.str());
+        tuner.addParameter("WGSIZE", {8, 16, 32, 64, 128, 256, 512, 1024},
+                           util::Tuner::LOCAL_SIZE);
+        tuner.addConstraint([&](const util::TuningConfig& c)
+        {
+            return c.at("WGSIZE") <= max_work_group_size &&
+                   in_nsteps / (c.at("WGSIZE")*niters) >= 1;
+        });
+        util::TuningConfig defaults;
+        defaults["WGSIZE"] = work_group_size;
+        work_group_size = tuner.select(tune, defaults,
+            [&](const util::TuningConfig& c)
+            {
+                ::size_t wg_size = c.at("WGSIZE");
+                ::size_t groups  = in_nsteps/(wg_size*niters);
+                cl::Buffer sums(context, CL_MEM_WRITE_ONLY, sizeof(float) * groups);
+                return pi(
+                    cl::EnqueueArgs(
+                            queue,
+                            cl::NDRange(groups * wg_size),
+                            cl::NDRange(wg_size)),
+                            niters,
+                            1.0f/static_cast<float>(groups * wg_size * niters),
+                            cl::Local(sizeof(float) * wg_size),
+                            sums);
+            }).at("WGSIZE");
+
         // Now that we know the size of the work_groups, we can set the number of work
         // groups, the actual number of steps, and the step size
         nwork_groups = in_nsteps/(work_group_size*niters);
@@ -106,7 +153,7 @@ int main(int argc, char *argv[])
 
         // Execute the kernel over the entire range of our 1d input data set
         // using the maximum number of work group items for this device
-        pi(
+        profiler.record("pi", pi(
             cl::EnqueueArgs(
                     queue,
                     cl::NDRange(nsteps / niters),
@@ -114,22 +161,29 @@ int main(int argc, char *argv[])
                     niters,
                     step_size,
                     cl::Local(sizeof(float) * work_group_size),
-                    d_partial_sums);
+                    d_partial_sums));
 
-        cl::copy(queue, d_partial_sums, h_psum.begin(), h_psum.end());
+        queue.enqueueReadBuffer(d_partial_sums, CL_TRUE, 0,
+                                sizeof(float) * nwork_groups, h_psum.data(),
+                                NULL, profiler.event("read sums"));
 
         // complete the sum and compute final integral value
-        pi_res = 0.0f;
-        for (unsigned int i = 0; i< nwork_groups; i++) {
-                pi_res += h_psum[i];
+        {
+            util::Trace::Region region(trace, "sum");
+            pi_res = 0.0f;
+            for (unsigned int i = 0; i< nwork_groups; i++) {
+                    pi_res += h_psum[i];
+            }
+            pi_res = pi_res * step_size;
         }
-        pi_res = pi_res * step_size;
 
         //rtime = wtime() - rtime;
         double rtime = static_cast<double>(timer.getTimeMilliseconds()) / 1000.;
         printf("\nThe calculation ran in %lf seconds\n", rtime);
         printf(" pi = %f for %d steps\n", pi_res, nsteps);
 
+        trace.write(profiler);
+
     }
     catch (cl::BuildError error)
     {
@@ -153,3 +207,66 @@ int main(int argc, char *argv[])
 
 }
 
+void parseArguments(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--list"))
+        {
+            // Get list of devices
+            std::vector<cl::Device> devices;
+            unsigned numDevices = getDeviceList(devices);
+
+            // Print device names
+            if (numDevices == 0)
+            {
+                std::cout << "No devices found.\n";
+            }
+            else
+            {
+                std::cout << "\nDevices:\n";
+                for (unsigned int i = 0; i < numDevices; i++)
+                {
+                    std::cout << i << ": " << getDeviceName(devices[i]) << "\n";
+                }
+                std::cout << "\n";
+            }
+            exit(0);
+        }
+        else if (parseDeviceArgument(argc, argv, i, &deviceIndex))
+        {
+            continue;
+        }
+        else if (!strcmp(argv[i], "--tune"))
+        {
+            tune = true;
+        }
+        else if (!strcmp(argv[i], "--trace"))
+        {
+            if (++i >= argc)
+            {
+                std::cout << "Missing argument to --trace\n";
+                exit(1);
+            }
+            traceFile = argv[i];
+        }
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+        {
+            std::cout << "\n";
+            std::cout << "Usage: ./pi_ocl [OPTIONS]\n\n";
+            std::cout << "Options:\n";
+            std::cout << "  -h  --help               Print the message\n";
+            std::cout << "      --list               List available devices\n";
+            printDeviceUsage();
+            std::cout << "      --tune               Search for the best work group size\n";
+            std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE\n";
+            std::cout << "\n";
+            exit(0);
+        }
+        else
+        {
+            std::cout << "Unrecognized argument '" << argv[i] << "' (try '--help')\n";
+            exit(1);
+        }
+    }
+}
@@ -29,6 +29,7 @@
 #endif
 
 #include "err_code.h"
+#include "util.h"
 
 //pick up device type from compiler command line or from
 //the default type
@@ -154,12 +155,8 @@ int main(int argc, char** argv)
     commands = clCreateCommandQueue(context, device_id, 0, &err);
     checkError(err, "Creating command queue");
 
-    // Create the compute program from the source buffer
-    program = clCreateProgramWithSource(context, 1, (const char **) & KernelSource, NULL, &err);
-    checkError(err, "Creating program");
-
-    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    // Build the compute program from the source buffer
+    program = buildProgram(context, device_id, KernelSource, NULL, &err);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -32,6 +32,8 @@
 #include <CL/cl2.hpp>
 
 #include <util.hpp>
+#include <profiler.hpp>
+#include <trace.hpp>
 
 
 // pick up device type from compiler command line or from the default type
@@ -46,8 +48,15 @@
 #define TOL    (0.001)   // tolerance used in floating point comparisons
 #define LENGTH (1024)    // length of vectors a, b, and c
 
-int main(void)
+void parseArguments(int argc, char *argv[]);
+
+std::string traceFile;
+
+int main(int argc, char *argv[])
 {
+    parseArguments(argc, argv);
+
+
     std::vector<float> h_a(LENGTH);                     // a vector
     std::vector<float> h_b(LENGTH);                     // b vector
     std::vector<float> h_c(LENGTH);                     // c vector
@@ -77,6 +86,8 @@ int main(void)
 
     try
     {
+        util::Trace trace(traceFile);
+
     	// Create a context
         cl::Context context(DEVICE);
 
@@ -85,10 +96,15 @@ int main(void)
                   << device.getInfo<CL_DEVICE_NAME>() << std::endl;
 
         // Load in kernel source, creating a program object for the context
-        cl::Program program(context, util::loadProgram("vadd_chain.cl"), true);
+        cl::Program program;
+        {
+            util::Trace::Region region(trace, "buildProgram");
+            program = util::buildProgram(context, util::loadProgram("vadd_chain.cl"));
+        }
 
         // Get the command queue
-        cl::CommandQueue queue(context);
+        util::Profiler profiler(trace.enabled());
+        cl::CommandQueue queue = profiler.createQueue(context, device);
 
         // Create the kernel functor
 
@@ -103,7 +119,7 @@ int main(void)
         d_d  = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * LENGTH);
         d_g  = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * LENGTH);
 
-        vadd(
+        profiler.record("vadd d", vadd(
             cl::EnqueueArgs(
                 queue,
                 cl::NDRange(count)),
@@ -111,9 +127,9 @@ int main(void)
             d_b,
             d_c,
             d_d,
-            count);
+            count));
 
-        vadd(
+        profiler.record("vadd g", vadd(
             cl::EnqueueArgs(
                 queue,
                 cl::NDRange(count)),
@@ -121,27 +137,33 @@ int main(void)
             d_e,
             d_f,
             d_g,
-            count);
+            count));
 
-        cl::copy(queue, d_g, h_g.begin(), h_g.end());
+        queue.enqueueReadBuffer(d_g, CL_TRUE, 0, sizeof(float) * LENGTH,
+                                h_g.data(), NULL, profiler.event("read g"));
 
         // Test the results
         int correct = 0;
         float tmp;
-        for(int i = 0; i < count; i++)
         {
-            tmp = h_a[i] + h_b[i] + h_c[i] + h_e[i] + h_f[i]; // assign element i of a+b+c+e+f to tmp
-            tmp -= h_g[i];                                    // compute deviation of expected and output result
-            if(tmp*tmp < TOL*TOL)                             // correct if square deviation is less than tolerance squared
-                correct++;
-            else {
-                printf(" tmp %f h_a %f h_b %f h_c %f h_e %f h_f %f h_g %f\n",tmp, h_a[i], h_b[i], h_c[i], h_e[i], h_f[i], h_g[i]);
+            util::Trace::Region region(trace, "check");
+            for(int i = 0; i < count; i++)
+            {
+                tmp = h_a[i] + h_b[i] + h_c[i] + h_e[i] + h_f[i]; // assign element i of a+b+c+e+f to tmp
+                tmp -= h_g[i];                                    // compute deviation of expected and output result
+                if(tmp*tmp < TOL*TOL)                             // correct if square deviation is less than tolerance squared
+                    correct++;
+                else {
+                    printf(" tmp %f h_a %f h_b %f h_c %f h_e %f h_f %f h_g %f\n",tmp, h_a[i], h_b[i], h_c[i], h_e[i], h_f[i], h_g[i]);
+                }
             }
         }
 
         // summarize results
         printf("G = A+B+C+E+F:  %d out of %d results were correct.\n", correct, count);
 
+        trace.write(profiler);
+
     }
     catch (cl::BuildError error)
     {
@@ -163,3 +185,34 @@ int main(void)
     system("pause");
 #endif
 }
+
+void parseArguments(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--trace"))
+        {
+            if (++i >= argc)
+            {
+                std::cout << "Missing argument to --trace\n";
+                exit(1);
+            }
+            traceFile = argv[i];
+        }
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+        {
+            std::cout << "\n";
+            std::cout << "Usage: ./vadd_chain [OPTIONS]\n\n";
+            std::cout << "Options:\n";
+            std::cout << "  -h  --help               Print the message\n";
+            std::cout << "      --trace      FILE    Write a Chrome trace of the run to FILE\n";
+            std::cout << "\n";
+            exit(0);
+        }
+        else
+        {
+            std::cout << "Unrecognized argument '" << argv[i] << "' (try '--help')\n";
+            exit(1);
+        }
+    }
+}